@@ -0,0 +1,785 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <dirent.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "panaroia/panaroia.h"
+
+#define DEFAULT_MICRO_CYCLES 2000000
+#define DEFAULT_FRAMES 20000
+#define DEFAULT_MACHINES 64
+
+// times each micro benchmark body is repeated before jumping back
+#define MICRO_REPEAT 32
+
+// marks a call to the subroutine placed after the micro benchmark loop
+#define MICRO_CALL 0x2000
+
+// every key is held for this many frames in the rom benchmarks
+#define KEY_FRAMES 30
+
+#define MAX_ROMS 256
+
+// saves and loads timed together in the state benchmarks
+#define STATE_REPEAT 8
+
+// frames of every session in the reset benchmarks
+#define EPISODE_FRAMES 10
+
+// a loop of the same instruction, after some setup instructions
+typedef struct {
+    const char *name;
+    unsigned short setup[4];
+    unsigned short body;
+} micro_t;
+
+static const micro_t micros[] = {
+    { "6XKK",      { 0 },                      0x6A12 },
+    { "7XKK",      { 0 },                      0x7A01 },
+    { "3XKK",      { 0 },                      0x3A12 },
+    { "ANNN",      { 0 },                      0xA123 },
+    { "8XY0",      { 0x6005, 0x6107 },         0x8010 },
+    { "8XY1",      { 0x6005, 0x6107 },         0x8011 },
+    { "8XY2",      { 0x6005, 0x6107 },         0x8012 },
+    { "8XY3",      { 0x6005, 0x6107 },         0x8013 },
+    { "8XY4",      { 0x6005, 0x6107 },         0x8014 },
+    { "8XY5",      { 0x6005, 0x6107 },         0x8015 },
+    { "8XY6",      { 0x6005, 0x6107 },         0x8016 },
+    { "8XY7",      { 0x6005, 0x6107 },         0x8017 },
+    { "8XYE",      { 0x6005, 0x6107 },         0x801E },
+    { "FX1E",      { 0x6001 },                 0xF01E },
+    { "FX33",      { 0xA400, 0x607B },         0xF033 },
+    { "FX55",      { 0xA400 },                 0xFF55 },
+    { "FX65",      { 0xA400 },                 0xFF65 },
+    { "00E0",      { 0 },                      0x00E0 },
+    { "DXY5",      { 0xA000, 0x600A, 0x6105 }, 0xD015 },
+    { "DXYF-edge", { 0xA000, 0x603C, 0x6105 }, 0xD01F },
+    { "2NNN-00EE", { 0 },                      MICRO_CALL },
+};
+
+#define MICRO_COUNT (sizeof(micros) / sizeof(micros[0]))
+
+typedef struct {
+    char *name;
+    long instructions;
+    long frames;
+    double seconds;
+} result_t;
+
+typedef struct {
+    char *name;
+    long states;
+    long bytes;
+    double saveSeconds;
+    double loadSeconds;
+} state_result_t;
+
+typedef struct {
+    char *name;
+    long resets;
+    double loadSeconds;
+    double restartSeconds;
+} reset_result_t;
+
+static double now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int compare_names(const void *a, const void *b)
+{
+    return strcmp(*(const char **)a, *(const char **)b);
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr,
+            "usage: %s [options] [roms directory]\n"
+            "  -b backend   table, threaded or jit, default is the one built in\n"
+            "  -s suite     micro, roms, batch, state, reset or all, default all\n"
+            "  -m cycles    cycles per micro benchmark, default %d\n"
+            "  -n frames    frames per rom, default %d\n"
+            "  -c cycles    instructions per frame, default %d\n"
+            "  -w machines  machines per batch, default %d\n"
+            "  -j           print the results as json\n",
+            name, DEFAULT_MICRO_CYCLES, DEFAULT_FRAMES, PNRIA_CYCLES_PER_FRAME, DEFAULT_MACHINES);
+}
+
+// loads the micro benchmark program through a temporary file
+static bool load_micro(pnria_ctx_t *ctx, const micro_t *micro)
+{
+    unsigned short program[4 + MICRO_REPEAT + 2];
+    int size = 0;
+
+    for (int i = 0; i < 4 && micro->setup[i]; ++i) {
+        program[size++] = micro->setup[i];
+    }
+
+    unsigned short loop = PNRIA_START_OFFSET + size * PNRIA_OPCODE_SIZE;
+    unsigned short subroutine = loop + (MICRO_REPEAT + 1) * PNRIA_OPCODE_SIZE;
+    for (int i = 0; i < MICRO_REPEAT; ++i) {
+        program[size++] = micro->body == MICRO_CALL ? MICRO_CALL | subroutine : micro->body;
+    }
+    program[size++] = 0x1000 | loop;
+    program[size++] = 0x00EE;
+
+    unsigned char rom[sizeof(program)];
+    for (int i = 0; i < size; ++i) {
+        rom[i * 2] = program[i] >> 8;
+        rom[i * 2 + 1] = program[i] & 0xFF;
+    }
+
+    char path[] = "/tmp/panaroia-bench-XXXXXX";
+    int fd = mkstemp(path);
+    if (fd < 0) {
+        perror("Error creating micro benchmark rom");
+        return false;
+    }
+
+    bool loaded = write(fd, rom, size * 2) == size * 2;
+    close(fd);
+    loaded = loaded && pnria_ctx_load(ctx, path);
+    unlink(path);
+
+    return loaded;
+}
+
+static int run_micros(pnria_ctx_t *ctx, long cycles, result_t *results)
+{
+    int count = 0;
+
+    for (size_t i = 0; i < MICRO_COUNT; ++i) {
+        pnria_ctx_reset(ctx);
+        if (!load_micro(ctx, &micros[i])) {
+            fprintf(stderr, "Error loading micro benchmark %s\n", micros[i].name);
+            continue;
+        }
+
+        double start = now();
+        pnria_run_cycles(ctx, cycles);
+
+        results[count++] = (result_t) {
+            .name = strdup(micros[i].name),
+            .instructions = cycles,
+            .seconds = now() - start
+        };
+    }
+
+    return count;
+}
+
+// sorted names of the roms in the directory, or -1 on errors
+static int list_roms(const char *romsDir, char **names)
+{
+    DIR *dir = opendir(romsDir);
+    if (!dir) {
+        perror("Error opening roms directory");
+        return -1;
+    }
+
+    int count = 0;
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL && count < MAX_ROMS) {
+        // roms are the upper case files, skip INFO.txt and friends
+        if (entry->d_name[0] == '.' || strchr(entry->d_name, '.')) {
+            continue;
+        }
+        names[count++] = strdup(entry->d_name);
+    }
+    closedir(dir);
+
+    qsort(names, count, sizeof(char *), compare_names);
+    return count;
+}
+
+// runs every rom in the directory for a number of frames, pressing each key in
+// turn, returns the number of results or -1 on errors
+static int run_roms(pnria_ctx_t *ctx, const char *romsDir, long frames, result_t *results)
+{
+    char *names[MAX_ROMS];
+    int count = list_roms(romsDir, names);
+    if (count < 0) {
+        return -1;
+    }
+
+    int loaded = 0;
+    for (int i = 0; i < count; ++i) {
+        char path[4096];
+        snprintf(path, sizeof(path), "%s/%s", romsDir, names[i]);
+
+        pnria_ctx_reset(ctx);
+        if (!pnria_ctx_load(ctx, path)) {
+            fprintf(stderr, "Error loading %s\n", path);
+            free(names[i]);
+            continue;
+        }
+
+        char keys[PNRIA_INPUT_SIZE] = { 0 };
+        double start = now();
+        for (long frame = 0; frame < frames; ++frame) {
+            if (frame % KEY_FRAMES == 0) {
+                memset(keys, 0, sizeof(keys));
+                keys[(frame / KEY_FRAMES) % PNRIA_INPUT_SIZE] = 1;
+                pnria_ctx_set_input(ctx, keys);
+            }
+            pnria_run_frame(ctx);
+        }
+
+        results[loaded++] = (result_t) {
+            .name = names[i],
+            .instructions = frames * pnria_ctx_get_cycles_per_frame(ctx),
+            .frames = frames,
+            .seconds = now() - start
+        };
+    }
+
+    return loaded;
+}
+
+// same as run_roms on a batch of machines, each pressing a different key
+static int run_batches(const char *romsDir, long frames, int cyclesPerFrame, int machines, result_t *results)
+{
+    char *names[MAX_ROMS];
+    int count = list_roms(romsDir, names);
+    if (count < 0) {
+        return -1;
+    }
+
+    pnria_batch_t *batch = pnria_batch_create(machines);
+    if (!batch) {
+        for (int i = 0; i < count; ++i) {
+            free(names[i]);
+        }
+        return -1;
+    }
+    pnria_batch_set_cycles_per_frame(batch, cyclesPerFrame);
+    // machines diverge on random numbers too, same as separate sessions would
+    for (int m = 0; m < machines; ++m) {
+        pnria_batch_set_seed(batch, m, m);
+    }
+
+    int loaded = 0;
+    for (int i = 0; i < count; ++i) {
+        char path[4096];
+        snprintf(path, sizeof(path), "%s/%s", romsDir, names[i]);
+
+        if (!pnria_batch_load(batch, path)) {
+            fprintf(stderr, "Error loading %s\n", path);
+            free(names[i]);
+            continue;
+        }
+
+        double start = now();
+        for (long frame = 0; frame < frames; ++frame) {
+            if (frame % KEY_FRAMES == 0) {
+                for (int m = 0; m < machines; ++m) {
+                    char keys[PNRIA_INPUT_SIZE] = { 0 };
+                    keys[(frame / KEY_FRAMES + m) % PNRIA_INPUT_SIZE] = 1;
+                    pnria_batch_set_input(batch, m, keys);
+                }
+            }
+            pnria_batch_run_frame(batch);
+        }
+
+        results[loaded++] = (result_t) {
+            .name = names[i],
+            .instructions = frames * cyclesPerFrame * machines,
+            .frames = frames * machines,
+            .seconds = now() - start
+        };
+    }
+
+    pnria_batch_destroy(batch);
+    return loaded;
+}
+
+// the batch workload on as many separate contexts, each run a frame at a time
+// in turn, for comparing the batch against running the machines one by one
+static int run_contexts(pnria_ctx_t *ctx, const char *romsDir, long frames, int machines, result_t *results)
+{
+    char *names[MAX_ROMS];
+    int count = list_roms(romsDir, names);
+    if (count < 0) {
+        return -1;
+    }
+
+    pnria_ctx_t **ctxs = calloc(machines, sizeof(pnria_ctx_t *));
+    bool created = ctxs != NULL;
+    for (int m = 0; created && m < machines; ++m) {
+        created = (ctxs[m] = pnria_create()) != NULL;
+        if (created) {
+            pnria_ctx_set_backend(ctxs[m], pnria_ctx_get_backend(ctx));
+            pnria_ctx_set_cycles_per_frame(ctxs[m], pnria_ctx_get_cycles_per_frame(ctx));
+            pnria_ctx_set_seed(ctxs[m], m);
+        }
+    }
+
+    int loaded = 0;
+    for (int i = 0; created && i < count; ++i) {
+        char path[4096];
+        snprintf(path, sizeof(path), "%s/%s", romsDir, names[i]);
+
+        bool ok = true;
+        for (int m = 0; ok && m < machines; ++m) {
+            pnria_ctx_reset(ctxs[m]);
+            ok = pnria_ctx_load(ctxs[m], path);
+        }
+        if (!ok) {
+            fprintf(stderr, "Error loading %s\n", path);
+            free(names[i]);
+            continue;
+        }
+
+        double start = now();
+        for (long frame = 0; frame < frames; ++frame) {
+            if (frame % KEY_FRAMES == 0) {
+                for (int m = 0; m < machines; ++m) {
+                    char keys[PNRIA_INPUT_SIZE] = { 0 };
+                    keys[(frame / KEY_FRAMES + m) % PNRIA_INPUT_SIZE] = 1;
+                    pnria_ctx_set_input(ctxs[m], keys);
+                }
+            }
+            for (int m = 0; m < machines; ++m) {
+                pnria_run_frame(ctxs[m]);
+            }
+        }
+
+        results[loaded++] = (result_t) {
+            .name = names[i],
+            .instructions = frames * pnria_ctx_get_cycles_per_frame(ctx) * machines,
+            .frames = frames * machines,
+            .seconds = now() - start
+        };
+    }
+
+    for (int m = 0; ctxs && m < machines; ++m) {
+        pnria_destroy(ctxs[m]);
+    }
+    free(ctxs);
+
+    if (!created) {
+        for (int i = 0; i < count; ++i) {
+            free(names[i]);
+        }
+        return -1;
+    }
+    return loaded;
+}
+
+// same as run_roms, saving the state after every frame and loading it back as
+// workflows snapshotting every frame do
+static int run_states(pnria_ctx_t *ctx, const char *romsDir, long frames, state_result_t *results)
+{
+    char *names[MAX_ROMS];
+    int count = list_roms(romsDir, names);
+    if (count < 0) {
+        return -1;
+    }
+
+    unsigned char state[PNRIA_SAVE_STATE_MAX_SIZE];
+    int loaded = 0;
+    for (int i = 0; i < count; ++i) {
+        char path[4096];
+        snprintf(path, sizeof(path), "%s/%s", romsDir, names[i]);
+
+        pnria_ctx_reset(ctx);
+        if (!pnria_ctx_load(ctx, path)) {
+            fprintf(stderr, "Error loading %s\n", path);
+            free(names[i]);
+            continue;
+        }
+
+        state_result_t *result = &results[loaded++];
+        *result = (state_result_t) { .name = names[i], .states = frames * STATE_REPEAT };
+
+        char keys[PNRIA_INPUT_SIZE] = { 0 };
+        for (long frame = 0; frame < frames; ++frame) {
+            if (frame % KEY_FRAMES == 0) {
+                memset(keys, 0, sizeof(keys));
+                keys[(frame / KEY_FRAMES) % PNRIA_INPUT_SIZE] = 1;
+                pnria_ctx_set_input(ctx, keys);
+            }
+            pnria_run_frame(ctx);
+
+            size_t size = 0;
+            double start = now();
+            for (int r = 0; r < STATE_REPEAT; ++r) {
+                size = pnria_save_state(ctx, state, sizeof(state));
+            }
+            double saved = now();
+            for (int r = 0; r < STATE_REPEAT; ++r) {
+                pnria_load_state(ctx, state, size);
+            }
+
+            result->loadSeconds += now() - saved;
+            result->saveSeconds += saved - start;
+            result->bytes += size * STATE_REPEAT;
+        }
+    }
+
+    return loaded;
+}
+
+// runs every rom in sessions of a few frames, as episode based workloads do,
+// timing a reset and load before each session against a restart
+static int run_resets(pnria_ctx_t *ctx, const char *romsDir, long frames, reset_result_t *results)
+{
+    char *names[MAX_ROMS];
+    int count = list_roms(romsDir, names);
+    if (count < 0) {
+        return -1;
+    }
+
+    long episodes = frames / EPISODE_FRAMES > 0 ? frames / EPISODE_FRAMES : 1;
+    int loaded = 0;
+    for (int i = 0; i < count; ++i) {
+        char path[4096];
+        snprintf(path, sizeof(path), "%s/%s", romsDir, names[i]);
+
+        reset_result_t *result = &results[loaded];
+        *result = (reset_result_t) { .name = names[i], .resets = episodes };
+
+        bool failed = false;
+        for (long episode = 0; episode < episodes && !failed; ++episode) {
+            double start = now();
+            pnria_ctx_reset(ctx);
+            failed = !pnria_ctx_load(ctx, path);
+            result->loadSeconds += now() - start;
+
+            char keys[PNRIA_INPUT_SIZE] = { 0 };
+            keys[episode % PNRIA_INPUT_SIZE] = 1;
+            pnria_ctx_set_input(ctx, keys);
+            for (int frame = 0; frame < EPISODE_FRAMES; ++frame) {
+                pnria_run_frame(ctx);
+            }
+        }
+
+        if (failed) {
+            fprintf(stderr, "Error loading %s\n", path);
+            free(names[i]);
+            continue;
+        }
+
+        for (long episode = 0; episode < episodes; ++episode) {
+            double start = now();
+            pnria_ctx_restart(ctx);
+            result->restartSeconds += now() - start;
+
+            char keys[PNRIA_INPUT_SIZE] = { 0 };
+            keys[episode % PNRIA_INPUT_SIZE] = 1;
+            pnria_ctx_set_input(ctx, keys);
+            for (int frame = 0; frame < EPISODE_FRAMES; ++frame) {
+                pnria_run_frame(ctx);
+            }
+        }
+
+        ++loaded;
+    }
+
+    return loaded;
+}
+
+// adds a total result after the others
+static void add_total(result_t *results, int count)
+{
+    result_t *sum = &results[count];
+    *sum = (result_t) { .name = strdup("total") };
+    for (int i = 0; i < count; ++i) {
+        sum->instructions += results[i].instructions;
+        sum->frames += results[i].frames;
+        sum->seconds += results[i].seconds;
+    }
+}
+
+static void add_state_total(state_result_t *results, int count)
+{
+    state_result_t *sum = &results[count];
+    *sum = (state_result_t) { .name = strdup("total") };
+    for (int i = 0; i < count; ++i) {
+        sum->states += results[i].states;
+        sum->bytes += results[i].bytes;
+        sum->saveSeconds += results[i].saveSeconds;
+        sum->loadSeconds += results[i].loadSeconds;
+    }
+}
+
+static void add_reset_total(reset_result_t *results, int count)
+{
+    reset_result_t *sum = &results[count];
+    *sum = (reset_result_t) { .name = strdup("total") };
+    for (int i = 0; i < count; ++i) {
+        sum->resets += results[i].resets;
+        sum->loadSeconds += results[i].loadSeconds;
+        sum->restartSeconds += results[i].restartSeconds;
+    }
+}
+
+static void print_table(const char *title, const result_t *results, int count, bool frames)
+{
+    printf("%-12s %14s %12s", title, "instr/s", "ns/instr");
+    printf(frames ? " %12s\n" : "\n", "ns/frame");
+
+    for (int i = 0; i < count; ++i) {
+        printf("%-12s %14.0f %12.2f", results[i].name,
+               results[i].instructions / results[i].seconds, results[i].seconds * 1e9 / results[i].instructions);
+        if (frames) {
+            printf(" %12.0f", results[i].seconds * 1e9 / results[i].frames);
+        }
+        printf("\n");
+    }
+}
+
+static void print_state_table(const state_result_t *results, int count)
+{
+    printf("%-12s %12s %12s %12s\n", "rom", "ns/save", "ns/load", "bytes");
+
+    for (int i = 0; i < count; ++i) {
+        printf("%-12s %12.1f %12.1f %12.0f\n", results[i].name,
+               results[i].saveSeconds * 1e9 / results[i].states, results[i].loadSeconds * 1e9 / results[i].states,
+               (double)results[i].bytes / results[i].states);
+    }
+}
+
+static void print_state_json(const state_result_t *results, int count, bool last)
+{
+    printf("  \"state\": [");
+    for (int i = 0; i < count; ++i) {
+        printf("%s\n    { \"name\": \"%s\", \"states\": %ld, \"bytes_per_state\": %.1f, "
+               "\"ns_per_save\": %.3f, \"ns_per_load\": %.3f }",
+               i > 0 ? "," : "", results[i].name, results[i].states, (double)results[i].bytes / results[i].states,
+               results[i].saveSeconds * 1e9 / results[i].states, results[i].loadSeconds * 1e9 / results[i].states);
+    }
+    printf("%s]%s\n", count > 0 ? "\n  " : "", last ? "" : ",");
+}
+
+static void print_reset_table(const reset_result_t *results, int count)
+{
+    printf("%-12s %12s %12s %14s\n", "rom", "ns/load", "ns/restart", "restarts/s");
+
+    for (int i = 0; i < count; ++i) {
+        printf("%-12s %12.1f %12.1f %14.0f\n", results[i].name,
+               results[i].loadSeconds * 1e9 / results[i].resets, results[i].restartSeconds * 1e9 / results[i].resets,
+               results[i].resets / results[i].restartSeconds);
+    }
+}
+
+static void print_reset_json(const reset_result_t *results, int count, bool last)
+{
+    printf("  \"reset\": [");
+    for (int i = 0; i < count; ++i) {
+        printf("%s\n    { \"name\": \"%s\", \"resets\": %ld, \"ns_per_load\": %.3f, "
+               "\"ns_per_restart\": %.3f, \"restarts_per_second\": %.0f }",
+               i > 0 ? "," : "", results[i].name, results[i].resets,
+               results[i].loadSeconds * 1e9 / results[i].resets, results[i].restartSeconds * 1e9 / results[i].resets,
+               results[i].resets / results[i].restartSeconds);
+    }
+    printf("%s]%s\n", count > 0 ? "\n  " : "", last ? "" : ",");
+}
+
+static void print_json(const char *key, const result_t *results, int count, bool frames, bool last)
+{
+    printf("  \"%s\": [", key);
+    for (int i = 0; i < count; ++i) {
+        printf("%s\n    { \"name\": \"%s\", \"instructions\": %ld, \"seconds\": %.9f, "
+               "\"instructions_per_second\": %.0f, \"ns_per_instruction\": %.3f",
+               i > 0 ? "," : "", results[i].name, results[i].instructions, results[i].seconds,
+               results[i].instructions / results[i].seconds, results[i].seconds * 1e9 / results[i].instructions);
+        if (frames) {
+            printf(", \"frames\": %ld, \"ns_per_frame\": %.1f",
+                   results[i].frames, results[i].seconds * 1e9 / results[i].frames);
+        }
+        printf(" }");
+    }
+    printf("%s]%s\n", count > 0 ? "\n  " : "", last ? "" : ",");
+}
+
+// per instruction micro benchmarks, whole rom macro benchmarks, the same roms
+// on batches of machines, save states and restarts
+int main(int argc, char **argv)
+{
+    const char *backend = NULL;
+    const char *suite = "all";
+    long microCycles = DEFAULT_MICRO_CYCLES;
+    long frames = DEFAULT_FRAMES;
+    int cyclesPerFrame = PNRIA_CYCLES_PER_FRAME;
+    int machines = DEFAULT_MACHINES;
+    bool json = false;
+
+    int option;
+    while ((option = getopt(argc, argv, "b:s:m:n:c:w:jh")) != -1) {
+        switch (option) {
+        case 'b': backend = optarg; break;
+        case 's': suite = optarg; break;
+        case 'm': microCycles = atol(optarg); break;
+        case 'n': frames = atol(optarg); break;
+        case 'c': cyclesPerFrame = atoi(optarg); break;
+        case 'w': machines = atoi(optarg); break;
+        case 'j': json = true; break;
+        default:
+            usage(argv[0]);
+            return option == 'h' ? 0 : 1;
+        }
+    }
+
+    bool micro = strcmp(suite, "micro") == 0 || strcmp(suite, "all") == 0;
+    bool roms = strcmp(suite, "roms") == 0 || strcmp(suite, "all") == 0;
+    bool batches = strcmp(suite, "batch") == 0 || strcmp(suite, "all") == 0;
+    bool states = strcmp(suite, "state") == 0 || strcmp(suite, "all") == 0;
+    bool resets = strcmp(suite, "reset") == 0 || strcmp(suite, "all") == 0;
+    if (optind < argc - 1 || (!micro && !roms && !batches && !states && !resets) ||
+        microCycles < 1 || frames < 1 || cyclesPerFrame < 1 || machines < 1) {
+        usage(argv[0]);
+        return 1;
+    }
+    const char *romsDir = optind < argc ? argv[optind] : PNRIA_ROMS_DIR;
+
+    pnria_set_log_level(PNRIA_LOG_ERROR);
+
+    pnria_ctx_t *ctx = pnria_create();
+    if (!ctx) {
+        return 1;
+    }
+
+    if (backend) {
+        if (strcasecmp(backend, "table") == 0) {
+            pnria_ctx_set_backend(ctx, PNRIA_BACKEND_TABLE);
+        } else if (strcasecmp(backend, "threaded") == 0) {
+            pnria_ctx_set_backend(ctx, PNRIA_BACKEND_THREADED);
+        } else if (strcasecmp(backend, "jit") == 0) {
+            pnria_ctx_set_backend(ctx, PNRIA_BACKEND_JIT);
+        } else {
+            fprintf(stderr, "Unknown backend: %s\n", backend);
+            pnria_destroy(ctx);
+            return 1;
+        }
+    }
+    pnria_ctx_set_cycles_per_frame(ctx, cyclesPerFrame);
+
+    const char *backendNames[] = { "table", "threaded", "jit" };
+    const char *backendName = backendNames[pnria_ctx_get_backend(ctx)];
+
+    result_t microResults[MICRO_COUNT + 1];
+    int microCount = 0;
+    if (micro) {
+        microCount = run_micros(ctx, microCycles, microResults);
+        add_total(microResults, microCount++);
+    }
+
+    result_t romResults[MAX_ROMS + 1];
+    int romCount = 0;
+    if (roms) {
+        romCount = run_roms(ctx, romsDir, frames, romResults);
+        if (romCount < 0) {
+            pnria_destroy(ctx);
+            return 1;
+        }
+        add_total(romResults, romCount++);
+    }
+
+    result_t batchResults[MAX_ROMS + 1];
+    int batchCount = 0;
+    result_t contextResults[MAX_ROMS + 1];
+    int contextCount = 0;
+    if (batches) {
+        batchCount = run_batches(romsDir, frames, cyclesPerFrame, machines, batchResults);
+        if (batchCount < 0) {
+            pnria_destroy(ctx);
+            return 1;
+        }
+        add_total(batchResults, batchCount++);
+
+        contextCount = run_contexts(ctx, romsDir, frames, machines, contextResults);
+        if (contextCount < 0) {
+            pnria_destroy(ctx);
+            return 1;
+        }
+        add_total(contextResults, contextCount++);
+    }
+
+    state_result_t stateResults[MAX_ROMS + 1];
+    int stateCount = 0;
+    if (states) {
+        stateCount = run_states(ctx, romsDir, frames, stateResults);
+        if (stateCount < 0) {
+            pnria_destroy(ctx);
+            return 1;
+        }
+        add_state_total(stateResults, stateCount++);
+    }
+
+    reset_result_t resetResults[MAX_ROMS + 1];
+    int resetCount = 0;
+    if (resets) {
+        resetCount = run_resets(ctx, romsDir, frames, resetResults);
+        if (resetCount < 0) {
+            pnria_destroy(ctx);
+            return 1;
+        }
+        add_reset_total(resetResults, resetCount++);
+    }
+
+    if (json) {
+        printf("{\n  \"backend\": \"%s\",\n  \"cycles_per_frame\": %d,\n  \"batch_machines\": %d,\n",
+               backendName, cyclesPerFrame, machines);
+        print_json("micro", microResults, microCount, false, false);
+        print_json("roms", romResults, romCount, true, false);
+        print_json("batch", batchResults, batchCount, true, false);
+        print_json("batch_contexts", contextResults, contextCount, true, false);
+        print_state_json(stateResults, stateCount, false);
+        print_reset_json(resetResults, resetCount, true);
+        printf("}\n");
+    } else {
+        printf("backend: %s\n", backendName);
+        if (micro) {
+            printf("\n");
+            print_table("instruction", microResults, microCount, false);
+        }
+        if (roms) {
+            printf("\n");
+            print_table("rom", romResults, romCount, true);
+        }
+        if (batches) {
+            printf("\nbatches of %d machines, frames of all the machines\n", machines);
+            print_table("rom", batchResults, batchCount, true);
+            printf("\nthe same machines as %d separate contexts\n", machines);
+            print_table("rom", contextResults, contextCount, true);
+        }
+        if (states) {
+            printf("\nsave states after every frame\n");
+            print_state_table(stateResults, stateCount);
+        }
+        if (resets) {
+            printf("\nsessions of %d frames, reset and load against restart\n", EPISODE_FRAMES);
+            print_reset_table(resetResults, resetCount);
+        }
+    }
+
+    for (int i = 0; i < microCount; ++i) {
+        free(microResults[i].name);
+    }
+    for (int i = 0; i < romCount; ++i) {
+        free(romResults[i].name);
+    }
+    for (int i = 0; i < batchCount; ++i) {
+        free(batchResults[i].name);
+    }
+    for (int i = 0; i < contextCount; ++i) {
+        free(contextResults[i].name);
+    }
+    for (int i = 0; i < stateCount; ++i) {
+        free(stateResults[i].name);
+    }
+    for (int i = 0; i < resetCount; ++i) {
+        free(resetResults[i].name);
+    }
+    pnria_destroy(ctx);
+
+    return 0;
+}
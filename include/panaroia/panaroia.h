@@ -2,14 +2,28 @@
 #define PANAROIA_H
 
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
 
 #define PNRIA_START_OFFSET  0x200
 #define PNRIA_OPCODE_SIZE   2
+#define PNRIA_SCREEN_WIDTH 64
+#define PNRIA_SCREEN_HEIGHT 32
 #define PNRIA_SCREEN_SIZE 2048 // display size 64 * 32
 #define PNRIA_MEMORY_SIZE 4096
 #define PNRIA_STACK_SIZE 16
 #define PNRIA_INPUT_SIZE 16
 #define PNRIA_REGISTER_SIZE 16
+#define PNRIA_CYCLES_PER_FRAME 10 // default instructions per 60 Hz timer tick
+
+// log levels, same values used by log.c
+#define PNRIA_LOG_TRACE 0
+#define PNRIA_LOG_DEBUG 1
+#define PNRIA_LOG_INFO  2
+#define PNRIA_LOG_WARN  3
+#define PNRIA_LOG_ERROR 4
+#define PNRIA_LOG_FATAL 5
+#define PNRIA_LOG_OFF   6
 
 #ifdef __cplusplus
 extern "C" {
@@ -32,8 +46,9 @@ typedef struct {
     // program counter
     unsigned short PC;
 
-    // graphics output
-    unsigned char screen[PNRIA_SCREEN_SIZE];
+    // graphics output, one word per row with the leftmost pixel in the most
+    // significant bit, pnria_ctx_get_screen unpacks it to a byte per pixel
+    uint64_t screen[PNRIA_SCREEN_HEIGHT];
 
     // timers
     unsigned char delay;
@@ -52,14 +67,354 @@ typedef struct {
     int waiting_for_key;
 } pnria_state_t;
 
+typedef enum {
+    // reference implementation, decodes through the handler tables
+    PNRIA_BACKEND_TABLE,
+    // pre-decoded operations dispatched with computed gotos
+    PNRIA_BACKEND_THREADED,
+    // basic blocks translated to x86-64, only available when built with
+    // ENABLE_JIT, otherwise the threaded backend is used
+    PNRIA_BACKEND_JIT
+} pnria_backend_t;
+
+// an independent chip8 instance, create one per emulated machine
+typedef struct pnria_ctx pnria_ctx_t;
+
+pnria_ctx_t *pnria_create();
+void pnria_destroy(pnria_ctx_t *ctx);
+
+void pnria_ctx_init(pnria_ctx_t *ctx);
+void pnria_ctx_reset(pnria_ctx_t *ctx);
+// back to right after the rom was loaded, keeping the seed and cycles per
+// frame, without reading the rom again. Only the memory written since is
+// copied back, which makes it far cheaper than a reset and a load for
+// running many short sessions of the same rom
+void pnria_ctx_restart(pnria_ctx_t *ctx);
+void pnria_ctx_cycle(pnria_ctx_t *ctx);
+// the rom is read straight into the memory, files bigger than the memory
+// past PNRIA_START_OFFSET are rejected before reading
+bool pnria_ctx_load(pnria_ctx_t *ctx, const char *romFile);
+// same as pnria_ctx_load with the rom's bytes, e.g. from an archive
+bool pnria_ctx_load_buffer(pnria_ctx_t *ctx, const void *rom, size_t size);
+void pnria_ctx_set_input(pnria_ctx_t *ctx, const char *key);
+unsigned char *pnria_ctx_get_screen(pnria_ctx_t *ctx);
+// copies the whole state, prefer the view or the getters below when polling
+pnria_state_t pnria_ctx_get_state(pnria_ctx_t *ctx);
+// the state without copying it, updated in place as the context runs and
+// valid until it's destroyed
+const pnria_state_t *pnria_ctx_view_state(pnria_ctx_t *ctx);
+unsigned short pnria_ctx_get_pc(pnria_ctx_t *ctx);
+unsigned short pnria_ctx_get_i(pnria_ctx_t *ctx);
+unsigned short pnria_ctx_get_opcode(pnria_ctx_t *ctx);
+// Vx, x from 0 to 15
+unsigned char pnria_ctx_get_register(pnria_ctx_t *ctx, int x);
+unsigned char pnria_ctx_get_delay(pnria_ctx_t *ctx);
+unsigned char pnria_ctx_get_sound(pnria_ctx_t *ctx);
+
+typedef enum {
+    // 4 bytes per pixel, the palette colors are 0xRRGGBBAA and written red
+    // first, as GL_RGBA with GL_UNSIGNED_BYTE expects them
+    PNRIA_PIXELS_RGBA,
+    // a byte per pixel, the low byte of the palette colors
+    PNRIA_PIXELS_BYTE,
+    // a bit per pixel, leftmost in the most significant bit, set for set
+    // pixels regardless of the palette, as in pbm images
+    PNRIA_PIXELS_BIT
+} pnria_pixel_format_t;
+
+// a caller's buffer the screen is written into, (PNRIA_SCREEN_HEIGHT * scale)
+// rows of pitch bytes each
+typedef struct {
+    void *pixels;
+    pnria_pixel_format_t format;
+    // width and height every chip8 pixel is drawn with, 1 or more
+    int scale;
+    // bytes from the start of a row to the next, 0 when rows are packed
+    size_t pitch;
+    // colors of unset and set pixels
+    uint32_t palette[2];
+} pnria_framebuffer_t;
+
+// writes the screen rows in the mask, bit n for row n, straight from the
+// packed screen, leaving the others as they were. Pass UINT32_MAX for every
+// row or the dirty rows to convert only what changed. False for invalid
+// framebuffers
+bool pnria_ctx_export_screen(pnria_ctx_t *ctx, const pnria_framebuffer_t *framebuffer, uint32_t rows);
+
+// screen change tracking: the generation is bumped by every instruction that
+// changes a pixel, so frontends can skip frames where it didn't move. The
+// dirty rows (bit n for row n) and their bounding rectangle accumulate the
+// changes until pnria_ctx_clear_dirty, get_dirty_rect returns false when
+// nothing changed
+unsigned long pnria_ctx_get_screen_generation(pnria_ctx_t *ctx);
+uint32_t pnria_ctx_get_dirty_rows(pnria_ctx_t *ctx);
+bool pnria_ctx_get_dirty_rect(pnria_ctx_t *ctx, int *x, int *y, int *width, int *height);
+void pnria_ctx_clear_dirty(pnria_ctx_t *ctx);
+
+// same as calling pnria_ctx_cycle the given number of times
+void pnria_run_cycles(pnria_ctx_t *ctx, long cycles);
+
+// the delay and sound timers tick at 60 Hz of emulated time, once every
+// cycles per frame instructions, so results don't depend on how often the
+// host runs the context. pnria_run_frame runs up to the next tick, call it 60
+// times a second for realtime speed or in a loop for maximum speed
+void pnria_run_frame(pnria_ctx_t *ctx);
+void pnria_ctx_set_cycles_per_frame(pnria_ctx_t *ctx, int cycles);
+int pnria_ctx_get_cycles_per_frame(pnria_ctx_t *ctx);
+
+// CXKK draws from a generator of the context's own, restarted from the seed
+// by pnria_ctx_set_seed and every init or reset, so runs with the same seed,
+// rom and input are identical. Contexts start with seed 0
+void pnria_ctx_set_seed(pnria_ctx_t *ctx, uint64_t seed);
+uint64_t pnria_ctx_get_seed(pnria_ctx_t *ctx);
+
+// new contexts use the backend selected with PNRIA_BACKEND at build time
+void pnria_ctx_set_backend(pnria_ctx_t *ctx, pnria_backend_t backend);
+pnria_backend_t pnria_ctx_get_backend(pnria_ctx_t *ctx);
+
+// save states are a compact versioned snapshot of a context: registers, the
+// random generator, the used part of the stack, the rows of the screen with
+// pixels set and the memory bytes that differ from the rom, so they can only
+// be loaded in a context with the same rom loaded. Pressed keys are restored
+// as 1. A state is never bigger than PNRIA_SAVE_STATE_MAX_SIZE
+#define PNRIA_SAVE_STATE_MAX_SIZE 4608
+
+// returns the size of the state written, 0 if it doesn't fit in the buffer
+size_t pnria_save_state(pnria_ctx_t *ctx, void *buffer, size_t size);
+// leaves the context untouched when the state is invalid, from another
+// version or for another rom
+bool pnria_load_state(pnria_ctx_t *ctx, const void *buffer, size_t size);
+
+// rewind history, a frame pushed after every emulated frame. Frames are kept
+// as the runs of bytes that differ from the last keyframe, xored with it, so
+// a second of history usually takes a few kilobytes. Once the history reaches
+// its size the oldest keyframe is dropped along with the frames built on it
+#define PNRIA_REWIND_KEYFRAME_INTERVAL 60
+
+typedef struct pnria_rewind pnria_rewind_t;
+
+// a keyframe every keyframeInterval frames, 0 for the default
+pnria_rewind_t *pnria_rewind_create(size_t bytes, int keyframeInterval);
+void pnria_rewind_destroy(pnria_rewind_t *rewind);
+void pnria_rewind_clear(pnria_rewind_t *rewind);
+bool pnria_rewind_push(pnria_rewind_t *rewind, pnria_ctx_t *ctx);
+// drops the newest frame, the current one when pushing after every frame,
+// and restores the one before it. False when there's no frame before it
+bool pnria_rewind_back(pnria_rewind_t *rewind, pnria_ctx_t *ctx);
+// restores the frame age frames before the newest one, keeping the history,
+// e.g. to branch from it
+bool pnria_rewind_restore(pnria_rewind_t *rewind, pnria_ctx_t *ctx, int age);
+int pnria_rewind_frames(pnria_rewind_t *rewind);
+// bytes taken by the frames kept, along with what indexes them, never more
+// than the size the history was created with
+size_t pnria_rewind_bytes(pnria_rewind_t *rewind);
+
+// a fork is a frozen copy of a context's state that can be restored into it,
+// or into another context running the same rom, any number of times. Forks
+// share the memory in pages with the context and each other, so a fork only
+// copies the registers, the screen and the pages written since the previous
+// one, and a restore only the pages that differ. Forks are read only and can
+// be restored from several threads at once
+typedef struct pnria_fork pnria_fork_t;
+
+pnria_fork_t *pnria_fork_create(pnria_ctx_t *ctx);
+void pnria_fork_destroy(pnria_fork_t *fork);
+void pnria_fork_restore(pnria_fork_t *fork, pnria_ctx_t *ctx);
+
+// a batch runs many machines at once, usually the same rom with different
+// inputs. Registers are kept in one array per register with a lane per
+// machine, and machines at the same PC sit next to each other, so each group
+// runs its instructions together as vector loops until the machines diverge
+typedef struct pnria_batch pnria_batch_t;
+
+pnria_batch_t *pnria_batch_create(int machines);
+void pnria_batch_destroy(pnria_batch_t *batch);
+int pnria_batch_size(pnria_batch_t *batch);
+
+// resets every machine to the rom's initial state
+bool pnria_batch_load(pnria_batch_t *batch, const char *romFile);
+bool pnria_batch_load_buffer(pnria_batch_t *batch, const void *rom, size_t size);
+void pnria_batch_set_input(pnria_batch_t *batch, int machine, const char *key);
+void pnria_batch_set_state(pnria_batch_t *batch, int machine, const pnria_state_t *state);
+pnria_state_t pnria_batch_get_state(pnria_batch_t *batch, int machine);
+
+// every machine has its own CXKK generator, restarted from its seed when set
+// and by pnria_batch_load. A machine draws the same numbers as a context with
+// the same seed, machines start with seed 0
+void pnria_batch_set_seed(pnria_batch_t *batch, int machine, uint64_t seed);
+
+// same as the context functions, all machines share the frame timing
+void pnria_batch_set_cycles_per_frame(pnria_batch_t *batch, int cycles);
+void pnria_batch_run_cycles(pnria_batch_t *batch, long cycles);
+void pnria_batch_run_frame(pnria_batch_t *batch);
+
+// a library loads every rom once, finds it by the hash of its bytes or the
+// file it came from, and shares its memory image between the contexts it's
+// loaded in. Roms are never freed before the library, which must outlive the
+// contexts and jobs using them. Adding, finding, loading roms and setting
+// their cycles per frame are thread safe
+typedef struct pnria_library pnria_library_t;
+typedef struct pnria_rom pnria_rom_t;
+
+pnria_library_t *pnria_library_create();
+void pnria_library_destroy(pnria_library_t *library);
+
+// reads the file the first time it's added, NULL when it can't be loaded.
+// Files with the same bytes are the same rom
+pnria_rom_t *pnria_library_add(pnria_library_t *library, const char *romFile);
+pnria_rom_t *pnria_library_add_buffer(pnria_library_t *library, const char *name, const void *rom, size_t size);
+// adds every file in the directory but hidden and .txt ones, returns the
+// number of files added or -1
+int pnria_library_add_directory(pnria_library_t *library, const char *directory);
+int pnria_library_size(pnria_library_t *library);
+pnria_rom_t *pnria_library_get(pnria_library_t *library, int index);
+// NULL when there's no rom with the hash
+pnria_rom_t *pnria_library_find(pnria_library_t *library, uint64_t hash);
+
+// file name the rom was first added with
+const char *pnria_rom_name(const pnria_rom_t *rom);
+// 64 bit FNV-1a of the rom's bytes
+uint64_t pnria_rom_hash(const pnria_rom_t *rom);
+size_t pnria_rom_size(const pnria_rom_t *rom);
+// instructions per frame the rom plays best at, 0 to keep the context's
+void pnria_rom_set_cycles_per_frame(pnria_rom_t *rom, int cycles);
+int pnria_rom_get_cycles_per_frame(const pnria_rom_t *rom);
+
+// same as init and load with the rom, but only copies the pages of memory
+// that differ from it, so restarting a rom on a context is cheap
+void pnria_ctx_load_rom(pnria_ctx_t *ctx, const pnria_rom_t *rom);
+
+// from frame on, the given keys are pressed
+typedef struct {
+    long frame;
+    char keys[PNRIA_INPUT_SIZE];
+} pnria_input_event_t;
+
+typedef struct pnria_job pnria_job_t;
+
+// called on the worker thread once the job's frames ran, the context is only
+// valid during the call. ctx is NULL when the rom couldn't be loaded
+typedef void (*pnria_job_done_t)(const pnria_job_t *job, pnria_ctx_t *ctx);
+
+// a rom session: the rom runs for the given frames with the input events,
+// sorted by frame, applied at the start of their frames
+struct pnria_job {
+    const char *romFile;
+    // the rom's bytes, loaded instead when romFile is NULL
+    const void *rom;
+    size_t romSize;
+    // a library's rom, loaded instead of both when set, not copied
+    const pnria_rom_t *libraryRom;
+    const pnria_input_event_t *inputs;
+    long inputCount;
+    long frames;
+    // 0 for the library rom's or PNRIA_CYCLES_PER_FRAME
+    int cyclesPerFrame;
+    // seed of the context's random generator
+    uint64_t seed;
+    pnria_job_done_t done;
+    void *userData;
+};
+
+// runs jobs on a set of worker threads, each with its own deque of jobs and
+// its own context. Idle workers steal from the others, so uneven jobs still
+// keep every thread busy
+typedef struct pnria_pool pnria_pool_t;
+
+// 0 threads for one per online cpu
+pnria_pool_t *pnria_pool_create(int threads);
+// waits for the submitted jobs before stopping the workers
+void pnria_pool_destroy(pnria_pool_t *pool);
+int pnria_pool_size(pnria_pool_t *pool);
+
+// the job, its rom file name or bytes and inputs are copied. Jobs submitted
+// from a done callback go to the calling worker's own deque
+bool pnria_pool_submit(pnria_pool_t *pool, const pnria_job_t *job);
+// blocks until every submitted job is done
+void pnria_pool_wait(pnria_pool_t *pool);
+
+// an input recording is the keys pressed on every frame of a session started
+// from a freshly loaded rom, with the seed and cycles per frame it ran with,
+// so replaying it reproduces the session exactly. Keys are recorded at the
+// frame they're set in, so set them between frames. A recording must outlive
+// the contexts recording or replaying it
+typedef struct pnria_recording pnria_recording_t;
+
+pnria_recording_t *pnria_recording_create();
+void pnria_recording_destroy(pnria_recording_t *recording);
+// NULL when the file can't be read or isn't a valid recording
+pnria_recording_t *pnria_recording_load(const char *file);
+bool pnria_recording_save(pnria_recording_t *recording, const char *file);
+long pnria_recording_frames(pnria_recording_t *recording);
+uint64_t pnria_recording_seed(pnria_recording_t *recording);
+int pnria_recording_cycles_per_frame(pnria_recording_t *recording);
+// the changes of the pressed keys, e.g. for the inputs of a pool job
+const pnria_input_event_t *pnria_recording_events(pnria_recording_t *recording, long *count);
+
+// restarts the loaded rom and records the keys set from then on, replacing
+// what the recording had. Keys held when it's called stay pressed and are
+// recorded from the first frame. Going back to an earlier frame with rewind,
+// forks or save states drops what was recorded after it
+void pnria_ctx_record(pnria_ctx_t *ctx, pnria_recording_t *recording);
+// restarts the loaded rom with the recording's seed and cycles per frame, the
+// recorded keys are then pressed at the start of their frames and
+// pnria_ctx_set_input is ignored. False for recordings of another rom
+bool pnria_ctx_replay(pnria_ctx_t *ctx, pnria_recording_t *recording);
+// stops recording or replaying, so do init, reset and restart
+void pnria_ctx_stop(pnria_ctx_t *ctx);
+// frames run since init or restart
+long pnria_ctx_get_frame(pnria_ctx_t *ctx);
+
+// what contexts spent their cycles on: executions of every instruction and of
+// every address, the cycles FX0A waited for a key, and the cycles run in every
+// call path, following 2NNN and 00EE. Contexts only count into a profile when
+// the library is built with ENABLE_PROFILER, otherwise none of it is compiled
+// into the interpreter. A profile isn't locked, feed it from a thread at a time
+typedef struct pnria_profile pnria_profile_t;
+
+pnria_profile_t *pnria_profile_create();
+void pnria_profile_destroy(pnria_profile_t *profile);
+void pnria_profile_clear(pnria_profile_t *profile);
+unsigned long pnria_profile_cycles(const pnria_profile_t *profile);
+// executions of the instruction the opcode decodes to, e.g. of every 8XY4 for
+// 0x8124. Opcodes no instruction decodes to share a count
+unsigned long pnria_profile_opcode_count(const pnria_profile_t *profile, unsigned short opcode);
+unsigned long pnria_profile_address_count(const pnria_profile_t *profile, unsigned short address);
+// cycles an FX0A ran again because no key was pressed
+unsigned long pnria_profile_key_wait_cycles(const pnria_profile_t *profile);
+// every count, instructions by name, and the call paths
+bool pnria_profile_save_json(const pnria_profile_t *profile, const char *file);
+// a line per call path, main then the addresses of its subroutines separated
+// by ';', and the cycles run in it, as flamegraph.pl reads them
+bool pnria_profile_save_folded(const pnria_profile_t *profile, const char *file);
+
+// counts what the context runs into the profile, NULL stops. While profiling
+// the context runs on the table backend, whichever is set. False when built
+// without ENABLE_PROFILER
+bool pnria_ctx_set_profile(pnria_ctx_t *ctx, pnria_profile_t *profile);
+
+// messages below the level PNRIA_LOG_LEVEL the library was built with are
+// never emitted, regardless of the runtime level
+void pnria_set_log_level(int level);
 
+// same as the functions above, operating on a default instance
 void pnria_init();
 void pnria_reset();
 void pnria_cycle();
 bool pnria_load(const char *romFile);
+bool pnria_load_buffer(const void *rom, size_t size);
 void pnria_set_input(const char *key);
 unsigned char *pnria_get_screen();
 pnria_state_t pnria_get_state();
+const pnria_state_t *pnria_view_state();
+bool pnria_export_screen(const pnria_framebuffer_t *framebuffer, uint32_t rows);
+unsigned long pnria_get_screen_generation();
+uint32_t pnria_get_dirty_rows();
+bool pnria_get_dirty_rect(int *x, int *y, int *width, int *height);
+void pnria_clear_dirty();
+void pnria_set_cycles_per_frame(int cycles);
+int pnria_get_cycles_per_frame();
+void pnria_set_seed(uint64_t seed);
 
 #ifdef __cplusplus
 }
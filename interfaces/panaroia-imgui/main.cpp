@@ -1,6 +1,6 @@
+#include <algorithm>
+#include <array>
 #include <iostream>
-#include <chrono>
-#include <thread>
 
 #include <SDL.h>
 #include <GL/glew.h>
@@ -11,7 +11,7 @@
 #include "imfilebrowser.h"
 #include "panaroiacontroller.h"
 
-void displayGameWindow(PanaroiaController &controller);
+void displayGameWindow(GLuint screenTexture);
 void displayKeypad(PanaroiaController &controller);
 void displayRomController(PanaroiaController &controller, ImGui::FileBrowser &fileDialog);
 
@@ -38,7 +38,7 @@ int main(int, char**)
     SDL_Window* window = SDL_CreateWindow("Panaroia lib example", SDL_WINDOWPOS_CENTERED, SDL_WINDOWPOS_CENTERED, 1280, 720, windowFlags);
     SDL_GLContext glContext = SDL_GL_CreateContext(window);
     SDL_GL_MakeCurrent(window, glContext);
-    SDL_GL_SetSwapInterval(0);
+    SDL_GL_SetSwapInterval(1);
 
     bool err = glewInit() != GLEW_OK;
 
@@ -59,15 +59,27 @@ int main(int, char**)
 
     ImVec4 clearColor = ImVec4(0.45f, 0.55f, 0.60f, 1.00f);
 
+    // the screen is a 64x32 texture updated when it changes and scaled to
+    // the window without filtering
+    GLuint screenTexture;
+    glGenTextures(1, &screenTexture);
+    glBindTexture(GL_TEXTURE_2D, screenTexture);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    static const std::array<uint32_t, PNRIA_SCREEN_SIZE> blankScreen{};
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, PNRIA_SCREEN_WIDTH, PNRIA_SCREEN_HEIGHT, 0, GL_RGBA, GL_UNSIGNED_BYTE,
+                 blankScreen.data());
+
     ImGui::FileBrowser fileDialog;
     fileDialog.SetTitle("Select the ROM file...");
     fileDialog.ClearSelected();
 
-    // Main loop
+    // Main loop, paced by the display, the controller emulates on its own
+    // thread
     bool done = false;
     while (!done) {
-        controller.step();
-
         SDL_Event event;
         while (SDL_PollEvent(&event)) {
             ImGui_ImplSDL2_ProcessEvent(&event);
@@ -87,6 +99,12 @@ int main(int, char**)
             }
         }
 
+        if (const uint32_t *screen = controller.updateScreen()) {
+            glBindTexture(GL_TEXTURE_2D, screenTexture);
+            glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, PNRIA_SCREEN_WIDTH, PNRIA_SCREEN_HEIGHT, GL_RGBA, GL_UNSIGNED_BYTE,
+                            screen);
+        }
+
         // Start the Dear ImGui frame
         ImGui_ImplOpenGL3_NewFrame();
         ImGui_ImplSDL2_NewFrame(window);
@@ -99,7 +117,7 @@ int main(int, char**)
             fileDialog.ClearSelected();
         }
 
-        displayGameWindow(controller);
+        displayGameWindow(screenTexture);
 
         displayKeypad(controller);
 
@@ -112,11 +130,10 @@ int main(int, char**)
         glClear(GL_COLOR_BUFFER_BIT);
         ImGui_ImplOpenGL3_RenderDrawData(ImGui::GetDrawData());
         SDL_GL_SwapWindow(window);
-
-        std::this_thread::sleep_for(std::chrono::microseconds(1200));
     }
 
     // Cleanup
+    glDeleteTextures(1, &screenTexture);
     ImGui_ImplOpenGL3_Shutdown();
     ImGui_ImplSDL2_Shutdown();
     ImGui::DestroyContext();
@@ -160,26 +177,16 @@ void displayKeypad(PanaroiaController &controller)
     ImGui::End();
 }
 
-void displayGameWindow(PanaroiaController &controller)
+void displayGameWindow(GLuint screenTexture)
 {
-    ImGui::SetNextWindowSize(ImVec2(655, 360), ImGuiCond_Always);
+    ImGui::SetNextWindowSize(ImVec2(655, 360), ImGuiCond_FirstUseEver);
     ImGui::Begin("Game window");
-    unsigned char *screen = controller.screen();
-
-    ImVec2 pos = ImGui::GetCursorScreenPos();
-    ImDrawList* drawList = ImGui::GetWindowDrawList();
 
-    for (int i = 0; i < 64; ++i) {
-        for (int j = 0; j < 32; ++j) {
-            ImVec2 topLeft = ImVec2(pos.x + i * 10, pos.y + j * 10.0);
-            ImVec2 bottomRight = ImVec2(topLeft.x + 10.0, topLeft.y + 10.0);
-            unsigned short pnriaIndex = i + j * 64;
-
-            if (screen[pnriaIndex] == 1) {
-                drawList->AddRectFilled(topLeft, bottomRight, IM_COL32(255, 0, 255, 255));
-            }
-        }
-    }
+    // the largest screen that fits, pixels stay square
+    ImVec2 available = ImGui::GetContentRegionAvail();
+    float scale = std::max(1.0f, std::min(available.x / PNRIA_SCREEN_WIDTH, available.y / PNRIA_SCREEN_HEIGHT));
+    ImGui::Image((ImTextureID)(intptr_t)screenTexture,
+                 ImVec2(PNRIA_SCREEN_WIDTH * scale, PNRIA_SCREEN_HEIGHT * scale));
 
     ImGui::End();
 }
@@ -187,7 +194,7 @@ void displayGameWindow(PanaroiaController &controller)
 void displayRomController(PanaroiaController &controller, ImGui::FileBrowser &fileDialog)
 {
     ImGui::SetNextWindowPos(ImVec2(10, 10), ImGuiCond_FirstUseEver);
-    ImGui::SetNextWindowSize(ImVec2(150, 70), ImGuiCond_FirstUseEver);
+    ImGui::SetNextWindowSize(ImVec2(360, 130), ImGuiCond_FirstUseEver);
 
     static bool romControl;
     ImGui::Begin("ROM", &romControl, ImGuiWindowFlags_MenuBar);
@@ -208,6 +215,18 @@ void displayRomController(PanaroiaController &controller, ImGui::FileBrowser &fi
         ImGui::EndMenuBar();
 
         ImGui::Text("Current ROM: %s", controller.currentRom().c_str());
+        ImGui::Text(controller.rewinding() ? "Rewinding, %.1f s left" : "Hold Backspace to rewind %.1f s",
+                    controller.rewindSeconds());
+
+        bool measureLatency = controller.measuringLatency();
+        if (ImGui::Checkbox("Measure input latency", &measureLatency)) {
+            controller.setMeasureLatency(measureLatency);
+        }
+        if (measureLatency) {
+            const PanaroiaController::InputLatency &latency = controller.inputLatency();
+            ImGui::Text("Last %.1f ms, average %.1f ms, worst %.1f ms over %ld keys",
+                        latency.lastMs, latency.averageMs, latency.worstMs, latency.samples);
+        }
     }
 
     ImGui::End();
@@ -1,9 +1,39 @@
 #include "panaroiacontroller.h"
 
-#include "panaroia/panaroia.h"
+#include <algorithm>
+#include <chrono>
+#include <ctime>
+
+namespace {
+using clock = std::chrono::steady_clock;
+
+int64_t nowNanoseconds()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(clock::now().time_since_epoch()).count();
+}
+
+// minutes of history for most roms
+constexpr size_t kRewindBytes = 4 * 1024 * 1024;
+constexpr SDL_Keycode kRewindKey = SDLK_BACKSPACE;
+// inputs no screen changed after within half a second aren't measured
+constexpr int kLatencyFrames = 30;
+// unset pixels show the window behind them
+constexpr uint32_t kPixelOff = 0x00000000;
+constexpr uint32_t kPixelOn = 0xFF00FFFF;
+}
 
 PanaroiaController::PanaroiaController()
-    : m_running{false}
+    : m_ctx{pnria_create()}
+    , m_rewind{pnria_rewind_create(kRewindBytes, 0)}
+    , m_running{false}
+    , m_rewinding{false}
+    , m_quit{false}
+    , m_rewindFrames{0}
+    , m_keys{0}
+    , m_measureLatency{false}
+    , m_inputTime{0}
+    , m_pendingInputTime{0}
+    , m_pendingInputFrames{0}
 {
     init();
 
@@ -13,24 +43,116 @@ PanaroiaController::PanaroiaController()
         SDLK_x, SDLK_c, SDLK_y, SDLK_i,
         SDLK_r, SDLK_f, SDLK_v, SDLK_o
     };
+    for (int i = 0; i < 16; ++i) {
+        m_keyIndexes[m_keymap[i]] = i;
+    }
+
+    m_thread = std::thread(&PanaroiaController::run, this);
+}
+
+PanaroiaController::~PanaroiaController()
+{
+    m_quit = true;
+    m_thread.join();
+    pnria_rewind_destroy(m_rewind);
+    pnria_destroy(m_ctx);
 }
 
 void PanaroiaController::init()
 {
-    pnria_init();
+    pnria_ctx_set_seed(m_ctx, std::time(nullptr));
+    pnria_ctx_init(m_ctx);
+}
+
+// emulates a frame for every 60th of a second elapsed, no matter how long
+// rendering takes
+void PanaroiaController::run()
+{
+    const auto frameTime = std::chrono::duration_cast<clock::duration>(std::chrono::duration<double>(1.0 / 60));
+    auto nextFrame = clock::now();
+
+    while (!m_quit) {
+        auto now = clock::now();
+        // drop the frames missed while stalled instead of catching up
+        if (now - nextFrame > frameTime * 4) {
+            nextFrame = now;
+        }
+        while (nextFrame <= now) {
+            step();
+            nextFrame += frameTime;
+        }
+
+        std::this_thread::sleep_until(nextFrame);
+    }
 }
 
 void PanaroiaController::step()
 {
-    pnria_cycle();
-    pnria_set_input(m_chip8Keys);
+    if (!m_running) {
+        return;
+    }
+
+    std::lock_guard<std::mutex> lock(m_ctxMutex);
+
+    // keys pressed until now count from the first instruction of the frame
+    uint16_t keys = m_keys;
+    int64_t inputTime = m_inputTime.exchange(0);
+    if (m_pendingInputTime && ++m_pendingInputFrames > kLatencyFrames) {
+        m_pendingInputTime = 0;
+    }
+    if (inputTime && !m_pendingInputTime) {
+        m_pendingInputTime = inputTime;
+        m_pendingInputFrames = 0;
+    }
+    char chip8Keys[16];
+    for (int i = 0; i < 16; ++i) {
+        chip8Keys[i] = (keys >> i) & 1;
+    }
+    pnria_ctx_set_input(m_ctx, chip8Keys);
+
+    if (m_rewinding) {
+        pnria_rewind_back(m_rewind, m_ctx);
+    } else {
+        pnria_run_frame(m_ctx);
+        pnria_rewind_push(m_rewind, m_ctx);
+    }
+
+    m_rewindFrames = pnria_rewind_frames(m_rewind);
+    publishScreen();
+}
+
+void PanaroiaController::publishScreen()
+{
+    if (!pnria_ctx_get_dirty_rows(m_ctx)) {
+        return;
+    }
+
+    // the back slot holds an older screen, so every row is written
+    pnria_framebuffer_t framebuffer = {};
+    Screen &screen = m_screens.back();
+    framebuffer.pixels = screen.pixels.data();
+    framebuffer.format = PNRIA_PIXELS_RGBA;
+    framebuffer.scale = 1;
+    framebuffer.palette[0] = kPixelOff;
+    framebuffer.palette[1] = kPixelOn;
+    pnria_ctx_export_screen(m_ctx, &framebuffer, UINT32_MAX);
+    pnria_ctx_clear_dirty(m_ctx);
+
+    screen.inputTime = m_pendingInputTime;
+    m_pendingInputTime = 0;
+    m_screens.publish();
 }
 
 void PanaroiaController::reset()
 {
-    pnria_reset();
+    std::lock_guard<std::mutex> lock(m_ctxMutex);
+    pnria_rewind_clear(m_rewind);
+    m_rewindFrames = 0;
+    // a different game every time
+    pnria_ctx_set_seed(m_ctx, std::time(nullptr));
+    pnria_ctx_reset(m_ctx);
     if (!m_currentRom.empty()) {
-        pnria_load(m_currentRom.c_str());
+        pnria_ctx_load(m_ctx, m_currentRom.c_str());
     }
 }
 
@@ -41,7 +163,6 @@ void PanaroiaController::setCurrentRom(const std::string &rom)
     }
     m_currentRom = rom;
     reset();
-    pnria_load(m_currentRom.c_str());
     m_running = true;
 }
 
@@ -55,9 +176,48 @@ bool PanaroiaController::running() const
     return m_running;
 }
 
-unsigned char *PanaroiaController::screen() const
+bool PanaroiaController::rewinding() const
 {
-    return pnria_get_screen();
+    return m_rewinding;
+}
+
+double PanaroiaController::rewindSeconds() const
+{
+    return m_rewindFrames / 60.0;
+}
+
+const uint32_t *PanaroiaController::updateScreen()
+{
+    if (!m_screens.update()) {
+        return nullptr;
+    }
+
+    const Screen &screen = m_screens.front();
+    if (screen.inputTime && m_measureLatency) {
+        double latency = (nowNanoseconds() - screen.inputTime) / 1e6;
+        m_inputLatency.lastMs = latency;
+        m_inputLatency.worstMs = std::max(m_inputLatency.worstMs, latency);
+        m_inputLatency.averageMs += (latency - m_inputLatency.averageMs) / ++m_inputLatency.samples;
+    }
+    return screen.pixels.data();
+}
+
+void PanaroiaController::setMeasureLatency(bool measure)
+{
+    if (measure && !m_measureLatency) {
+        m_inputLatency = InputLatency();
+    }
+    m_measureLatency = measure;
+}
+
+bool PanaroiaController::measuringLatency() const
+{
+    return m_measureLatency;
+}
+
+const PanaroiaController::InputLatency &PanaroiaController::inputLatency() const
+{
+    return m_inputLatency;
 }
 
 char PanaroiaController::inputState(int index) const
@@ -65,7 +225,7 @@ char PanaroiaController::inputState(int index) const
     if (index < 0 || index >= 16) {
         return 0;
     }
-    return m_chip8Keys[index];
+    return (m_keys >> index) & 1;
 }
 
 SDL_Keycode PanaroiaController::keyMapping(int index) const
@@ -75,20 +235,34 @@ SDL_Keycode PanaroiaController::keyMapping(int index) const
 
 void PanaroiaController::updateInputState(SDL_Keycode keycode, bool pressed)
 {
-    for (int i = 0; i < 16; ++i) {
-        if (m_keymap[i] == keycode) {
-            m_chip8Keys[i] = pressed ? 1 : 0;
-            break;
-        }
+    auto key = m_keyIndexes.find(keycode);
+    if (key == m_keyIndexes.end()) {
+        return;
+    }
+
+    uint16_t bit = 1 << key->second;
+    uint16_t keys = pressed ? m_keys.fetch_or(bit) : m_keys.fetch_and(~bit);
+    // key repeats change nothing
+    if (m_measureLatency && ((keys & bit) != 0) != pressed) {
+        int64_t unset = 0;
+        m_inputTime.compare_exchange_strong(unset, nowNanoseconds());
     }
 }
 
 void PanaroiaController::keyUp(SDL_Keycode keycode)
 {
+    if (keycode == kRewindKey) {
+        m_rewinding = false;
+        return;
+    }
     updateInputState(keycode, false);
 }
 
 void PanaroiaController::keyDown(SDL_Keycode keycode)
 {
+    if (keycode == kRewindKey) {
+        m_rewinding = true;
+        return;
+    }
     updateInputState(keycode, true);
 }
@@ -3,14 +3,38 @@
 
 #include <string>
 #include <array>
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
 
 #include <SDL_keycode.h>
 
+#include "panaroia/panaroia.h"
+#include "triplebuffer.h"
+
+// Runs the emulator on a thread of its own at 60 frames per second of
+// emulated time, whatever the rendering does. Finished screens are handed to
+// the UI through a triple buffer and the pressed keys come back as an atomic
+// mask, so neither side waits for the other.
 class PanaroiaController {
 public:
+    // from handling a key event to the UI getting the first screen that
+    // changed after it
+    struct InputLatency {
+        double lastMs = 0;
+        double averageMs = 0;
+        double worstMs = 0;
+        long samples = 0;
+    };
+
     PanaroiaController();
+    ~PanaroiaController();
+
+    PanaroiaController(const PanaroiaController &) = delete;
+    PanaroiaController &operator=(const PanaroiaController &) = delete;
 
-    void step();
     void reset();
 
     void keyUp(SDL_Keycode keycode);
@@ -20,21 +44,66 @@ public:
     const std::string &currentRom() const;
 
     bool running() const;
+    bool rewinding() const;
+    // emulated time kept in the rewind history
+    double rewindSeconds() const;
+
+    // the latest screen, 64x32 RGBA, if there's a new one since the last
+    // call, nullptr otherwise. Valid until the next call
+    const uint32_t *updateScreen();
 
-    unsigned char *screen() const;
+    // latency is only measured while enabled, enabling it starts over
+    void setMeasureLatency(bool measure);
+    bool measuringLatency() const;
+    const InputLatency &inputLatency() const;
 
     char inputState(int index) const;
     SDL_Keycode keyMapping(int index) const;
 
 private:
+    struct Screen {
+        std::array<uint32_t, PNRIA_SCREEN_SIZE> pixels;
+        // when the key event this screen is the first change after was
+        // handled, in steady clock nanoseconds, 0 for none
+        int64_t inputTime;
+    };
+
     void init();
+    void run();
+    // runs one frame, or goes back one while the rewind key is held
+    void step();
+    void publishScreen();
     void updateInputState(SDL_Keycode keycode, bool pressed);
 
 private:
+    pnria_ctx_t *m_ctx;
+    pnria_rewind_t *m_rewind;
+    // held by the emulation thread while it runs a frame, and by the UI to
+    // load or reset a rom
+    std::mutex m_ctxMutex;
     std::string m_currentRom;
     std::array<SDL_Keycode, 16> m_keymap;
-    bool m_running;
-    char m_chip8Keys[16] = { 0 };
+    // chip8 key of every mapped keycode
+    std::unordered_map<SDL_Keycode, int> m_keyIndexes;
+
+    std::atomic<bool> m_running;
+    std::atomic<bool> m_rewinding;
+    std::atomic<bool> m_quit;
+    std::atomic<long> m_rewindFrames;
+    // bit n for chip8 key n
+    std::atomic<uint16_t> m_keys;
+
+    std::atomic<bool> m_measureLatency;
+    // the oldest key event not applied yet, and the oldest applied one no
+    // screen changed after yet, 0 for none
+    std::atomic<int64_t> m_inputTime;
+    int64_t m_pendingInputTime;
+    int m_pendingInputFrames;
+    InputLatency m_inputLatency;
+
+    TripleBuffer<Screen> m_screens;
+
+    std::thread m_thread;
 };
 
 #endif // PANAROIA_CONTROLLER_H
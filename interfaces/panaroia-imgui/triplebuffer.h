@@ -0,0 +1,53 @@
+#ifndef TRIPLE_BUFFER_H
+#define TRIPLE_BUFFER_H
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+
+// Hands values from one writer thread to one reader thread without locks or
+// waiting: the writer fills the back slot and swaps it with the middle one,
+// the reader swaps the middle slot with its front one when a new value was
+// published. Neither ever touches the slot the other one is using, and the
+// reader always gets the latest value, skipping any it was too slow for.
+template <typename T>
+class TripleBuffer {
+public:
+    // slot for the writer to fill before publish()
+    T &back()
+    {
+        return m_slots[m_back];
+    }
+
+    void publish()
+    {
+        m_back = m_middle.exchange(m_back | kFresh, std::memory_order_acq_rel) & kIndex;
+    }
+
+    // takes the latest published value, false if there's none since the
+    // previous call. The value is front() until the next update
+    bool update()
+    {
+        if (!(m_middle.load(std::memory_order_relaxed) & kFresh)) {
+            return false;
+        }
+        m_front = m_middle.exchange(m_front, std::memory_order_acq_rel) & kIndex;
+        return true;
+    }
+
+    const T &front() const
+    {
+        return m_slots[m_front];
+    }
+
+private:
+    static constexpr uint8_t kIndex = 0x3;
+    static constexpr uint8_t kFresh = 0x4;
+
+    std::array<T, 3> m_slots{};
+    uint8_t m_back = 0;
+    std::atomic<uint8_t> m_middle{1};
+    uint8_t m_front = 2;
+};
+
+#endif // TRIPLE_BUFFER_H
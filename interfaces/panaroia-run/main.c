@@ -0,0 +1,324 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "panaroia/panaroia.h"
+
+#define DEFAULT_FRAMES 600
+
+static double now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr,
+            "usage: %s [options] rom\n"
+            "  -n frames    frames to run, default %d\n"
+            "  -c cycles    instructions per frame, default %d\n"
+            "  -b backend   table, threaded or jit\n"
+            "  -r seed      seed of the random numbers, default 0\n"
+            "  -i file      input script, lines of \"<frame> <keys>\" where keys are the\n"
+            "               hex digits of the keys held from that frame on, or - for none\n"
+            "  -o file      record the input to a file\n"
+            "  -p file      replay a recording instead of -i, with its seed and cycles,\n"
+            "               for its frames unless -n is given\n"
+            "  -s file      write the final screen to a pbm file\n"
+            "  -e frames    with -s, also write the screen every given frames to file.<frame>\n"
+            "  -j file      write a profile of the run as json, needs a library built\n"
+            "               with ENABLE_PROFILER\n"
+            "  -f file      write the profile's call paths as folded stacks for\n"
+            "               flamegraph.pl\n"
+            "  -q           don't print the final state\n",
+            name, DEFAULT_FRAMES, PNRIA_CYCLES_PER_FRAME);
+}
+
+// reads the input script, a line per event, returns the number of events or -1
+// on errors
+static long read_input(const char *path, pnria_input_event_t **events)
+{
+    FILE *f = fopen(path, "r");
+    if (!f) {
+        perror("Error opening input script");
+        return -1;
+    }
+
+    long count = 0;
+    long capacity = 0;
+    long lastFrame = -1;
+    char line[256];
+    for (int number = 1; fgets(line, sizeof(line), f); ++number) {
+        char *comment = strchr(line, '#');
+        if (comment) {
+            *comment = '\0';
+        }
+
+        long frame;
+        char keys[64];
+        int fields = sscanf(line, "%ld %63s", &frame, keys);
+        if (fields <= 0) {
+            continue;
+        }
+        if (fields != 2 || frame < lastFrame) {
+            fprintf(stderr, "%s:%d: expected \"<frame> <keys>\" in frame order\n", path, number);
+            fclose(f);
+            free(*events);
+            return -1;
+        }
+
+        if (count == capacity) {
+            capacity = capacity ? capacity * 2 : 64;
+            pnria_input_event_t *grown = realloc(*events, capacity * sizeof(pnria_input_event_t));
+            if (!grown) {
+                perror("Error reading input script");
+                fclose(f);
+                free(*events);
+                return -1;
+            }
+            *events = grown;
+        }
+
+        pnria_input_event_t *event = &(*events)[count++];
+        event->frame = frame;
+        memset(event->keys, 0, sizeof(event->keys));
+        for (char *key = keys; strcmp(keys, "-") != 0 && *key; ++key) {
+            char digit[2] = { *key, '\0' };
+            char *end;
+            long index = strtol(digit, &end, 16);
+            if (*end != '\0') {
+                fprintf(stderr, "%s:%d: invalid key '%c'\n", path, number, *key);
+                fclose(f);
+                free(*events);
+                return -1;
+            }
+            event->keys[index] = 1;
+        }
+        lastFrame = frame;
+    }
+
+    fclose(f);
+    return count;
+}
+
+static bool write_screen(pnria_ctx_t *ctx, const char *path)
+{
+    FILE *f = fopen(path, "w");
+    if (!f) {
+        perror("Error writing screen");
+        return false;
+    }
+
+    // binary pbm rows are the screen's bits as they are
+    unsigned char pixels[PNRIA_SCREEN_SIZE / 8];
+    pnria_framebuffer_t framebuffer = { .pixels = pixels, .format = PNRIA_PIXELS_BIT, .scale = 1 };
+    pnria_ctx_export_screen(ctx, &framebuffer, UINT32_MAX);
+
+    fprintf(f, "P4\n%d %d\n", PNRIA_SCREEN_WIDTH, PNRIA_SCREEN_HEIGHT);
+    bool written = fwrite(pixels, 1, sizeof(pixels), f) == sizeof(pixels);
+    written = fclose(f) == 0 && written;
+    if (!written) {
+        fprintf(stderr, "Error writing screen %s\n", path);
+    }
+    return written;
+}
+
+static void print_state(pnria_ctx_t *ctx)
+{
+    const pnria_state_t *state = pnria_ctx_view_state(ctx);
+
+    printf("PC: %03X I: %03X SP: %X opcode: %04X delay: %02X sound: %02X\n",
+           state->PC, state->I, state->SP, state->opcode, state->delay, state->sound);
+    for (int i = 0; i < PNRIA_REGISTER_SIZE; ++i) {
+        printf("V%X: %02X%c", i, state->V[i], i % 8 == 7 ? '\n' : ' ');
+    }
+
+    const unsigned char *screen = pnria_ctx_get_screen(ctx);
+    for (int y = 0; y < PNRIA_SCREEN_HEIGHT; ++y) {
+        for (int x = 0; x < PNRIA_SCREEN_WIDTH; ++x) {
+            putchar(screen[y * PNRIA_SCREEN_WIDTH + x] ? '#' : '.');
+        }
+        putchar('\n');
+    }
+}
+
+// runs a rom for a number of frames as fast as possible, without a display
+int main(int argc, char **argv)
+{
+    long frames = DEFAULT_FRAMES;
+    int cyclesPerFrame = PNRIA_CYCLES_PER_FRAME;
+    uint64_t seed = 0;
+    const char *backend = NULL;
+    const char *inputPath = NULL;
+    const char *recordPath = NULL;
+    const char *replayPath = NULL;
+    bool framesGiven = false;
+    const char *screenPath = NULL;
+    long screenEvery = 0;
+    const char *jsonPath = NULL;
+    const char *foldedPath = NULL;
+    bool quiet = false;
+
+    int option;
+    while ((option = getopt(argc, argv, "n:c:b:r:i:o:p:s:e:j:f:qh")) != -1) {
+        switch (option) {
+        case 'n': frames = atol(optarg); framesGiven = true; break;
+        case 'c': cyclesPerFrame = atoi(optarg); break;
+        case 'b': backend = optarg; break;
+        case 'r': seed = strtoull(optarg, NULL, 0); break;
+        case 'i': inputPath = optarg; break;
+        case 'o': recordPath = optarg; break;
+        case 'p': replayPath = optarg; break;
+        case 's': screenPath = optarg; break;
+        case 'e': screenEvery = atol(optarg); break;
+        case 'j': jsonPath = optarg; break;
+        case 'f': foldedPath = optarg; break;
+        case 'q': quiet = true; break;
+        default:
+            usage(argv[0]);
+            return option == 'h' ? 0 : 1;
+        }
+    }
+
+    if (optind != argc - 1 || frames < 0 || cyclesPerFrame < 1) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    pnria_set_log_level(PNRIA_LOG_ERROR);
+
+    pnria_ctx_t *ctx = pnria_create();
+    if (!ctx) {
+        return 1;
+    }
+
+    if (backend) {
+        if (strcasecmp(backend, "table") == 0) {
+            pnria_ctx_set_backend(ctx, PNRIA_BACKEND_TABLE);
+        } else if (strcasecmp(backend, "threaded") == 0) {
+            pnria_ctx_set_backend(ctx, PNRIA_BACKEND_THREADED);
+        } else if (strcasecmp(backend, "jit") == 0) {
+            pnria_ctx_set_backend(ctx, PNRIA_BACKEND_JIT);
+        } else {
+            fprintf(stderr, "Unknown backend: %s\n", backend);
+            pnria_destroy(ctx);
+            return 1;
+        }
+    }
+    pnria_ctx_set_cycles_per_frame(ctx, cyclesPerFrame);
+    pnria_ctx_set_seed(ctx, seed);
+
+    pnria_profile_t *profile = NULL;
+    if (jsonPath || foldedPath) {
+        profile = pnria_profile_create();
+        if (!profile || !pnria_ctx_set_profile(ctx, profile)) {
+            fprintf(stderr, "Error profiling, is the library built with ENABLE_PROFILER?\n");
+            pnria_profile_destroy(profile);
+            pnria_destroy(ctx);
+            return 1;
+        }
+    }
+
+    pnria_input_event_t *events = NULL;
+    long eventCount = 0;
+    if (inputPath && (eventCount = read_input(inputPath, &events)) < 0) {
+        pnria_profile_destroy(profile);
+        pnria_destroy(ctx);
+        return 1;
+    }
+
+    if (!pnria_ctx_load(ctx, argv[optind])) {
+        fprintf(stderr, "Error loading %s\n", argv[optind]);
+        free(events);
+        pnria_profile_destroy(profile);
+        pnria_destroy(ctx);
+        return 1;
+    }
+
+    pnria_recording_t *recording = NULL;
+    if (replayPath) {
+        recording = pnria_recording_load(replayPath);
+        if (!recording || !pnria_ctx_replay(ctx, recording)) {
+            fprintf(stderr, "Error replaying %s\n", replayPath);
+            pnria_recording_destroy(recording);
+            free(events);
+            pnria_profile_destroy(profile);
+            pnria_destroy(ctx);
+            return 1;
+        }
+        if (!framesGiven) {
+            frames = pnria_recording_frames(recording);
+        }
+        cyclesPerFrame = pnria_recording_cycles_per_frame(recording);
+        eventCount = 0;
+    } else if (recordPath) {
+        recording = pnria_recording_create();
+        if (!recording) {
+            free(events);
+            pnria_profile_destroy(profile);
+            pnria_destroy(ctx);
+            return 1;
+        }
+        pnria_ctx_record(ctx, recording);
+    }
+
+    long nextEvent = 0;
+    double start = now();
+    for (long frame = 0; frame < frames; ++frame) {
+        while (nextEvent < eventCount && events[nextEvent].frame <= frame) {
+            pnria_ctx_set_input(ctx, events[nextEvent++].keys);
+        }
+
+        pnria_run_frame(ctx);
+
+        if (screenPath && screenEvery > 0 && (frame + 1) % screenEvery == 0) {
+            char path[4096];
+            snprintf(path, sizeof(path), "%s.%ld", screenPath, frame + 1);
+            write_screen(ctx, path);
+        }
+    }
+
+    double elapsed = now() - start;
+
+    int status = 0;
+    if (screenPath && !write_screen(ctx, screenPath)) {
+        status = 1;
+    }
+
+    if (recordPath && !replayPath && !pnria_recording_save(recording, recordPath)) {
+        fprintf(stderr, "Error writing %s\n", recordPath);
+        status = 1;
+    }
+
+    if (jsonPath && !pnria_profile_save_json(profile, jsonPath)) {
+        fprintf(stderr, "Error writing %s\n", jsonPath);
+        status = 1;
+    }
+
+    if (foldedPath && !pnria_profile_save_folded(profile, foldedPath)) {
+        fprintf(stderr, "Error writing %s\n", foldedPath);
+        status = 1;
+    }
+
+    if (!quiet) {
+        print_state(ctx);
+    }
+
+    long instructions = frames * cyclesPerFrame;
+    printf("%ld frames, %ld instructions in %.3f s, %.0f instr/s\n",
+           frames, instructions, elapsed, elapsed > 0 ? instructions / elapsed : 0);
+
+    pnria_destroy(ctx);
+    pnria_recording_destroy(recording);
+    pnria_profile_destroy(profile);
+    free(events);
+
+    return status;
+}
@@ -0,0 +1,795 @@
+#include "panaroia_p.h"
+
+#include <errno.h>
+#include <stdlib.h>
+
+// Machines run in groups of the ones at the same PC. Registers live in one
+// array per register with a slot per machine, and the slots of a group are
+// kept next to each other, so its instructions run as loops over contiguous
+// slices the compiler vectorizes. A group runs instruction after instruction
+// until its cycles are done or its machines take different paths, then its
+// slots are sorted by their new PC and split into a group per PC. Groups that
+// end a run on the same PC are merged before the next one by sorting every
+// slot by PC. Instructions are decoded once from the memory every machine
+// loaded, and only fetched from a machine's own memory where it wrote to.
+
+// the memory is split in 64 blocks, a bit each in the masks of written blocks
+#define PNRIA_BATCH_BLOCK_SHIFT 6
+
+typedef struct {
+    int start;
+    int end;
+    // cycles run so far in the current run
+    long ran;
+} pnria_batch_group_t;
+
+struct pnria_batch {
+    int count;
+    int cyclesPerFrame;
+    int frameCycles;
+
+    // by slot
+    uint8_t *V[PNRIA_REGISTER_SIZE];
+    uint16_t *PC;
+    uint16_t *I;
+    uint16_t *SP;
+    uint16_t *opcode;
+    uint8_t *delay;
+    uint8_t *sound;
+    // pressed keys, bit n for key n
+    uint16_t *keys;
+
+    // machine in every slot and slot of every machine
+    uint32_t *machine;
+    uint32_t *slot;
+
+    // by machine: PNRIA_STACK_SIZE entries, PNRIA_MEMORY_SIZE bytes and
+    // PNRIA_SCREEN_HEIGHT rows each, CXKK's generators and the seeds
+    // pnria_batch_load restarts them from, and the blocks of memory written
+    uint16_t *stack;
+    uint8_t *memory;
+    uint64_t *screen;
+    uint64_t *seed;
+    uint64_t *random;
+    uint64_t *written;
+
+    // the memory machines load with, decoded at every address
+    uint8_t image[PNRIA_MEMORY_SIZE];
+    pnria_instruction_t code[PNRIA_MEMORY_SIZE];
+
+    // the groups that ran, the ones left to run and whether the slots need
+    // sorting by PC before the next run
+    pnria_batch_group_t *groups;
+    int groupCount;
+    pnria_batch_group_t *pending;
+    int pendingCount;
+    bool regroup;
+
+    // the run every PC was last seen in when looking for groups to merge,
+    // out of the memory counts as PNRIA_MEMORY_SIZE
+    uint32_t seen[PNRIA_MEMORY_SIZE + 1];
+    uint32_t run;
+
+    // slots to sort or move, and buffers to do it
+    uint32_t *order;
+    uint32_t *sorted;
+    uint32_t *scratch;
+};
+
+#define PNRIA_MEMORY(batch, machine) (&(batch)->memory[(size_t)(machine) * PNRIA_MEMORY_SIZE])
+#define PNRIA_SCREEN(batch, machine) (&(batch)->screen[(size_t)(machine) * PNRIA_SCREEN_HEIGHT])
+#define PNRIA_STACK(batch, machine) (&(batch)->stack[(size_t)(machine) * PNRIA_STACK_SIZE])
+// addresses wrap around the machine's own memory, so no machine ever reaches
+// another's
+#define PNRIA_ADDRESS(address) ((address) & (PNRIA_MEMORY_SIZE - 1))
+#define PNRIA_BLOCK(address) (1ull << (PNRIA_ADDRESS(address) >> PNRIA_BATCH_BLOCK_SHIFT))
+
+// up to this many slots are sorted in place instead of by radix
+#define PNRIA_BATCH_INSERTION_SORT 16
+
+// runs the statement for every slot i of the group
+#define PNRIA_RANGE(...) {                      \
+    for (int i = start; i < end; ++i) {         \
+        __VA_ARGS__                             \
+    }                                           \
+}
+
+static void pnria_batch_set_image(pnria_batch_t *batch, const uint8_t *image)
+{
+    memcpy(batch->image, image, PNRIA_MEMORY_SIZE);
+    for (int address = 0; address < PNRIA_MEMORY_SIZE; ++address) {
+        batch->code[address] = pnria_decode(image[address] << 8 | image[PNRIA_ADDRESS(address + 1)]);
+    }
+}
+
+pnria_batch_t *pnria_batch_create(int machines)
+{
+    if (machines < 1) {
+        pnria_error("Invalid batch size: %d", machines);
+        return NULL;
+    }
+
+    pnria_batch_t *batch = calloc(1, sizeof(pnria_batch_t));
+    if (!batch) {
+        pnria_error("Error allocating batch: %s", strerror(errno));
+        return NULL;
+    }
+
+    batch->count = machines;
+    batch->cyclesPerFrame = PNRIA_CYCLES_PER_FRAME;
+    batch->frameCycles = PNRIA_CYCLES_PER_FRAME;
+
+    bool allocated = true;
+#define PNRIA_ALLOC(field, size) \
+    allocated = allocated && (batch->field = calloc((size), sizeof(*batch->field))) != NULL
+
+    for (int r = 0; r < PNRIA_REGISTER_SIZE; ++r) {
+        PNRIA_ALLOC(V[r], machines);
+    }
+    PNRIA_ALLOC(PC, machines);
+    PNRIA_ALLOC(I, machines);
+    PNRIA_ALLOC(SP, machines);
+    PNRIA_ALLOC(opcode, machines);
+    PNRIA_ALLOC(delay, machines);
+    PNRIA_ALLOC(sound, machines);
+    PNRIA_ALLOC(keys, machines);
+    PNRIA_ALLOC(machine, machines);
+    PNRIA_ALLOC(slot, machines);
+    PNRIA_ALLOC(stack, (size_t)machines * PNRIA_STACK_SIZE);
+    PNRIA_ALLOC(memory, (size_t)machines * PNRIA_MEMORY_SIZE);
+    PNRIA_ALLOC(screen, (size_t)machines * PNRIA_SCREEN_HEIGHT);
+    PNRIA_ALLOC(seed, machines);
+    PNRIA_ALLOC(random, machines);
+    PNRIA_ALLOC(written, machines);
+    PNRIA_ALLOC(groups, machines);
+    PNRIA_ALLOC(pending, machines);
+    PNRIA_ALLOC(order, machines);
+    PNRIA_ALLOC(sorted, machines);
+    PNRIA_ALLOC(scratch, machines);
+
+#undef PNRIA_ALLOC
+
+    if (!allocated) {
+        pnria_error("Error allocating batch of %d machines: %s", machines, strerror(errno));
+        pnria_batch_destroy(batch);
+        return NULL;
+    }
+
+    for (int machine = 0; machine < machines; ++machine) {
+        batch->machine[machine] = machine;
+        batch->slot[machine] = machine;
+        batch->random[machine] = pnria_random_seed(0);
+    }
+    batch->groups[0] = (pnria_batch_group_t) { 0, machines, 0 };
+    batch->groupCount = 1;
+    pnria_batch_set_image(batch, batch->memory);
+
+    return batch;
+}
+
+void pnria_batch_destroy(pnria_batch_t *batch)
+{
+    if (!batch) {
+        return;
+    }
+
+    for (int r = 0; r < PNRIA_REGISTER_SIZE; ++r) {
+        free(batch->V[r]);
+    }
+    free(batch->PC);
+    free(batch->I);
+    free(batch->SP);
+    free(batch->opcode);
+    free(batch->delay);
+    free(batch->sound);
+    free(batch->keys);
+    free(batch->machine);
+    free(batch->slot);
+    free(batch->stack);
+    free(batch->memory);
+    free(batch->screen);
+    free(batch->seed);
+    free(batch->random);
+    free(batch->written);
+    free(batch->groups);
+    free(batch->pending);
+    free(batch->order);
+    free(batch->sorted);
+    free(batch->scratch);
+    free(batch);
+}
+
+int pnria_batch_size(pnria_batch_t *batch)
+{
+    return batch->count;
+}
+
+void pnria_batch_set_state(pnria_batch_t *batch, int machine, const pnria_state_t *state)
+{
+    int slot = batch->slot[machine];
+
+    for (int r = 0; r < PNRIA_REGISTER_SIZE; ++r) {
+        batch->V[r][slot] = state->V[r];
+    }
+    memcpy(PNRIA_STACK(batch, machine), state->stack, sizeof(state->stack));
+    batch->PC[slot] = state->PC;
+    batch->I[slot] = state->I;
+    batch->SP[slot] = state->SP;
+    batch->opcode[slot] = state->opcode;
+    batch->delay[slot] = state->delay;
+    batch->sound[slot] = state->sound;
+    pnria_batch_set_input(batch, machine, (const char *)state->key);
+    memcpy(PNRIA_MEMORY(batch, machine), state->memory, PNRIA_MEMORY_SIZE);
+    memcpy(PNRIA_SCREEN(batch, machine), state->screen, sizeof(state->screen));
+
+    // blocks that differ from the loaded memory count as written
+    uint64_t written = 0;
+    for (int block = 0; block < PNRIA_MEMORY_SIZE >> PNRIA_BATCH_BLOCK_SHIFT; ++block) {
+        int offset = block << PNRIA_BATCH_BLOCK_SHIFT;
+        bool same = memcmp(state->memory + offset, batch->image + offset, 1 << PNRIA_BATCH_BLOCK_SHIFT) == 0;
+        written |= (uint64_t)!same << block;
+    }
+    batch->written[machine] = written;
+
+    // the machine may have left its group's PC
+    batch->regroup = true;
+}
+
+pnria_state_t pnria_batch_get_state(pnria_batch_t *batch, int machine)
+{
+    pnria_state_t state = {};
+    int slot = batch->slot[machine];
+
+    for (int r = 0; r < PNRIA_REGISTER_SIZE; ++r) {
+        state.V[r] = batch->V[r][slot];
+    }
+    for (int k = 0; k < PNRIA_INPUT_SIZE; ++k) {
+        state.key[k] = (batch->keys[slot] >> k) & 1;
+    }
+    memcpy(state.stack, PNRIA_STACK(batch, machine), sizeof(state.stack));
+    state.PC = batch->PC[slot];
+    state.I = batch->I[slot];
+    state.SP = batch->SP[slot];
+    state.opcode = batch->opcode[slot];
+    state.delay = batch->delay[slot];
+    state.sound = batch->sound[slot];
+    memcpy(state.memory, PNRIA_MEMORY(batch, machine), PNRIA_MEMORY_SIZE);
+    memcpy(state.screen, PNRIA_SCREEN(batch, machine), sizeof(state.screen));
+
+    return state;
+}
+
+// a context builds the initial state, the same for every machine
+static void pnria_batch_start(pnria_batch_t *batch, pnria_ctx_t *ctx)
+{
+    pnria_batch_set_image(batch, ctx->chip8.memory);
+    for (int machine = 0; machine < batch->count; ++machine) {
+        pnria_batch_set_state(batch, machine, &ctx->chip8);
+        batch->random[machine] = pnria_random_seed(batch->seed[machine]);
+    }
+    batch->frameCycles = batch->cyclesPerFrame;
+}
+
+bool pnria_batch_load(pnria_batch_t *batch, const char *romFile)
+{
+    pnria_ctx_t *ctx = pnria_create();
+    if (!ctx) {
+        return false;
+    }
+
+    bool loaded = pnria_ctx_load(ctx, romFile);
+    if (loaded) {
+        pnria_batch_start(batch, ctx);
+    }
+
+    pnria_destroy(ctx);
+    return loaded;
+}
+
+bool pnria_batch_load_buffer(pnria_batch_t *batch, const void *rom, size_t size)
+{
+    pnria_ctx_t *ctx = pnria_create();
+    if (!ctx) {
+        return false;
+    }
+
+    bool loaded = pnria_ctx_load_buffer(ctx, rom, size);
+    if (loaded) {
+        pnria_batch_start(batch, ctx);
+    }
+
+    pnria_destroy(ctx);
+    return loaded;
+}
+
+void pnria_batch_set_seed(pnria_batch_t *batch, int machine, uint64_t seed)
+{
+    batch->seed[machine] = seed;
+    batch->random[machine] = pnria_random_seed(seed);
+}
+
+void pnria_batch_set_input(pnria_batch_t *batch, int machine, const char *key)
+{
+    uint16_t keys = 0;
+    for (int k = 0; k < PNRIA_INPUT_SIZE; ++k) {
+        keys |= (key[k] != 0) << k;
+    }
+    batch->keys[batch->slot[machine]] = keys;
+}
+
+void pnria_batch_set_cycles_per_frame(pnria_batch_t *batch, int cycles)
+{
+    if (cycles < 1) {
+        pnria_error("Invalid cycles per frame: %d", cycles);
+        return;
+    }
+
+    batch->cyclesPerFrame = cycles;
+    batch->frameCycles = cycles;
+}
+
+// sorts the first count slots of the order buffer by their key, small counts
+// by insertion and larger ones with two passes of a byte wide radix sort
+static void pnria_batch_sort(pnria_batch_t *batch, const uint16_t *keys, int count)
+{
+    // the bucket passes cost more than sorting a handful of slots in place
+    if (count <= PNRIA_BATCH_INSERTION_SORT) {
+        uint32_t *order = batch->order;
+        for (int j = 1; j < count; ++j) {
+            uint32_t slot = order[j];
+            int k = j;
+            for (; k > 0 && keys[order[k - 1]] > keys[slot]; --k) {
+                order[k] = order[k - 1];
+            }
+            order[k] = slot;
+        }
+        return;
+    }
+
+    // after two passes the sorted slots are back in the order buffer
+    uint32_t *from = batch->order;
+    uint32_t *to = batch->sorted;
+
+    for (int shift = 0; shift < 16; shift += 8) {
+        int offsets[257] = { 0 };
+        for (int j = 0; j < count; ++j) {
+            ++offsets[((keys[from[j]] >> shift) & 0xFF) + 1];
+        }
+        for (int b = 0; b < 256; ++b) {
+            offsets[b + 1] += offsets[b];
+        }
+        for (int j = 0; j < count; ++j) {
+            to[offsets[(keys[from[j]] >> shift) & 0xFF]++] = from[j];
+        }
+
+        uint32_t *swap = from;
+        from = to;
+        to = swap;
+    }
+}
+
+// moves the slots in the order buffer to start, start + 1 and on
+static void pnria_batch_permute(pnria_batch_t *batch, int start, int count)
+{
+    const uint32_t *order = batch->order;
+
+#define PNRIA_PERMUTE(array) {                                          \
+    __typeof__(*(array)) *permuted = (void *)batch->scratch;            \
+    for (int j = 0; j < count; ++j) {                                   \
+        permuted[j] = (array)[order[j]];                                \
+    }                                                                   \
+    memcpy(&(array)[start], permuted, count * sizeof(*(array)));        \
+}
+
+    for (int r = 0; r < PNRIA_REGISTER_SIZE; ++r) {
+        PNRIA_PERMUTE(batch->V[r]);
+    }
+    PNRIA_PERMUTE(batch->PC);
+    PNRIA_PERMUTE(batch->I);
+    PNRIA_PERMUTE(batch->SP);
+    PNRIA_PERMUTE(batch->opcode);
+    PNRIA_PERMUTE(batch->delay);
+    PNRIA_PERMUTE(batch->sound);
+    PNRIA_PERMUTE(batch->keys);
+    PNRIA_PERMUTE(batch->machine);
+
+#undef PNRIA_PERMUTE
+
+    for (int i = start; i < start + count; ++i) {
+        batch->slot[batch->machine[i]] = i;
+    }
+}
+
+// sorts the slots from start to end by one of the slot arrays and queues a
+// group for every value, with the cycles it ran so far
+static void pnria_batch_split(pnria_batch_t *batch, int start, int end, const uint16_t *keys, long ran)
+{
+    int count = end - start;
+    for (int j = 0; j < count; ++j) {
+        batch->order[j] = start + j;
+    }
+    pnria_batch_sort(batch, keys, count);
+    pnria_batch_permute(batch, start, count);
+
+    for (int from = start, to; from < end; from = to) {
+        for (to = from + 1; to < end && keys[to] == keys[from]; ++to);
+        batch->pending[batch->pendingCount++] = (pnria_batch_group_t) { from, to, ran };
+    }
+}
+
+// skips the next instruction on the machines where the condition holds,
+// splitting the group unless it holds on all of them or none
+#define PNRIA_SKIP(condition) {                                         \
+    int taken = 0;                                                      \
+    PNRIA_RANGE(taken += (condition);)                                  \
+    if (taken == count) {                                               \
+        pc += PNRIA_OPCODE_SIZE;                                        \
+    } else if (taken > 0) {                                             \
+        PNRIA_RANGE(PC[i] = pc + (condition) * PNRIA_OPCODE_SIZE;)      \
+        goto diverged;                                                  \
+    }                                                                   \
+}
+
+// runs a group until it ran the cycles or left the memory, then adds it to
+// the groups that ran, or until its machines diverge and it's split. Same
+// semantics as the single machine instructions. Inlined twice, so groups of a
+// single machine run without loops
+static inline __attribute__((always_inline))
+void pnria_batch_run_slots(pnria_batch_t *batch, pnria_batch_group_t group, long cycles, bool single)
+{
+    const int start = group.start;
+    const int end = single ? group.start + 1 : group.end;
+    const int count = end - start;
+    const uint32_t *machine = batch->machine;
+    uint16_t *PC = batch->PC;
+    uint16_t *I = batch->I;
+    uint16_t *SP = batch->SP;
+    uint16_t *opcode = batch->opcode;
+    uint16_t *keys = batch->keys;
+    uint8_t *delay = batch->delay;
+    uint8_t *sound = batch->sound;
+    uint8_t *vf = batch->V[0xF];
+    uint8_t *v0 = batch->V[0];
+
+    long ran = group.ran;
+    unsigned int pc = PC[start];
+    pnria_instruction_t in = { 0 };
+
+    uint64_t written = 0;
+    PNRIA_RANGE(written |= batch->written[machine[i]];)
+
+    for (; ran < cycles && pc < PNRIA_MEMORY_SIZE; ++ran) {
+        if (written & (PNRIA_BLOCK(pc) | PNRIA_BLOCK(pc + 1))) {
+            // the machines that wrote there fetch from their own memory
+            bool same = true;
+            PNRIA_RANGE(
+                const uint8_t *memory = PNRIA_MEMORY(batch, machine[i]);
+                opcode[i] = memory[pc] << 8 | memory[PNRIA_ADDRESS(pc + 1)];
+                same = same && opcode[i] == opcode[start];
+            )
+            if (!same) {
+                PNRIA_RANGE(PC[i] = pc;)
+                pnria_batch_split(batch, start, end, opcode, ran);
+                return;
+            }
+            in = pnria_decode(opcode[start]);
+        } else {
+            in = batch->code[pc];
+        }
+        pc += PNRIA_OPCODE_SIZE;
+
+        uint8_t *vx = batch->V[in.x];
+        uint8_t *vy = batch->V[in.y];
+        uint8_t kk = in.kk;
+        uint16_t nnn = in.nnn;
+
+        switch (in.op) {
+        case PNRIA_OP_UNKNOWN:
+            break;
+        case PNRIA_OP_00E0:
+            PNRIA_RANGE(memset(PNRIA_SCREEN(batch, machine[i]), 0, PNRIA_SCREEN_HEIGHT * sizeof(uint64_t));)
+            break;
+        case PNRIA_OP_00EE: {
+            bool same = true;
+            PNRIA_RANGE(
+                --SP[i];
+                PC[i] = PNRIA_STACK(batch, machine[i])[SP[i] % PNRIA_STACK_SIZE] + PNRIA_OPCODE_SIZE;
+                same = same && PC[i] == PC[start];
+            )
+            if (!same) {
+                goto diverged;
+            }
+            pc = PC[start];
+            break;
+        }
+        case PNRIA_OP_1NNN:
+            // a jump to itself runs until the end
+            if (nnn == pc - PNRIA_OPCODE_SIZE) {
+                ran = cycles - 1;
+            }
+            pc = nnn;
+            break;
+        case PNRIA_OP_2NNN:
+            PNRIA_RANGE(
+                PNRIA_STACK(batch, machine[i])[SP[i] % PNRIA_STACK_SIZE] = pc - PNRIA_OPCODE_SIZE;
+                ++SP[i];
+            )
+            pc = nnn;
+            break;
+        case PNRIA_OP_3XKK:
+            PNRIA_SKIP(vx[i] == kk)
+            break;
+        case PNRIA_OP_4XKK:
+            PNRIA_SKIP(vx[i] != kk)
+            break;
+        case PNRIA_OP_5XY0:
+            PNRIA_SKIP(vx[i] == vy[i])
+            break;
+        case PNRIA_OP_6XKK:
+            PNRIA_RANGE(vx[i] = kk;)
+            break;
+        case PNRIA_OP_7XKK:
+            PNRIA_RANGE(vx[i] += kk;)
+            break;
+        case PNRIA_OP_8XY0:
+            PNRIA_RANGE(vx[i] = vy[i];)
+            break;
+        case PNRIA_OP_8XY1:
+            PNRIA_RANGE(vx[i] |= vy[i];)
+            break;
+        case PNRIA_OP_8XY2:
+            PNRIA_RANGE(vx[i] &= vy[i];)
+            break;
+        case PNRIA_OP_8XY3:
+            PNRIA_RANGE(vx[i] ^= vy[i];)
+            break;
+        case PNRIA_OP_8XY4:
+            PNRIA_RANGE(
+                vx[i] += vy[i];
+                vf[i] = vy[i] > (0xFF - vx[i]);
+            )
+            break;
+        case PNRIA_OP_8XY5:
+            PNRIA_RANGE(
+                vf[i] = !(vy[i] > vx[i]);
+                vx[i] -= vy[i];
+            )
+            break;
+        case PNRIA_OP_8XY6:
+            PNRIA_RANGE(
+                vf[i] = vx[i] & 1;
+                vx[i] >>= 1;
+            )
+            break;
+        case PNRIA_OP_8XY7:
+            PNRIA_RANGE(
+                vf[i] = !(vx[i] > vy[i]);
+                vx[i] = vy[i] - vx[i];
+            )
+            break;
+        case PNRIA_OP_8XYE:
+            PNRIA_RANGE(
+                vf[i] = vx[i] >> 7;
+                vx[i] <<= 1;
+            )
+            break;
+        case PNRIA_OP_9XY0:
+            PNRIA_SKIP(vx[i] != vy[i])
+            break;
+        case PNRIA_OP_ANNN:
+            PNRIA_RANGE(I[i] = nnn;)
+            break;
+        case PNRIA_OP_BNNN: {
+            bool same = true;
+            PNRIA_RANGE(
+                PC[i] = nnn + v0[i];
+                same = same && PC[i] == PC[start];
+            )
+            if (!same) {
+                goto diverged;
+            }
+            pc = PC[start];
+            break;
+        }
+        case PNRIA_OP_CXKK:
+            PNRIA_RANGE(vx[i] = pnria_random(&batch->random[machine[i]]) & kk;)
+            break;
+        case PNRIA_OP_DXYN:
+            PNRIA_RANGE(
+                uint32_t rows = 0;
+                uint64_t columns = 0;
+                const uint8_t *memory = PNRIA_MEMORY(batch, machine[i]);
+                const uint8_t *sprite = memory + PNRIA_ADDRESS(I[i]);
+                uint8_t wrapped[16];
+                if (PNRIA_ADDRESS(I[i]) + in.n > PNRIA_MEMORY_SIZE) {
+                    for (int r = 0; r < in.n; ++r) {
+                        wrapped[r] = memory[PNRIA_ADDRESS(I[i] + r)];
+                    }
+                    sprite = wrapped;
+                }
+                vf[i] = pnria_draw(PNRIA_SCREEN(batch, machine[i]), sprite, vx[i], vy[i], in.n, &rows, &columns);
+            )
+            break;
+        case PNRIA_OP_EX9E:
+            PNRIA_SKIP(vx[i] < PNRIA_INPUT_SIZE && (keys[i] >> vx[i]) & 1)
+            break;
+        case PNRIA_OP_EXA1:
+            PNRIA_SKIP(!(vx[i] < PNRIA_INPUT_SIZE && (keys[i] >> vx[i]) & 1))
+            break;
+        case PNRIA_OP_FX07:
+            PNRIA_RANGE(vx[i] = delay[i];)
+            break;
+        case PNRIA_OP_FX0A: {
+            int pressed = 0;
+            PNRIA_RANGE(pressed += keys[i] != 0;)
+            if (pressed == count) {
+                PNRIA_RANGE(vx[i] = __builtin_ctz(keys[i]);)
+            } else if (pressed == 0) {
+                // keys don't change during a run, all of them wait until its end
+                pc -= PNRIA_OPCODE_SIZE;
+                ran = cycles - 1;
+            } else {
+                PNRIA_RANGE(
+                    if (keys[i]) {
+                        vx[i] = __builtin_ctz(keys[i]);
+                        PC[i] = pc;
+                    } else {
+                        PC[i] = pc - PNRIA_OPCODE_SIZE;
+                    }
+                )
+                goto diverged;
+            }
+            break;
+        }
+        case PNRIA_OP_FX15:
+            PNRIA_RANGE(delay[i] = vx[i];)
+            break;
+        case PNRIA_OP_FX18:
+            PNRIA_RANGE(sound[i] = vx[i];)
+            break;
+        case PNRIA_OP_FX1E:
+            PNRIA_RANGE(
+                vf[i] = I[i] + vx[i] > 0xFFF;
+                I[i] += vx[i];
+            )
+            break;
+        case PNRIA_OP_FX29:
+            PNRIA_RANGE(I[i] = vx[i] * 5;)
+            break;
+        case PNRIA_OP_FX33:
+            PNRIA_RANGE(
+                uint8_t *memory = PNRIA_MEMORY(batch, machine[i]);
+                memory[PNRIA_ADDRESS(I[i])]     = vx[i] / 100;
+                memory[PNRIA_ADDRESS(I[i] + 1)] = (vx[i] / 10) % 10;
+                memory[PNRIA_ADDRESS(I[i] + 2)] = vx[i] % 10;
+                uint64_t blocks = PNRIA_BLOCK(I[i]) | PNRIA_BLOCK(I[i] + 2);
+                batch->written[machine[i]] |= blocks;
+                written |= blocks;
+            )
+            break;
+        case PNRIA_OP_FX55:
+            PNRIA_RANGE(
+                uint8_t *memory = PNRIA_MEMORY(batch, machine[i]);
+                for (int r = 0; r <= in.x; ++r) {
+                    memory[PNRIA_ADDRESS(I[i] + r)] = batch->V[r][i];
+                }
+                uint64_t blocks = PNRIA_BLOCK(I[i]) | PNRIA_BLOCK(I[i] + in.x);
+                batch->written[machine[i]] |= blocks;
+                written |= blocks;
+            )
+            break;
+        case PNRIA_OP_FX65:
+            PNRIA_RANGE(
+                const uint8_t *memory = PNRIA_MEMORY(batch, machine[i]);
+                for (int r = 0; r <= in.x; ++r) {
+                    batch->V[r][i] = memory[PNRIA_ADDRESS(I[i] + r)];
+                }
+            )
+            break;
+        default:
+            break;
+        }
+    }
+
+    // only machines that ran an instruction have a new opcode
+    if (ran > group.ran) {
+        PNRIA_RANGE(opcode[i] = in.opcode;)
+    }
+    PNRIA_RANGE(PC[i] = pc;)
+    batch->groups[batch->groupCount++] = (pnria_batch_group_t) { start, end, ran };
+    return;
+
+diverged:
+    PNRIA_RANGE(opcode[i] = in.opcode;)
+    pnria_batch_split(batch, start, end, PC, ran + 1);
+}
+
+static void pnria_batch_run_group(pnria_batch_t *batch, pnria_batch_group_t group, long cycles)
+{
+    if (group.end - group.start == 1) {
+        pnria_batch_run_slots(batch, group, cycles, true);
+    } else {
+        pnria_batch_run_slots(batch, group, cycles, false);
+    }
+}
+
+// runs every group for the cycles or until it leaves the memory, returns the
+// most cycles any of them ran
+static long pnria_batch_run_groups(pnria_batch_t *batch, long cycles)
+{
+    batch->pendingCount = 0;
+    if (batch->regroup) {
+        batch->regroup = false;
+        pnria_batch_split(batch, 0, batch->count, batch->PC, 0);
+    } else {
+        for (int g = 0; g < batch->groupCount; ++g) {
+            batch->pending[batch->pendingCount++] = (pnria_batch_group_t) {
+                batch->groups[g].start, batch->groups[g].end, 0
+            };
+        }
+    }
+
+    batch->groupCount = 0;
+    while (batch->pendingCount > 0) {
+        pnria_batch_group_t group = batch->pending[--batch->pendingCount];
+        pnria_batch_run_group(batch, group, cycles);
+    }
+
+    // groups that ended on the same PC are merged before the next run, once
+    // at least half of them would, as sorting costs more than a few small
+    // groups running apart
+    long ran = 0;
+    int merges = 0;
+    ++batch->run;
+    for (int g = 0; g < batch->groupCount; ++g) {
+        const pnria_batch_group_t *group = &batch->groups[g];
+        ran = group->ran > ran ? group->ran : ran;
+
+        unsigned int pc = batch->PC[group->start];
+        pc = pc < PNRIA_MEMORY_SIZE ? pc : PNRIA_MEMORY_SIZE;
+        merges += batch->seen[pc] == batch->run;
+        batch->seen[pc] = batch->run;
+    }
+    batch->regroup = batch->regroup || (merges > 0 && merges * 2 >= batch->groupCount);
+
+    return ran;
+}
+
+void pnria_batch_run_cycles(pnria_batch_t *batch, long cycles)
+{
+    while (cycles > 0) {
+        // runs end with the frame, so every machine ticks its timers at once
+        long run = cycles < batch->frameCycles ? cycles : batch->frameCycles;
+        long ran = pnria_batch_run_groups(batch, run);
+
+        // machines that left the memory stop, as do the timers of the ones
+        // that didn't run until the end of the frame
+        batch->frameCycles -= ran;
+        if (batch->frameCycles == 0) {
+            batch->frameCycles = batch->cyclesPerFrame;
+
+            uint8_t *delay = batch->delay;
+            uint8_t *sound = batch->sound;
+            for (int g = 0; g < batch->groupCount; ++g) {
+                const int start = batch->groups[g].start;
+                const int end = batch->groups[g].end;
+                if (batch->groups[g].ran == run) {
+                    PNRIA_RANGE(
+                        delay[i] -= delay[i] > 0;
+                        sound[i] -= sound[i] > 0;
+                    )
+                }
+            }
+        }
+
+        if (ran < run) {
+            return;
+        }
+        cycles -= run;
+    }
+}
+
+void pnria_batch_run_frame(pnria_batch_t *batch)
+{
+    pnria_batch_run_cycles(batch, batch->frameCycles);
+}
@@ -0,0 +1,139 @@
+#include "panaroia_p.h"
+
+#include <errno.h>
+
+// A fork keeps the registers and screen by value, they are a few hundred
+// bytes, and the memory as pages shared with the context it was taken from
+// and every other fork of it. Pages are never written: the context keeps its
+// own memory and only remembers which page each part of it still equals,
+// forgetting it on the first write, so the next fork copies just the pages
+// written since the last one and restoring copies just the pages that
+// differ.
+
+struct pnria_fork {
+    unsigned short opcode;
+    unsigned char V[PNRIA_REGISTER_SIZE];
+    unsigned short I;
+    unsigned short PC;
+    uint64_t screen[PNRIA_SCREEN_HEIGHT];
+    unsigned char delay;
+    unsigned char sound;
+    unsigned short stack[PNRIA_STACK_SIZE];
+    unsigned short SP;
+    unsigned char key[PNRIA_INPUT_SIZE];
+    int waiting_for_key;
+
+    int cyclesPerFrame;
+    int frameCycles;
+    uint64_t random;
+    long frame;
+
+    pnria_page_t *pages[PNRIA_PAGE_COUNT];
+};
+
+pnria_fork_t *pnria_fork_create(pnria_ctx_t *ctx)
+{
+    pnria_fork_t *fork = malloc(sizeof(pnria_fork_t));
+    if (!fork) {
+        pnria_error("Error allocating fork: %s", strerror(errno));
+        return NULL;
+    }
+
+    for (int i = 0; i < PNRIA_PAGE_COUNT; ++i) {
+        pnria_page_t *page = ctx->pages[i];
+        if (!page) {
+            page = malloc(sizeof(pnria_page_t));
+            if (!page) {
+                pnria_error("Error allocating fork page: %s", strerror(errno));
+                for (int j = 0; j < i; ++j) {
+                    pnria_page_release(fork->pages[j]);
+                }
+                free(fork);
+                return NULL;
+            }
+            atomic_init(&page->refs, 1);
+            memcpy(page->bytes, ctx->chip8.memory + i * PNRIA_PAGE_SIZE, PNRIA_PAGE_SIZE);
+            ctx->pages[i] = page;
+        }
+
+        atomic_fetch_add(&page->refs, 1);
+        fork->pages[i] = page;
+    }
+
+    PNRIA_COPY_REGISTERS(fork, &ctx->chip8);
+    fork->cyclesPerFrame = ctx->cyclesPerFrame;
+    fork->frameCycles = ctx->frameCycles;
+    fork->random = ctx->random;
+    fork->frame = ctx->frame;
+
+    return fork;
+}
+
+bool pnria_pages_create(pnria_page_t **pages, const unsigned char *memory)
+{
+    for (int i = 0; i < PNRIA_PAGE_COUNT; ++i) {
+        pages[i] = malloc(sizeof(pnria_page_t));
+        if (!pages[i]) {
+            pnria_error("Error allocating pages: %s", strerror(errno));
+            for (int j = 0; j < i; ++j) {
+                pnria_page_release(pages[j]);
+                pages[j] = NULL;
+            }
+            return false;
+        }
+        atomic_init(&pages[i]->refs, 1);
+        memcpy(pages[i]->bytes, memory + i * PNRIA_PAGE_SIZE, PNRIA_PAGE_SIZE);
+    }
+
+    return true;
+}
+
+void pnria_fork_destroy(pnria_fork_t *fork)
+{
+    if (!fork) {
+        return;
+    }
+
+    for (int i = 0; i < PNRIA_PAGE_COUNT; ++i) {
+        pnria_page_release(fork->pages[i]);
+    }
+    free(fork);
+}
+
+void pnria_share_pages(pnria_ctx_t *ctx, pnria_page_t *const *pages)
+{
+    for (int i = 0; i < PNRIA_PAGE_COUNT; ++i) {
+        pnria_page_t *page = pages[i];
+        if (ctx->pages[i] == page) {
+            continue;
+        }
+
+        // only the instructions decoded from pages that differ are dropped
+        unsigned int offset = i * PNRIA_PAGE_SIZE;
+        unsigned char *memory = ctx->chip8.memory + offset;
+        if (memcmp(memory, page->bytes, PNRIA_PAGE_SIZE) != 0) {
+            memcpy(memory, page->bytes, PNRIA_PAGE_SIZE);
+            pnria_invalidate(ctx, offset, offset + PNRIA_PAGE_SIZE);
+        }
+
+        atomic_fetch_add(&page->refs, 1);
+        pnria_page_release(ctx->pages[i]);
+        ctx->pages[i] = page;
+    }
+}
+
+void pnria_fork_restore(pnria_fork_t *fork, pnria_ctx_t *ctx)
+{
+    pnria_share_pages(ctx, fork->pages);
+
+    PNRIA_COPY_REGISTERS(&ctx->chip8, fork);
+    ctx->cyclesPerFrame = fork->cyclesPerFrame;
+    ctx->frameCycles = fork->frameCycles;
+    ctx->random = fork->random;
+    ctx->frame = fork->frame;
+    pnria_mark_dirty(ctx, 0xFFFFFFFF, UINT64_MAX);
+
+    if (ctx->recording) {
+        pnria_recording_seek(ctx);
+    }
+}
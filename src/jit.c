@@ -0,0 +1,529 @@
+#include "panaroia_p.h"
+
+#if defined(PNRIA_JIT)
+
+#include <errno.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+// Translates straight-line runs of instructions to x86-64. A block ends at the
+// first jump, call, return or skip, or right before an instruction that isn't
+// translated, which the threaded backend runs instead.
+//
+// Blocks follow the SysV calling convention, long block(pnria_state_t *, long):
+// rdi holds the state and rsi the remaining cycles, which are returned in rax.
+// Only rax, rcx and rdx are used as scratch. Every instruction checks the cycle
+// budget, which never goes past the end of the current frame, so the timers
+// tick between blocks and leaving one gives the same state the interpreters
+// would have after that many cycles.
+//
+// The code buffer is never writable and executable at once: the pages a
+// translation writes to are made writable for it, then executable again.
+
+#define PNRIA_JIT_CODE_SIZE (256 * 1024)
+#define PNRIA_JIT_MAX_BLOCK 32
+
+// upper bound for the code of one instruction and its exit stub
+#define PNRIA_JIT_MAX_INSTRUCTION_SIZE 160
+
+typedef long (*pnria_block_t)(pnria_state_t *chip8, long cycles);
+
+struct pnria_jit {
+    unsigned char *code;
+    size_t used;
+    size_t pageSize;
+
+    // translated block starting at each address
+    pnria_block_t blocks[PNRIA_MEMORY_SIZE];
+
+    // memory bytes read by the translated blocks, writing to any of them
+    // drops every translation
+    unsigned char translated[PNRIA_MEMORY_SIZE];
+};
+
+// marks addresses whose first instruction isn't translated, never called
+static long pnria_jit_interpret(pnria_state_t *chip8, long cycles)
+{
+    (void)chip8;
+    return cycles;
+}
+
+// emitter
+
+enum { EAX = 0, ECX = 1, EDX = 2 };
+
+#define OFFSET(field) ((int32_t)offsetof(pnria_state_t, field))
+#define V(x) (OFFSET(V) + (x))
+
+typedef struct {
+    unsigned char *p;
+} pnria_emitter_t;
+
+static void emit8(pnria_emitter_t *e, uint8_t value)
+{
+    *e->p++ = value;
+}
+
+static void emit16(pnria_emitter_t *e, uint16_t value)
+{
+    emit8(e, value & 0xFF);
+    emit8(e, value >> 8);
+}
+
+static void emit32(pnria_emitter_t *e, uint32_t value)
+{
+    emit16(e, value & 0xFFFF);
+    emit16(e, value >> 16);
+}
+
+// [rdi + disp32] operand, reg is the register or the opcode extension
+static void emit_mem(pnria_emitter_t *e, uint8_t reg, int32_t disp)
+{
+    emit8(e, 0x80 | reg << 3 | 0x07);
+    emit32(e, disp);
+}
+
+// movzx reg, byte [rdi + disp]
+static void emit_load8(pnria_emitter_t *e, uint8_t reg, int32_t disp)
+{
+    emit8(e, 0x0F); emit8(e, 0xB6);
+    emit_mem(e, reg, disp);
+}
+
+// movzx reg, word [rdi + disp]
+static void emit_load16(pnria_emitter_t *e, uint8_t reg, int32_t disp)
+{
+    emit8(e, 0x0F); emit8(e, 0xB7);
+    emit_mem(e, reg, disp);
+}
+
+// mov byte [rdi + disp], reg8
+static void emit_store8(pnria_emitter_t *e, uint8_t reg, int32_t disp)
+{
+    emit8(e, 0x88);
+    emit_mem(e, reg, disp);
+}
+
+// mov word [rdi + disp], reg16
+static void emit_store16(pnria_emitter_t *e, uint8_t reg, int32_t disp)
+{
+    emit8(e, 0x66); emit8(e, 0x89);
+    emit_mem(e, reg, disp);
+}
+
+// mov byte [rdi + disp], imm8
+static void emit_store8_imm(pnria_emitter_t *e, int32_t disp, uint8_t value)
+{
+    emit8(e, 0xC6);
+    emit_mem(e, 0, disp);
+    emit8(e, value);
+}
+
+// mov word [rdi + disp], imm16
+static void emit_store16_imm(pnria_emitter_t *e, int32_t disp, uint16_t value)
+{
+    emit8(e, 0x66); emit8(e, 0xC7);
+    emit_mem(e, 0, disp);
+    emit16(e, value);
+}
+
+// two register operation, op is the "op r/m32, r32" opcode
+enum { ADD = 0x01, OR = 0x09, AND = 0x21, SUB = 0x29, XOR = 0x31, CMP = 0x39 };
+static void emit_alu(pnria_emitter_t *e, uint8_t op, uint8_t dst, uint8_t src)
+{
+    emit8(e, op);
+    emit8(e, 0xC0 | src << 3 | dst);
+}
+
+// setcc al
+enum { SETA = 0x97, SETBE = 0x96 };
+static void emit_set_al(pnria_emitter_t *e, uint8_t cc)
+{
+    emit8(e, 0x0F); emit8(e, cc); emit8(e, 0xC0);
+}
+
+// return the remaining cycles
+static void emit_return(pnria_emitter_t *e)
+{
+    // mov rax, rsi
+    emit8(e, 0x48); emit8(e, 0x89); emit8(e, 0xF0);
+    // ret
+    emit8(e, 0xC3);
+}
+
+static void emit_exit(pnria_emitter_t *e, uint16_t pc, uint16_t opcode)
+{
+    emit_store16_imm(e, OFFSET(PC), pc);
+    emit_store16_imm(e, OFFSET(opcode), opcode);
+    emit_return(e);
+}
+
+// PC = address + 2, or address + 4 if the flags match the jump condition
+// that skips over the second store
+enum { JE = 0x74, JNE = 0x75 };
+static void emit_skip(pnria_emitter_t *e, uint8_t jcc, uint16_t address)
+{
+    emit_store16_imm(e, OFFSET(PC), address + PNRIA_OPCODE_SIZE);
+    emit8(e, jcc); emit8(e, 9);
+    emit_store16_imm(e, OFFSET(PC), address + PNRIA_OPCODE_SIZE * 2);
+}
+
+// translates a single instruction, returns false if it isn't supported
+static bool pnria_jit_emit(pnria_emitter_t *e, const pnria_instruction_t *in,
+                           uint16_t address, bool *terminates)
+{
+    uint8_t x = in->x;
+    uint8_t y = in->y;
+
+    *terminates = false;
+
+    switch (in->op) {
+    case PNRIA_OP_00EE:
+        emit_load16(e, EAX, OFFSET(SP));
+        emit8(e, 0x83); emit8(e, 0xE8); emit8(e, 0x01); // sub eax, 1
+        emit_store16(e, EAX, OFFSET(SP));
+        emit8(e, 0x0F); emit8(e, 0xB7); emit8(e, 0xC0); // movzx eax, ax
+        // movzx ecx, word [rdi + rax * 2 + stack]
+        emit8(e, 0x0F); emit8(e, 0xB7); emit8(e, 0x8C); emit8(e, 0x47);
+        emit32(e, OFFSET(stack));
+        emit8(e, 0x83); emit8(e, 0xC1); emit8(e, PNRIA_OPCODE_SIZE); // add ecx, 2
+        emit_store16(e, ECX, OFFSET(PC));
+        *terminates = true;
+        break;
+    case PNRIA_OP_1NNN:
+        emit_store16_imm(e, OFFSET(PC), in->nnn);
+        *terminates = true;
+        break;
+    case PNRIA_OP_2NNN:
+        emit_load16(e, EAX, OFFSET(SP));
+        // mov word [rdi + rax * 2 + stack], address
+        emit8(e, 0x66); emit8(e, 0xC7); emit8(e, 0x84); emit8(e, 0x47);
+        emit32(e, OFFSET(stack));
+        emit16(e, address);
+        emit8(e, 0x83); emit8(e, 0xC0); emit8(e, 0x01); // add eax, 1
+        emit_store16(e, EAX, OFFSET(SP));
+        emit_store16_imm(e, OFFSET(PC), in->nnn);
+        *terminates = true;
+        break;
+    case PNRIA_OP_3XKK:
+    case PNRIA_OP_4XKK:
+        // cmp byte [rdi + Vx], kk
+        emit8(e, 0x80); emit_mem(e, 7, V(x)); emit8(e, in->kk);
+        emit_skip(e, in->op == PNRIA_OP_3XKK ? JNE : JE, address);
+        *terminates = true;
+        break;
+    case PNRIA_OP_5XY0:
+    case PNRIA_OP_9XY0:
+        emit_load8(e, EAX, V(x));
+        // cmp al, byte [rdi + Vy]
+        emit8(e, 0x3A); emit_mem(e, EAX, V(y));
+        emit_skip(e, in->op == PNRIA_OP_5XY0 ? JNE : JE, address);
+        *terminates = true;
+        break;
+    case PNRIA_OP_6XKK:
+        emit_store8_imm(e, V(x), in->kk);
+        break;
+    case PNRIA_OP_7XKK:
+        // add byte [rdi + Vx], kk
+        emit8(e, 0x80); emit_mem(e, 0, V(x)); emit8(e, in->kk);
+        break;
+    case PNRIA_OP_8XY0:
+        emit_load8(e, EAX, V(y));
+        emit_store8(e, EAX, V(x));
+        break;
+    case PNRIA_OP_8XY1:
+    case PNRIA_OP_8XY2:
+    case PNRIA_OP_8XY3:
+        emit_load8(e, EAX, V(x));
+        emit_load8(e, ECX, V(y));
+        emit_alu(e, in->op == PNRIA_OP_8XY1 ? OR : in->op == PNRIA_OP_8XY2 ? AND : XOR, EAX, ECX);
+        emit_store8(e, EAX, V(x));
+        break;
+    // the flag instructions reload the registers after every store, keeping
+    // the results the interpreters give when x or y is F
+    case PNRIA_OP_8XY4:
+        emit_load8(e, EAX, V(x));
+        emit_load8(e, ECX, V(y));
+        emit_alu(e, ADD, EAX, ECX);
+        emit_store8(e, EAX, V(x));
+        emit_load8(e, ECX, V(y));
+        emit_load8(e, EDX, V(x));
+        emit8(e, 0xB8); emit32(e, 0xFF); // mov eax, 0xFF
+        emit_alu(e, SUB, EAX, EDX);
+        emit_alu(e, CMP, ECX, EAX);
+        emit_set_al(e, SETA);
+        emit_store8(e, EAX, V(0xF));
+        break;
+    case PNRIA_OP_8XY5:
+        emit_load8(e, ECX, V(y));
+        emit_load8(e, EAX, V(x));
+        emit_alu(e, CMP, ECX, EAX);
+        emit_set_al(e, SETBE);
+        emit_store8(e, EAX, V(0xF));
+        emit_load8(e, EAX, V(x));
+        emit_load8(e, ECX, V(y));
+        emit_alu(e, SUB, EAX, ECX);
+        emit_store8(e, EAX, V(x));
+        break;
+    case PNRIA_OP_8XY6:
+        emit_load8(e, EAX, V(x));
+        emit8(e, 0x83); emit8(e, 0xE0); emit8(e, 0x01); // and eax, 1
+        emit_store8(e, EAX, V(0xF));
+        emit_load8(e, EAX, V(x));
+        emit8(e, 0xD1); emit8(e, 0xE8); // shr eax, 1
+        emit_store8(e, EAX, V(x));
+        break;
+    case PNRIA_OP_8XY7:
+        emit_load8(e, EAX, V(x));
+        emit_load8(e, ECX, V(y));
+        emit_alu(e, CMP, EAX, ECX);
+        emit_set_al(e, SETBE);
+        emit_store8(e, EAX, V(0xF));
+        emit_load8(e, ECX, V(y));
+        emit_load8(e, EAX, V(x));
+        emit_alu(e, SUB, ECX, EAX);
+        emit_store8(e, ECX, V(x));
+        break;
+    case PNRIA_OP_8XYE:
+        emit_load8(e, EAX, V(x));
+        emit8(e, 0xC1); emit8(e, 0xE8); emit8(e, 0x07); // shr eax, 7
+        emit_store8(e, EAX, V(0xF));
+        emit_load8(e, EAX, V(x));
+        emit8(e, 0xD1); emit8(e, 0xE0); // shl eax, 1
+        emit_store8(e, EAX, V(x));
+        break;
+    case PNRIA_OP_ANNN:
+        emit_store16_imm(e, OFFSET(I), in->nnn);
+        break;
+    case PNRIA_OP_BNNN:
+        emit_load8(e, EAX, V(0));
+        emit8(e, 0x05); emit32(e, in->nnn); // add eax, nnn
+        emit_store16(e, EAX, OFFSET(PC));
+        *terminates = true;
+        break;
+    case PNRIA_OP_EX9E:
+    case PNRIA_OP_EXA1:
+        emit_load8(e, EAX, V(x));
+        // cmp byte [rdi + rax + key], 0
+        emit8(e, 0x80); emit8(e, 0xBC); emit8(e, 0x07);
+        emit32(e, OFFSET(key));
+        emit8(e, 0x00);
+        emit_skip(e, in->op == PNRIA_OP_EX9E ? JE : JNE, address);
+        *terminates = true;
+        break;
+    case PNRIA_OP_FX07:
+        emit_load8(e, EAX, OFFSET(delay));
+        emit_store8(e, EAX, V(x));
+        break;
+    case PNRIA_OP_FX15:
+        emit_load8(e, EAX, V(x));
+        emit_store8(e, EAX, OFFSET(delay));
+        break;
+    case PNRIA_OP_FX18:
+        emit_load8(e, EAX, V(x));
+        emit_store8(e, EAX, OFFSET(sound));
+        break;
+    case PNRIA_OP_FX1E:
+        emit_load16(e, EAX, OFFSET(I));
+        emit_load8(e, ECX, V(x));
+        emit_alu(e, ADD, EAX, ECX);
+        emit8(e, 0x3D); emit32(e, 0xFFF); // cmp eax, 0xFFF
+        emit_set_al(e, SETA);
+        emit_store8(e, EAX, V(0xF));
+        emit_load16(e, EAX, OFFSET(I));
+        emit_load8(e, ECX, V(x));
+        emit_alu(e, ADD, EAX, ECX);
+        emit_store16(e, EAX, OFFSET(I));
+        break;
+    case PNRIA_OP_FX29:
+        emit_load8(e, EAX, V(x));
+        emit8(e, 0x8D); emit8(e, 0x04); emit8(e, 0x80); // lea eax, [rax + rax * 4]
+        emit_store16(e, EAX, OFFSET(I));
+        break;
+    default:
+        // memory writes, drawing, random numbers and key waits are left to
+        // the interpreter
+        return false;
+    }
+
+    if (*terminates) {
+        emit_store16_imm(e, OFFSET(opcode), in->opcode);
+        emit8(e, 0x48); emit8(e, 0xFF); emit8(e, 0xCE); // dec rsi
+        emit_return(e);
+        return true;
+    }
+
+    emit8(e, 0x48); emit8(e, 0xFF); emit8(e, 0xCE); // dec rsi
+
+    // jnz over the exit taken when the cycles run out
+    emit8(e, 0x75);
+    unsigned char *jump = e->p;
+    emit8(e, 0);
+    emit_exit(e, address + PNRIA_OPCODE_SIZE, in->opcode);
+    *jump = e->p - jump - 1;
+
+    return true;
+}
+
+static void pnria_jit_flush(pnria_jit_t *jit)
+{
+    pnria_debug("Dropping %zu bytes of translated code", jit->used);
+    jit->used = 0;
+    memset(jit->blocks, 0, sizeof(jit->blocks));
+    memset(jit->translated, 0, sizeof(jit->translated));
+}
+
+// changes the protection of the pages holding code[start, end)
+static bool pnria_jit_protect(pnria_jit_t *jit, size_t start, size_t end, int protection)
+{
+    start &= ~(jit->pageSize - 1);
+    end = (end + jit->pageSize - 1) & ~(jit->pageSize - 1);
+    if (mprotect(jit->code + start, end - start, protection) != 0) {
+        pnria_error("Error protecting the jit code: %s", strerror(errno));
+        return false;
+    }
+    return true;
+}
+
+// runs the instruction at start with the interpreter, until it's rewritten
+static pnria_block_t pnria_jit_interpreted(pnria_jit_t *jit, uint16_t start)
+{
+    jit->translated[start] = 1;
+    if (start + 1 < PNRIA_MEMORY_SIZE) {
+        jit->translated[start + 1] = 1;
+    }
+    jit->blocks[start] = pnria_jit_interpret;
+    return jit->blocks[start];
+}
+
+// NULL when the code can't be made writable or executable
+static pnria_block_t pnria_jit_translate(pnria_ctx_t *ctx, uint16_t start)
+{
+    pnria_jit_t *jit = ctx->jit;
+    size_t maxSize = PNRIA_JIT_MAX_INSTRUCTION_SIZE * (PNRIA_JIT_MAX_BLOCK + 1);
+
+    if (jit->used + maxSize > PNRIA_JIT_CODE_SIZE) {
+        pnria_jit_flush(jit);
+    }
+
+    size_t writable = jit->used;
+    if (!pnria_jit_protect(jit, writable, writable + maxSize, PROT_READ | PROT_WRITE)) {
+        return NULL;
+    }
+
+    pnria_emitter_t e = { jit->code + jit->used };
+    unsigned char *entry = e.p;
+
+    uint16_t address = start;
+    uint16_t opcode = 0;
+    int count = 0;
+    bool terminates = false;
+
+    while (count < PNRIA_JIT_MAX_BLOCK && address + 1 < PNRIA_MEMORY_SIZE && !terminates) {
+        pnria_instruction_t in = pnria_decode(ctx->chip8.memory[address] << 8 | ctx->chip8.memory[address + 1]);
+
+        if (!pnria_jit_emit(&e, &in, address, &terminates)) {
+            break;
+        }
+
+        jit->translated[address] = 1;
+        jit->translated[address + 1] = 1;
+        opcode = in.opcode;
+        address += PNRIA_OPCODE_SIZE;
+        ++count;
+    }
+
+    if (count > 0 && !terminates) {
+        emit_exit(&e, address, opcode);
+    }
+
+    // nothing runs from pages that didn't go back to executable
+    if (!pnria_jit_protect(jit, writable, writable + maxSize, PROT_READ | PROT_EXEC)) {
+        pnria_jit_flush(jit);
+        return NULL;
+    }
+
+    if (count == 0) {
+        return pnria_jit_interpreted(jit, start);
+    }
+
+    pnria_trace("Translated %d instructions at 0x%X, %d bytes", count, start, (int)(e.p - entry));
+
+    jit->used = e.p - jit->code;
+    jit->blocks[start] = (pnria_block_t)(void *)entry;
+    return jit->blocks[start];
+}
+
+static pnria_jit_t *pnria_jit_create()
+{
+    pnria_jit_t *jit = calloc(1, sizeof(pnria_jit_t));
+    if (!jit) {
+        pnria_error("Error allocating the jit");
+        return NULL;
+    }
+
+    jit->pageSize = sysconf(_SC_PAGESIZE);
+    jit->code = mmap(NULL, PNRIA_JIT_CODE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (jit->code == MAP_FAILED) {
+        pnria_error("Error mapping memory for the jit");
+        free(jit);
+        return NULL;
+    }
+
+    return jit;
+}
+
+void pnria_jit_destroy(pnria_jit_t *jit)
+{
+    munmap(jit->code, PNRIA_JIT_CODE_SIZE);
+    free(jit);
+}
+
+void pnria_jit_run(pnria_ctx_t *ctx, long cycles)
+{
+    if (!ctx->jit && !(ctx->jit = pnria_jit_create())) {
+        pnria_warn("Jit unavailable, using the threaded backend");
+        ctx->backend = PNRIA_BACKEND_THREADED;
+        pnria_threaded_run(ctx, cycles);
+        return;
+    }
+
+    pnria_jit_t *jit = ctx->jit;
+
+    while (cycles > 0 && ctx->chip8.PC < PNRIA_MEMORY_SIZE) {
+        pnria_block_t block = jit->blocks[ctx->chip8.PC];
+        if (!block && !(block = pnria_jit_translate(ctx, ctx->chip8.PC))) {
+            pnria_warn("Jit unavailable, using the threaded backend");
+            ctx->backend = PNRIA_BACKEND_THREADED;
+            pnria_threaded_run(ctx, cycles);
+            return;
+        }
+
+        if (block == pnria_jit_interpret) {
+            pnria_threaded_run(ctx, 1);
+            --cycles;
+            continue;
+        }
+
+        // blocks stop at the end of the frame, the timers tick in between
+        long budget = cycles < ctx->frameCycles ? cycles : ctx->frameCycles;
+        long ran = budget - block(&ctx->chip8, budget);
+        cycles -= ran;
+        pnria_advance(ctx, ran);
+    }
+}
+
+void pnria_jit_invalidate(pnria_ctx_t *ctx, unsigned int start, unsigned int end)
+{
+    for (unsigned int address = start; address < end; ++address) {
+        if (ctx->jit->translated[address]) {
+            pnria_jit_flush(ctx->jit);
+            return;
+        }
+    }
+}
+
+#endif // PNRIA_JIT
@@ -0,0 +1,417 @@
+#include "panaroia_p.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+
+// A rom is loaded once and kept as the memory a context has right after
+// loading it, both whole, as the image save states compare against, and in
+// pages shared with the contexts it's loaded in. Loading it points the
+// context's image at the rom's and copies only the pages of memory that
+// differ, so a new session of the same rom on a context costs the pages the
+// previous one wrote. Roms are indexed by the hash of their bytes and by the
+// files they were read from, in open addressing tables of indexes plus one.
+
+#define PNRIA_ROM_MAX_SIZE (PNRIA_MEMORY_SIZE - PNRIA_START_OFFSET)
+
+struct pnria_rom {
+    char *name;
+    uint64_t hash;
+    size_t size;
+    // set while contexts on other threads may be loading the rom
+    atomic_int cyclesPerFrame;
+
+    uint32_t imageHash;
+    unsigned char image[PNRIA_MEMORY_SIZE];
+    pnria_page_t *pages[PNRIA_PAGE_COUNT];
+};
+
+typedef struct {
+    char *path;
+    pnria_rom_t *rom;
+} pnria_library_file_t;
+
+struct pnria_library {
+    pthread_mutex_t lock;
+
+    pnria_rom_t **roms;
+    int count;
+    int capacity;
+
+    pnria_library_file_t *files;
+    int fileCount;
+    int fileCapacity;
+
+    // both tables have the same capacity, at least twice the entries
+    int *byHash;
+    int *byPath;
+    size_t slots;
+};
+
+static uint64_t pnria_path_hash(const char *path)
+{
+    return pnria_hash64(path, strlen(path));
+}
+
+static void pnria_index_insert(int *table, size_t slots, uint64_t hash, int index)
+{
+    size_t slot = hash & (slots - 1);
+    while (table[slot]) {
+        slot = (slot + 1) & (slots - 1);
+    }
+    table[slot] = index + 1;
+}
+
+static pnria_rom_t *pnria_library_find_bytes(pnria_library_t *library, const void *bytes, size_t size,
+                                              uint64_t hash)
+{
+    if (library->slots == 0) {
+        return NULL;
+    }
+
+    for (size_t slot = hash & (library->slots - 1); library->byHash[slot];
+         slot = (slot + 1) & (library->slots - 1)) {
+        pnria_rom_t *rom = library->roms[library->byHash[slot] - 1];
+        if (rom->hash == hash && (!bytes ||
+            (rom->size == size && memcmp(rom->image + PNRIA_START_OFFSET, bytes, size) == 0))) {
+            return rom;
+        }
+    }
+    return NULL;
+}
+
+static pnria_rom_t *pnria_library_find_file(pnria_library_t *library, const char *path)
+{
+    if (library->slots == 0) {
+        return NULL;
+    }
+
+    for (size_t slot = pnria_path_hash(path) & (library->slots - 1); library->byPath[slot];
+         slot = (slot + 1) & (library->slots - 1)) {
+        pnria_library_file_t *file = &library->files[library->byPath[slot] - 1];
+        if (strcmp(file->path, path) == 0) {
+            return file->rom;
+        }
+    }
+    return NULL;
+}
+
+// makes room for one more rom and one more file
+static bool pnria_library_reserve(pnria_library_t *library)
+{
+    if (library->count == library->capacity) {
+        int capacity = library->capacity ? library->capacity * 2 : 64;
+        pnria_rom_t **roms = realloc(library->roms, capacity * sizeof(pnria_rom_t *));
+        if (!roms) {
+            return false;
+        }
+        library->roms = roms;
+        library->capacity = capacity;
+    }
+
+    if (library->fileCount == library->fileCapacity) {
+        int capacity = library->fileCapacity ? library->fileCapacity * 2 : 64;
+        pnria_library_file_t *files = realloc(library->files, capacity * sizeof(pnria_library_file_t));
+        if (!files) {
+            return false;
+        }
+        library->files = files;
+        library->fileCapacity = capacity;
+    }
+
+    size_t entries = library->count > library->fileCount ? library->count : library->fileCount;
+    if ((entries + 1) * 2 <= library->slots) {
+        return true;
+    }
+
+    size_t slots = library->slots ? library->slots * 2 : 128;
+    int *byHash = calloc(slots, sizeof(int));
+    int *byPath = calloc(slots, sizeof(int));
+    if (!byHash || !byPath) {
+        free(byHash);
+        free(byPath);
+        return false;
+    }
+
+    for (int i = 0; i < library->count; ++i) {
+        pnria_index_insert(byHash, slots, library->roms[i]->hash, i);
+    }
+    for (int i = 0; i < library->fileCount; ++i) {
+        pnria_index_insert(byPath, slots, pnria_path_hash(library->files[i].path), i);
+    }
+
+    free(library->byHash);
+    free(library->byPath);
+    library->byHash = byHash;
+    library->byPath = byPath;
+    library->slots = slots;
+
+    return true;
+}
+
+static void pnria_rom_destroy(pnria_rom_t *rom)
+{
+    for (int i = 0; i < PNRIA_PAGE_COUNT; ++i) {
+        pnria_page_release(rom->pages[i]);
+    }
+    free(rom->name);
+    free(rom);
+}
+
+// a context builds the image, the same memory it has after loading the rom
+static pnria_rom_t *pnria_rom_create(const char *name, const void *bytes, size_t size, uint64_t hash)
+{
+    pnria_rom_t *rom = calloc(1, sizeof(pnria_rom_t));
+    pnria_ctx_t *ctx = pnria_create();
+    if (!rom || !ctx || !pnria_ctx_load_buffer(ctx, bytes, size)) {
+        free(rom);
+        pnria_destroy(ctx);
+        return NULL;
+    }
+
+    memcpy(rom->image, ctx->image, PNRIA_MEMORY_SIZE);
+    rom->imageHash = ctx->imageHash;
+    rom->hash = hash;
+    rom->size = size;
+    pnria_destroy(ctx);
+
+    rom->name = strdup(name);
+    if (!rom->name || !pnria_pages_create(rom->pages, rom->image)) {
+        pnria_error("Error allocating rom %s: %s", name, strerror(errno));
+        pnria_rom_destroy(rom);
+        return NULL;
+    }
+
+    return rom;
+}
+
+// the rom with the bytes, added if there's none yet, with the library locked
+static pnria_rom_t *pnria_library_add_locked(pnria_library_t *library, const char *name, const void *bytes,
+                                             size_t size)
+{
+    if (size > PNRIA_ROM_MAX_SIZE) {
+        pnria_error("ROM bigger than the available memory, %zu bytes", size);
+        return NULL;
+    }
+
+    uint64_t hash = pnria_hash64(bytes, size);
+    pnria_rom_t *rom = pnria_library_find_bytes(library, bytes, size, hash);
+    if (rom) {
+        return rom;
+    }
+
+    if (!pnria_library_reserve(library)) {
+        pnria_error("Error allocating library: %s", strerror(errno));
+        return NULL;
+    }
+
+    rom = pnria_rom_create(name, bytes, size, hash);
+    if (!rom) {
+        return NULL;
+    }
+
+    library->roms[library->count] = rom;
+    pnria_index_insert(library->byHash, library->slots, hash, library->count);
+    ++library->count;
+
+    return rom;
+}
+
+pnria_library_t *pnria_library_create()
+{
+    pnria_library_t *library = calloc(1, sizeof(pnria_library_t));
+    if (!library) {
+        pnria_error("Error allocating library: %s", strerror(errno));
+        return NULL;
+    }
+
+    pthread_mutex_init(&library->lock, NULL);
+
+    return library;
+}
+
+void pnria_library_destroy(pnria_library_t *library)
+{
+    if (!library) {
+        return;
+    }
+
+    for (int i = 0; i < library->count; ++i) {
+        pnria_rom_destroy(library->roms[i]);
+    }
+    for (int i = 0; i < library->fileCount; ++i) {
+        free(library->files[i].path);
+    }
+    free(library->roms);
+    free(library->files);
+    free(library->byHash);
+    free(library->byPath);
+    pthread_mutex_destroy(&library->lock);
+    free(library);
+}
+
+// the size of the rom read into bytes, or -1
+static long pnria_library_read(const char *romFile, unsigned char *bytes)
+{
+    long size = -1;
+    FILE *file = fopen(romFile, "rb");
+    if (file) {
+        if (fseek(file, 0, SEEK_END) == 0 && (size = ftell(file)) >= 0 && size <= PNRIA_ROM_MAX_SIZE) {
+            rewind(file);
+            size = (long)fread(bytes, 1, size, file) == size ? size : -1;
+        } else if (size > PNRIA_ROM_MAX_SIZE) {
+            pnria_error("ROM bigger than the available memory, %ld bytes", size);
+            size = -1;
+        }
+        fclose(file);
+    }
+
+    if (size < 0) {
+        pnria_error("Error reading %s", romFile);
+    }
+    return size;
+}
+
+pnria_rom_t *pnria_library_add(pnria_library_t *library, const char *romFile)
+{
+    pthread_mutex_lock(&library->lock);
+    pnria_rom_t *rom = pnria_library_find_file(library, romFile);
+    pthread_mutex_unlock(&library->lock);
+    if (rom) {
+        return rom;
+    }
+
+    // read unlocked so other threads aren't held up by the disk
+    unsigned char bytes[PNRIA_ROM_MAX_SIZE];
+    long size = pnria_library_read(romFile, bytes);
+    if (size < 0) {
+        return NULL;
+    }
+
+    pthread_mutex_lock(&library->lock);
+
+    // another thread may have added the file while it was read
+    rom = pnria_library_find_file(library, romFile);
+    if (rom) {
+        pthread_mutex_unlock(&library->lock);
+        return rom;
+    }
+
+    // a file with the same bytes as one added before is another name of its rom
+    const char *name = strrchr(romFile, '/');
+    rom = pnria_library_reserve(library) ? pnria_library_add_locked(library, name ? name + 1 : romFile, bytes, size)
+                                         : NULL;
+
+    char *path = rom ? strdup(romFile) : NULL;
+    if (path) {
+        library->files[library->fileCount] = (pnria_library_file_t) { path, rom };
+        pnria_index_insert(library->byPath, library->slots, pnria_path_hash(path), library->fileCount);
+        ++library->fileCount;
+    }
+
+    pthread_mutex_unlock(&library->lock);
+    return rom;
+}
+
+pnria_rom_t *pnria_library_add_buffer(pnria_library_t *library, const char *name, const void *rom, size_t size)
+{
+    pthread_mutex_lock(&library->lock);
+    pnria_rom_t *added = pnria_library_add_locked(library, name ? name : "", rom, size);
+    pthread_mutex_unlock(&library->lock);
+
+    return added;
+}
+
+int pnria_library_add_directory(pnria_library_t *library, const char *directory)
+{
+    DIR *dir = opendir(directory);
+    if (!dir) {
+        pnria_error("Error opening %s: %s", directory, strerror(errno));
+        return -1;
+    }
+
+    int added = 0;
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        const char *extension = strrchr(entry->d_name, '.');
+        if (entry->d_name[0] == '.' || (extension && strcmp(extension, ".txt") == 0)) {
+            continue;
+        }
+
+        char path[4096];
+        snprintf(path, sizeof(path), "%s/%s", directory, entry->d_name);
+        added += pnria_library_add(library, path) != NULL;
+    }
+    closedir(dir);
+
+    return added;
+}
+
+int pnria_library_size(pnria_library_t *library)
+{
+    pthread_mutex_lock(&library->lock);
+    int count = library->count;
+    pthread_mutex_unlock(&library->lock);
+
+    return count;
+}
+
+pnria_rom_t *pnria_library_get(pnria_library_t *library, int index)
+{
+    pthread_mutex_lock(&library->lock);
+    pnria_rom_t *rom = index >= 0 && index < library->count ? library->roms[index] : NULL;
+    pthread_mutex_unlock(&library->lock);
+
+    return rom;
+}
+
+pnria_rom_t *pnria_library_find(pnria_library_t *library, uint64_t hash)
+{
+    pthread_mutex_lock(&library->lock);
+    pnria_rom_t *rom = pnria_library_find_bytes(library, NULL, 0, hash);
+    pthread_mutex_unlock(&library->lock);
+
+    return rom;
+}
+
+const char *pnria_rom_name(const pnria_rom_t *rom)
+{
+    return rom->name;
+}
+
+uint64_t pnria_rom_hash(const pnria_rom_t *rom)
+{
+    return rom->hash;
+}
+
+size_t pnria_rom_size(const pnria_rom_t *rom)
+{
+    return rom->size;
+}
+
+void pnria_rom_set_cycles_per_frame(pnria_rom_t *rom, int cycles)
+{
+    if (cycles < 0) {
+        pnria_error("Invalid cycles per frame: %d", cycles);
+        return;
+    }
+    atomic_store(&rom->cyclesPerFrame, cycles);
+}
+
+int pnria_rom_get_cycles_per_frame(const pnria_rom_t *rom)
+{
+    return atomic_load(&rom->cyclesPerFrame);
+}
+
+void pnria_ctx_load_rom(pnria_ctx_t *ctx, const pnria_rom_t *rom)
+{
+    pnria_info("Loading %s...", rom->name);
+
+    pnria_set_image(ctx, rom->image, rom->imageHash, rom->pages);
+    int cycles = atomic_load(&rom->cyclesPerFrame);
+    if (cycles > 0) {
+        ctx->cyclesPerFrame = cycles;
+    }
+    pnria_ctx_restart(ctx);
+}
@@ -1,457 +1,678 @@
-#include "panaroia/panaroia.h"
+#include "panaroia_p.h"
 
 #include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdbool.h>
-#include <time.h>
 
-#include "log.h"
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
-#define __FILENAME__ (strrchr(__FILE__, '/') ? strrchr(__FILE__, '/') + 1 : __FILE__)
+int pnria_log_level = PNRIA_LOG_LEVEL;
 
-#define pnria_trace(...) log_log(LOG_TRACE, __FILENAME__, __LINE__, __VA_ARGS__)
-#define pnria_debug(...) log_log(LOG_DEBUG, __FILENAME__, __LINE__, __VA_ARGS__)
-#define pnria_info(...)  log_log(LOG_INFO,  __FILENAME__, __LINE__, __VA_ARGS__)
-#define pnria_warn(...)  log_log(LOG_WARN,  __FILENAME__, __LINE__, __VA_ARGS__)
-#define pnria_error(...) log_log(LOG_ERROR, __FILENAME__, __LINE__, __VA_ARGS__)
-#define pnria_fatal(...) log_log(LOG_FATAL, __FILENAME__, __LINE__, __VA_ARGS__)
+// instance used by the context-less api
+static pnria_ctx_t pnria_default_ctx = {
+    .backend = PNRIA_DEFAULT_BACKEND,
+    .cyclesPerFrame = PNRIA_CYCLES_PER_FRAME,
+    // the empty image, so loading works before any init
+    .image = pnria_default_ctx.ownImage
+};
 
-static pnria_state_t chip8;
+pnria_state_t pnria_ctx_get_state(pnria_ctx_t *ctx)
+{
+    return ctx->chip8;
+}
 
-pnria_state_t pnria_get_state()
+const pnria_state_t *pnria_ctx_view_state(pnria_ctx_t *ctx)
 {
-    return chip8;
+    return &ctx->chip8;
 }
 
-void pnria_set_input(const char *key)
+unsigned short pnria_ctx_get_pc(pnria_ctx_t *ctx)
+{
+    return ctx->chip8.PC;
+}
+
+unsigned short pnria_ctx_get_i(pnria_ctx_t *ctx)
+{
+    return ctx->chip8.I;
+}
+
+unsigned short pnria_ctx_get_opcode(pnria_ctx_t *ctx)
+{
+    return ctx->chip8.opcode;
+}
+
+unsigned char pnria_ctx_get_register(pnria_ctx_t *ctx, int x)
 {
-#if !defined(NDEBUG)
+    return ctx->chip8.V[x & 0xF];
+}
+
+unsigned char pnria_ctx_get_delay(pnria_ctx_t *ctx)
+{
+    return ctx->chip8.delay;
+}
+
+unsigned char pnria_ctx_get_sound(pnria_ctx_t *ctx)
+{
+    return ctx->chip8.sound;
+}
+
+void pnria_ctx_set_input(pnria_ctx_t *ctx, const char *key)
+{
+#if PNRIA_LOG_LEVEL <= PNRIA_LOG_DEBUG
     for (int i = 0; i < 16; ++i) {
-        if (chip8.key[i]) {
+        if (ctx->chip8.key[i]) {
             pnria_debug("Key[%d]: pressed", i);
         }
     }
 #endif
-    memcpy(chip8.key, key, 16);
+    // replays set the recorded keys themselves
+    if (ctx->recording && ctx->replaying) {
+        return;
+    }
+
+    memcpy(ctx->chip8.key, key, 16);
+
+    if (ctx->recording) {
+        pnria_recording_input(ctx);
+    }
 }
 
-unsigned char *pnria_get_screen()
+unsigned char *pnria_ctx_get_screen(pnria_ctx_t *ctx)
 {
-    return chip8.screen;
+    if (ctx->pixelsGeneration == ctx->generation) {
+        return ctx->pixels;
+    }
+
+    for (int row = 0; row < PNRIA_SCREEN_HEIGHT; ++row) {
+        uint64_t line = ctx->chip8.screen[row];
+        unsigned char *pixel = &ctx->pixels[row * PNRIA_SCREEN_WIDTH];
+        for (int column = 0; column < PNRIA_SCREEN_WIDTH; ++column) {
+            pixel[column] = (line >> (63 - column)) & 1;
+        }
+    }
+    ctx->pixelsGeneration = ctx->generation;
+    return ctx->pixels;
+}
+
+unsigned long pnria_ctx_get_screen_generation(pnria_ctx_t *ctx)
+{
+    return ctx->generation;
+}
+
+uint32_t pnria_ctx_get_dirty_rows(pnria_ctx_t *ctx)
+{
+    return ctx->dirtyRows;
+}
+
+bool pnria_ctx_get_dirty_rect(pnria_ctx_t *ctx, int *x, int *y, int *width, int *height)
+{
+    if (!ctx->dirtyRows) {
+        *x = *y = *width = *height = 0;
+        return false;
+    }
+
+    *x = __builtin_clzll(ctx->dirtyColumns);
+    *width = PNRIA_SCREEN_WIDTH - __builtin_ctzll(ctx->dirtyColumns) - *x;
+    *y = __builtin_ctz(ctx->dirtyRows);
+    *height = PNRIA_SCREEN_HEIGHT - __builtin_clz(ctx->dirtyRows) - *y;
+    return true;
+}
+
+void pnria_ctx_clear_dirty(pnria_ctx_t *ctx)
+{
+    ctx->dirtyRows = 0;
+    ctx->dirtyColumns = 0;
 }
 
 // handlers: take a pointer to an instruction and pass the correct arguments
 
-typedef void (*pnria_nnn_function_t)(unsigned short value);
-void pnria_nnn_handler(unsigned short opcode, pnria_nnn_function_t instruction)
+typedef void (*pnria_nnn_function_t)(pnria_ctx_t *ctx, unsigned short value);
+void pnria_nnn_handler(pnria_ctx_t *ctx, unsigned short opcode, pnria_nnn_function_t instruction)
 {
-    unsigned short nnn = chip8.opcode & 0x0FFF;
+    unsigned short nnn = ctx->chip8.opcode & 0x0FFF;
     pnria_debug("Argument(nnn): 0x%X", nnn);
-    instruction(nnn);
+    instruction(ctx, nnn);
 }
 
-typedef void (*pnria_xkk_function_t)(unsigned short x, unsigned char k);
-void pnria_xkk_handler(unsigned short opcode, pnria_xkk_function_t instruction)
+typedef void (*pnria_xkk_function_t)(pnria_ctx_t *ctx, unsigned short x, unsigned char k);
+void pnria_xkk_handler(pnria_ctx_t *ctx, unsigned short opcode, pnria_xkk_function_t instruction)
 {
-    unsigned short x = (chip8.opcode & 0x0F00) >> 8;
-    char k = chip8.opcode & 0x00FF;
+    unsigned short x = (ctx->chip8.opcode & 0x0F00) >> 8;
+    char k = ctx->chip8.opcode & 0x00FF;
     pnria_debug("Arguments(x, kk): 0x%X, 0x%X", x, k);
-    instruction(x, k);
+    instruction(ctx, x, k);
 }
 
-typedef void (*pnria_xyn_function_t)(unsigned short x, unsigned short y, unsigned short n);
-void pnria_xyn_handler(unsigned short opcode, pnria_xyn_function_t instruction)
+typedef void (*pnria_xyn_function_t)(pnria_ctx_t *ctx, unsigned short x, unsigned short y, unsigned short n);
+void pnria_xyn_handler(pnria_ctx_t *ctx, unsigned short opcode, pnria_xyn_function_t instruction)
 {
-    unsigned short x = (chip8.opcode & 0x0F00) >> 8;
-    unsigned short y = (chip8.opcode & 0x00F0) >> 4;
-    unsigned short n = chip8.opcode & 0x000F;
+    unsigned short x = (ctx->chip8.opcode & 0x0F00) >> 8;
+    unsigned short y = (ctx->chip8.opcode & 0x00F0) >> 4;
+    unsigned short n = ctx->chip8.opcode & 0x000F;
     pnria_debug("Arguments(x, y, n): 0x%X, 0x%X, 0x%X", x, y, n);
-    instruction(x, y, n);
+    instruction(ctx, x, y, n);
 }
 
-typedef void (*pnria_xy_function_t)(unsigned short x, unsigned short y);
-void pnria_xy_handler(unsigned short opcode, pnria_xy_function_t instruction)
+typedef void (*pnria_xy_function_t)(pnria_ctx_t *ctx, unsigned short x, unsigned short y);
+void pnria_xy_handler(pnria_ctx_t *ctx, unsigned short opcode, pnria_xy_function_t instruction)
 {
-    unsigned short x = (chip8.opcode & 0x0F00) >> 8;
-    unsigned short y = (chip8.opcode & 0x00F0) >> 4;
+    unsigned short x = (ctx->chip8.opcode & 0x0F00) >> 8;
+    unsigned short y = (ctx->chip8.opcode & 0x00F0) >> 4;
     pnria_debug("Arguments(x, y): 0x%X, 0x%X", x, y);
-    instruction(x, y);
+    instruction(ctx, x, y);
 }
 
-typedef void (*pnria_x_function_t)(unsigned short x);
-void pnria_x_handler(unsigned short opcode, pnria_x_function_t instruction)
+typedef void (*pnria_x_function_t)(pnria_ctx_t *ctx, unsigned short x);
+void pnria_x_handler(pnria_ctx_t *ctx, unsigned short opcode, pnria_x_function_t instruction)
 {
-    unsigned short x = (chip8.opcode & 0x0F00) >> 8;
+    unsigned short x = (ctx->chip8.opcode & 0x0F00) >> 8;
     pnria_debug("Argument(x): 0x%X", x);
-    instruction(x);
+    instruction(ctx, x);
+}
+
+void pnria_invalidate(pnria_ctx_t *ctx, unsigned int start, unsigned int end)
+{
+    if (end > PNRIA_MEMORY_SIZE) {
+        end = PNRIA_MEMORY_SIZE;
+    }
+
+    if (start >= end) {
+        return;
+    }
+
+    // an instruction starting one byte before the range also overlaps it
+    unsigned int first = start > 0 ? (start - 1) / PNRIA_OPCODE_SIZE : 0;
+    unsigned int last = (end - 1) / PNRIA_OPCODE_SIZE;
+
+    for (unsigned int i = first; i <= last; ++i) {
+        ctx->cache[i].tag = 0;
+    }
+
+    for (unsigned int page = start / PNRIA_PAGE_SIZE; page <= (end - 1) / PNRIA_PAGE_SIZE; ++page) {
+        pnria_page_release(ctx->pages[page]);
+        ctx->pages[page] = NULL;
+    }
+
+#if defined(PNRIA_JIT)
+    if (ctx->jit) {
+        pnria_jit_invalidate(ctx, start, end);
+    }
+#endif
 }
 
 // clear screen
-static void pnria_00e0()
+static void pnria_00e0(pnria_ctx_t *ctx)
 {
     pnria_debug("00E0");
-    memset(chip8.screen, 0, PNRIA_SCREEN_SIZE);
+    uint32_t rows = 0;
+    uint64_t columns = 0;
+    for (int row = 0; row < PNRIA_SCREEN_HEIGHT; ++row) {
+        if (ctx->chip8.screen[row]) {
+            rows |= 1u << row;
+            columns |= ctx->chip8.screen[row];
+        }
+    }
+    memset(ctx->chip8.screen, 0, sizeof(ctx->chip8.screen));
+    pnria_mark_dirty(ctx, rows, columns);
 }
 
 // return from subroutine
-static void pnria_00ee()
+static void pnria_00ee(pnria_ctx_t *ctx)
 {
     pnria_debug("00EE");
-    --chip8.SP;
-    chip8.PC = chip8.stack[chip8.SP];
-    chip8.PC += PNRIA_OPCODE_SIZE;
+    --ctx->chip8.SP;
+    ctx->chip8.PC = ctx->chip8.stack[ctx->chip8.SP];
+    ctx->chip8.PC += PNRIA_OPCODE_SIZE;
 }
 
 // jump to NNN
-static void pnria_1nnn(unsigned short nnn)
+static void pnria_1nnn(pnria_ctx_t *ctx, unsigned short nnn)
 {
     pnria_debug("1NNN, nnn: %X", nnn);
-    chip8.PC = nnn;
+    ctx->chip8.PC = nnn;
 }
 
 // call NNN
-static void pnria_2nnn(unsigned short nnn)
+static void pnria_2nnn(pnria_ctx_t *ctx, unsigned short nnn)
 {
     pnria_debug("2NNN, nnn: %X", nnn);
     // store PC - opcode size because PC incremented in pnria_execute
-    chip8.stack[chip8.SP] = chip8.PC - PNRIA_OPCODE_SIZE;
-    ++chip8.SP;
-    chip8.PC = nnn;
+    ctx->chip8.stack[ctx->chip8.SP] = ctx->chip8.PC - PNRIA_OPCODE_SIZE;
+    ++ctx->chip8.SP;
+    ctx->chip8.PC = nnn;
 }
 
 #define SKIPIF(condition) {                       \
-    if (condition) chip8.PC += PNRIA_OPCODE_SIZE; \
+    if (condition) ctx->chip8.PC += PNRIA_OPCODE_SIZE; \
 }
 
 // skip next instruction if Vx == kk
-static void pnria_3xkk(unsigned short x, unsigned char kk)
+static void pnria_3xkk(pnria_ctx_t *ctx, unsigned short x, unsigned char kk)
 {
     pnria_debug("3XKK, x: %X, kk: %X", x, kk);
-    SKIPIF(chip8.V[x] == kk);
+    SKIPIF(ctx->chip8.V[x] == kk);
 }
 
 // skip next instruction if Vx != kk
-static void pnria_4xkk(unsigned short x, unsigned char kk)
+static void pnria_4xkk(pnria_ctx_t *ctx, unsigned short x, unsigned char kk)
 {
     pnria_debug("4XKK, x: %X, kk: %X", x, kk);
-    SKIPIF(chip8.V[x] != kk);
+    SKIPIF(ctx->chip8.V[x] != kk);
 }
 
 // skip next instruction if Vx == Vy
-static void pnria_5xy0(unsigned short x, unsigned short y)
+static void pnria_5xy0(pnria_ctx_t *ctx, unsigned short x, unsigned short y)
 {
     pnria_debug("5XY0, x: %X, y: %X", x, y);
-    SKIPIF(chip8.V[x] == chip8.V[y]);
+    SKIPIF(ctx->chip8.V[x] == ctx->chip8.V[y]);
 }
 
 // load kk into Vx
-static void pnria_6xkk(unsigned short x, unsigned char kk)
+static void pnria_6xkk(pnria_ctx_t *ctx, unsigned short x, unsigned char kk)
 {
     pnria_debug("6XKK, x: %X, kk: %X", x, kk);
-    chip8.V[x] = kk;
+    ctx->chip8.V[x] = kk;
 }
 
 // add kk to Vx
-static void pnria_7xkk(unsigned short x, unsigned char kk)
+static void pnria_7xkk(pnria_ctx_t *ctx, unsigned short x, unsigned char kk)
 {
     pnria_debug("7XKK, x: %X, kk: %X", x, kk);
-    chip8.V[x] += kk;
+    ctx->chip8.V[x] += kk;
 }
 
 // set Vx = Vy
-static void pnria_8xy0(unsigned short x, unsigned short y)
+static void pnria_8xy0(pnria_ctx_t *ctx, unsigned short x, unsigned short y)
 {
     pnria_debug("8XY0, x: %X, y: %X", x, y);
-    chip8.V[x] = chip8.V[y];
+    ctx->chip8.V[x] = ctx->chip8.V[y];
 }
 
 // set Vx = Vx OR Vy
-static void pnria_8xy1(unsigned short x, unsigned short y)
+static void pnria_8xy1(pnria_ctx_t *ctx, unsigned short x, unsigned short y)
 {
     pnria_debug("8XY1, x: %X, y: %X", x, y);
-    chip8.V[x] |= chip8.V[y];
+    ctx->chip8.V[x] |= ctx->chip8.V[y];
 }
 
 // set Vx = Vx AND Vy
-static void pnria_8xy2(unsigned short x, unsigned short y)
+static void pnria_8xy2(pnria_ctx_t *ctx, unsigned short x, unsigned short y)
 {
     pnria_debug("8XY2, x: %X, y: %X", x, y);
-    chip8.V[x] &= chip8.V[y];
+    ctx->chip8.V[x] &= ctx->chip8.V[y];
 }
 
 // set Vx = Vx XOR Vy
-static void pnria_8xy3(unsigned short x, unsigned short y)
+static void pnria_8xy3(pnria_ctx_t *ctx, unsigned short x, unsigned short y)
 {
     pnria_debug("8XY3, x: %X, y: %X", x, y);
-    chip8.V[x] ^= chip8.V[y];
+    ctx->chip8.V[x] ^= ctx->chip8.V[y];
 }
 
 // set Vx = Vx + Vy, if sum is greater than the capacity, set V[F] to carry
-static void pnria_8xy4(unsigned short x, unsigned short y)
+static void pnria_8xy4(pnria_ctx_t *ctx, unsigned short x, unsigned short y)
 {
     pnria_debug("8XY4, x: %X, y: %X", x, y);
-    chip8.V[x] += chip8.V[y];
-    chip8.V[0xF] = chip8.V[y] > (0xFF - chip8.V[x]) ? 1 : 0;
+    ctx->chip8.V[x] += ctx->chip8.V[y];
+    ctx->chip8.V[0xF] = ctx->chip8.V[y] > (0xFF - ctx->chip8.V[x]) ? 1 : 0;
 }
 
 // set Vx = Vx - Vy, if Vx > Vy, set V[F] to NOT borrow
-static void pnria_8xy5(unsigned short x, unsigned short y)
+static void pnria_8xy5(pnria_ctx_t *ctx, unsigned short x, unsigned short y)
 {
     pnria_debug("8XY5, x: %X, y: %X", x, y);
-    chip8.V[0xF] = chip8.V[y] > chip8.V[x] ? 0 : 1;
-    chip8.V[x] -= chip8.V[y];
+    ctx->chip8.V[0xF] = ctx->chip8.V[y] > ctx->chip8.V[x] ? 0 : 1;
+    ctx->chip8.V[x] -= ctx->chip8.V[y];
 }
 
 // if LSB of Vx is 1, V[F] is set to 1, them Vx is divided by 2 (SHR)
-static void pnria_8xy6(unsigned short x, unsigned short y)
+static void pnria_8xy6(pnria_ctx_t *ctx, unsigned short x, unsigned short y)
 {
     pnria_debug("8XY6, x: %X, y: %X", x, y);
-    chip8.V[0xF] = chip8.V[x] & 0x0001;
-    chip8.V[x] >>= 1;
+    ctx->chip8.V[0xF] = ctx->chip8.V[x] & 0x0001;
+    ctx->chip8.V[x] >>= 1;
 }
 
 // set Vx = Vy - Vx, set V[F] to NOT borrow
-static void pnria_8xy7(unsigned short x, unsigned short y)
+static void pnria_8xy7(pnria_ctx_t *ctx, unsigned short x, unsigned short y)
 {
     pnria_debug("8XY7, x: %X, y: %X", x, y);
-    chip8.V[0xF] = chip8.V[x] > chip8.V[y] ? 0 : 1;
-    chip8.V[x] = chip8.V[y] - chip8.V[x];
+    ctx->chip8.V[0xF] = ctx->chip8.V[x] > ctx->chip8.V[y] ? 0 : 1;
+    ctx->chip8.V[x] = ctx->chip8.V[y] - ctx->chip8.V[x];
 }
 
 // if LSB of Vx is 1, V[F] is set to 1, them Vx is multiplied by 2 (SHL)
-static void pnria_8xye(unsigned short x, unsigned short y)
+static void pnria_8xye(pnria_ctx_t *ctx, unsigned short x, unsigned short y)
 {
     pnria_debug("8XYE, x: %X, y: %X", x, y);
-    chip8.V[0xF] = chip8.V[x] >> 7;
-    chip8.V[x] <<= 1;
+    ctx->chip8.V[0xF] = ctx->chip8.V[x] >> 7;
+    ctx->chip8.V[x] <<= 1;
 }
 
 // skip next instruction if Vx != Vy
-static void pnria_9xy0(unsigned short x, unsigned short y)
+static void pnria_9xy0(pnria_ctx_t *ctx, unsigned short x, unsigned short y)
 {
     pnria_debug("9XY0, x: %X, y: %X", x, y);
-    SKIPIF(chip8.V[x] != chip8.V[y]);
+    SKIPIF(ctx->chip8.V[x] != ctx->chip8.V[y]);
 }
 
 // set index register to NNN
-static void pnria_annn(unsigned short nnn)
+static void pnria_annn(pnria_ctx_t *ctx, unsigned short nnn)
 {
     pnria_debug("ANNN, nnn: %X", nnn);
-    chip8.I = nnn;
+    ctx->chip8.I = nnn;
 }
 
 // jump to NNN + V0
-static void pnria_bnnn(unsigned short nnn)
+static void pnria_bnnn(pnria_ctx_t *ctx, unsigned short nnn)
 {
-    pnria_debug("BNNN, nnn: %X, V0:", nnn, chip8.V[0]);
-    chip8.PC = nnn + chip8.V[0];
+    pnria_debug("BNNN, nnn: %X, V0: %X", nnn, ctx->chip8.V[0]);
+    ctx->chip8.PC = nnn + ctx->chip8.V[0];
 }
 
 // set Vx to a random byte AND kk
-static void pnria_cxkk(unsigned short x, unsigned char kk)
+static void pnria_cxkk(pnria_ctx_t *ctx, unsigned short x, unsigned char kk)
 {
-    pnria_debug("CXKK, x: %X, kk: %X, x, kk");
-    chip8.V[x] = (rand() % 0X100) & kk;
+    pnria_debug("CXKK, x: %X, kk: %X", x, kk);
+    ctx->chip8.V[x] = pnria_random(&ctx->random) & kk;
 }
 
-// draw a sprite of n bytes at xy position in the screen
-static void pnria_dxyn(unsigned short x, unsigned short y, unsigned short n)
+bool pnria_draw(uint64_t *screen, const unsigned char *sprite, unsigned int x, unsigned int y, int n,
+                uint32_t *changedRows, uint64_t *changedColumns)
 {
-    pnria_debug("DXYN, x: %X, y: %X, n: %X", x, y, n);
-    unsigned short screenX = chip8.V[x];
-    unsigned short screenY = chip8.V[y];
-
-    chip8.V[0xF] = 0;
-
-    // n is the sprite height
-    for (int spriteY = 0; spriteY < n; ++spriteY) {
-        unsigned short spriteLine = chip8.memory[chip8.I + spriteY];
-        // every sprite is 8 bits wide
-        for (int spriteX = 0; spriteX < 8; ++spriteX) {
-            // from MSB to LSB, for each sprite line we check if it's already set and update Vx
-            if ((spriteLine & (0x80 >> spriteX)) != 0) { // if the sprite pixel is set
-                // get the screen pixel that can be changed
-                unsigned short screenPixel = (screenX + spriteX + ((screenY + spriteY) * 64));
-
-                if (screenPixel >= PNRIA_SCREEN_SIZE) {
-                    continue;
-                }
-
-                if (chip8.screen[screenPixel] == 1) { // and screen pixel is set
-                    chip8.V[0xF] = 1; // collision
-                }
-
-                chip8.screen[screenPixel] ^= 1;
+    unsigned int row = y + x / PNRIA_SCREEN_WIDTH;
+    unsigned int column = x % PNRIA_SCREEN_WIDTH;
+
+    // rows drawn before going past the bottom
+    int rows = row >= PNRIA_SCREEN_HEIGHT ? 0 : PNRIA_SCREEN_HEIGHT - row;
+    if (rows > n) {
+        rows = n;
+    }
+
+    // every sprite line is 8 bits wide, drawn with a shift and a xor, and
+    // collides with the set pixels it overlaps
+    uint64_t collision = 0;
+    int spriteY = 0;
+
+    if (column <= PNRIA_SCREEN_WIDTH - 8) {
+        unsigned int shift = PNRIA_SCREEN_WIDTH - 8 - column;
+
+        unsigned int lines = 0;
+        for (int i = 0; i < rows; ++i) {
+            *changedRows |= (uint32_t)(sprite[i] != 0) << (row + i);
+            lines |= sprite[i];
+        }
+        *changedColumns |= (uint64_t)lines << shift;
+
+#if defined(__AVX2__)
+        __m256i hits = _mm256_setzero_si256();
+        for (; spriteY + 4 <= rows; spriteY += 4) {
+            __m256i lines = _mm256_sll_epi64(_mm256_set_epi64x(sprite[spriteY + 3], sprite[spriteY + 2],
+                                                               sprite[spriteY + 1], sprite[spriteY]),
+                                             _mm_cvtsi32_si128(shift));
+            __m256i *pixels = (__m256i *)&screen[row + spriteY];
+            __m256i current = _mm256_loadu_si256(pixels);
+            hits = _mm256_or_si256(hits, _mm256_and_si256(current, lines));
+            _mm256_storeu_si256(pixels, _mm256_xor_si256(current, lines));
+        }
+        collision |= !_mm256_testz_si256(hits, hits);
+#endif
+#if defined(__SSE2__)
+        __m128i hits2 = _mm_setzero_si128();
+        for (; spriteY + 2 <= rows; spriteY += 2) {
+            __m128i lines = _mm_sll_epi64(_mm_set_epi64x(sprite[spriteY + 1], sprite[spriteY]),
+                                          _mm_cvtsi32_si128(shift));
+            __m128i *pixels = (__m128i *)&screen[row + spriteY];
+            __m128i current = _mm_loadu_si128(pixels);
+            hits2 = _mm_or_si128(hits2, _mm_and_si128(current, lines));
+            _mm_storeu_si128(pixels, _mm_xor_si128(current, lines));
+        }
+        collision |= _mm_movemask_epi8(_mm_cmpeq_epi8(hits2, _mm_setzero_si128())) != 0xFFFF;
+#endif
+        for (; spriteY < rows; ++spriteY) {
+            uint64_t line = (uint64_t)sprite[spriteY] << shift;
+            collision |= screen[row + spriteY] & line;
+            screen[row + spriteY] ^= line;
+        }
+    } else {
+        // the sprite crosses the right edge, its last pixels go to the
+        // start of the next row
+        unsigned int shift = column - (PNRIA_SCREEN_WIDTH - 8);
+        for (; spriteY < rows; ++spriteY) {
+            uint64_t line = (uint64_t)sprite[spriteY] >> shift;
+            collision |= screen[row + spriteY] & line;
+            screen[row + spriteY] ^= line;
+            *changedRows |= (uint32_t)(line != 0) << (row + spriteY);
+            *changedColumns |= line;
+
+            if (row + spriteY + 1 < PNRIA_SCREEN_HEIGHT) {
+                line = (uint64_t)sprite[spriteY] << (PNRIA_SCREEN_WIDTH - shift);
+                collision |= screen[row + spriteY + 1] & line;
+                screen[row + spriteY + 1] ^= line;
+                *changedRows |= (uint32_t)(line != 0) << (row + spriteY + 1);
+                *changedColumns |= line;
             }
         }
     }
+
+    return collision != 0;
+}
+
+// draw a sprite of n bytes at xy position in the screen
+static void pnria_dxyn(pnria_ctx_t *ctx, unsigned short x, unsigned short y, unsigned short n)
+{
+    pnria_debug("DXYN, x: %X, y: %X, n: %X", x, y, n);
+    uint32_t rows = 0;
+    uint64_t columns = 0;
+    ctx->chip8.V[0xF] = pnria_draw(ctx->chip8.screen, &ctx->chip8.memory[ctx->chip8.I],
+                                   ctx->chip8.V[x], ctx->chip8.V[y], n, &rows, &columns);
+    pnria_mark_dirty(ctx, rows, columns);
 }
 
 // skip next instruction if Vx is pressed
-static void pnria_ex9e(unsigned short x)
+static void pnria_ex9e(pnria_ctx_t *ctx, unsigned short x)
 {
     pnria_debug("EX9E, x: %X", x);
-    SKIPIF(chip8.key[chip8.V[x]] != 0);
+    SKIPIF(ctx->chip8.key[ctx->chip8.V[x]] != 0);
 }
 
 // skip next instruction if Vx is not pressed
-static void pnria_exa1(unsigned short x)
+static void pnria_exa1(pnria_ctx_t *ctx, unsigned short x)
 {
     pnria_debug("EXA1, x: %X", x);
-    SKIPIF(chip8.key[chip8.V[x]] == 0);
+    SKIPIF(ctx->chip8.key[ctx->chip8.V[x]] == 0);
 }
 
 // set Vx to the delay value
-static void pnria_fx07(unsigned short x)
+static void pnria_fx07(pnria_ctx_t *ctx, unsigned short x)
 {
     pnria_debug("FX07, x: %X", x);
-    chip8.V[x] = chip8.delay;
+    ctx->chip8.V[x] = ctx->chip8.delay;
 }
 
 // wait for a keypress, store result in x
-static void pnria_fx0a(unsigned short x)
+static void pnria_fx0a(pnria_ctx_t *ctx, unsigned short x)
 {
     pnria_debug("FX0A, x: %X", x);
     bool keyPressed = false;
     for (int i = 0; i < PNRIA_INPUT_SIZE; ++i) {
-        if (chip8.key[i] != 0) {
-            chip8.V[x] = i;
+        if (ctx->chip8.key[i] != 0) {
+            ctx->chip8.V[x] = i;
             keyPressed = true;
             break;
         }
     }
 
     if (!keyPressed) {
-        chip8.PC -= PNRIA_OPCODE_SIZE;
+        ctx->chip8.PC -= PNRIA_OPCODE_SIZE;
     }
 }
 
 // set delay to Vx
-static void pnria_fx15(unsigned short x)
+static void pnria_fx15(pnria_ctx_t *ctx, unsigned short x)
 {
     pnria_debug("FX15, x: %X", x);
-    chip8.delay = chip8.V[x];
+    ctx->chip8.delay = ctx->chip8.V[x];
 }
 
 // set sound to Vx
-static void pnria_fx18(unsigned short x)
+static void pnria_fx18(pnria_ctx_t *ctx, unsigned short x)
 {
     pnria_debug("FX18, x: %X", x);
-    chip8.sound = chip8.V[x];
+    ctx->chip8.sound = ctx->chip8.V[x];
 }
 
 // set I to I + Vx
-static void pnria_fx1e(unsigned short x)
+static void pnria_fx1e(pnria_ctx_t *ctx, unsigned short x)
 {
     pnria_debug("FX1E, x: %X", x);
-    chip8.V[0xF] = (chip8.I + chip8.V[x] > 0xFFF) ? 1 : 0;
-    chip8.I += chip8.V[x];
+    ctx->chip8.V[0xF] = (ctx->chip8.I + ctx->chip8.V[x] > 0xFFF) ? 1 : 0;
+    ctx->chip8.I += ctx->chip8.V[x];
 }
 
 // set I to the address of the starting pos of font digit in Vx
-static void pnria_fx29(unsigned short x)
+static void pnria_fx29(pnria_ctx_t *ctx, unsigned short x)
 {
     pnria_debug("FX29, x: %X", x);
-    chip8.I = chip8.V[x] * 5;
+    ctx->chip8.I = ctx->chip8.V[x] * 5;
 }
 
 // store the BCD represantation of Vx into I, I+1, I+2
-static void pnria_fx33(unsigned short x)
+static void pnria_fx33(pnria_ctx_t *ctx, unsigned short x)
 {
     pnria_debug("FX33, x: %X", x);
-    chip8.memory[chip8.I]     = chip8.V[x] / 100;
-    chip8.memory[chip8.I + 1] = (chip8.V[x] / 10) % 10;
-    chip8.memory[chip8.I + 2] = chip8.V[x] % 10;
+    ctx->chip8.memory[ctx->chip8.I]     = ctx->chip8.V[x] / 100;
+    ctx->chip8.memory[ctx->chip8.I + 1] = (ctx->chip8.V[x] / 10) % 10;
+    ctx->chip8.memory[ctx->chip8.I + 2] = ctx->chip8.V[x] % 10;
+    pnria_invalidate(ctx, ctx->chip8.I, ctx->chip8.I + 3);
 }
 
 // stores registers V0 through Vx into memory, starting at I
-static void pnria_fx55(unsigned short x)
+static void pnria_fx55(pnria_ctx_t *ctx, unsigned short x)
 {
     pnria_debug("FX55, x: %X", x);
     for (int i = 0; i <= x; ++i) {
-        chip8.memory[chip8.I + i] = chip8.V[i];
+        ctx->chip8.memory[ctx->chip8.I + i] = ctx->chip8.V[i];
     }
+    pnria_invalidate(ctx, ctx->chip8.I, ctx->chip8.I + x + 1);
 }
 
 // read registers V0 through Vx, storing at memory starting at I
-static void pnria_fx65(unsigned short x)
+static void pnria_fx65(pnria_ctx_t *ctx, unsigned short x)
 {
     pnria_debug("FX65, x: %X", x);
     for (int i = 0; i <= x; ++i) {
-        chip8.V[i] = chip8.memory[chip8.I + i];
+        ctx->chip8.V[i] = ctx->chip8.memory[ctx->chip8.I + i];
     }
 }
 
 // instruction table
 
-static void pnria_unknown()
+static void pnria_unknown(pnria_ctx_t *ctx)
 {
-    pnria_warn("Unknown instruction, opcode: %X", chip8.opcode);
+    pnria_warn("Unknown instruction, opcode: %X", ctx->chip8.opcode);
 }
 
 typedef void (*pnria_func_t)(void);
 typedef enum { X, XY, XYN, XKK, NNN, NOARGS } pnria_argument_t;
+typedef void (*pnria_noargs_function_t)(pnria_ctx_t *ctx);
 
 typedef struct {
     pnria_argument_t type;
     pnria_func_t instruction;
 } pnria_handler_t;
 
-static void pnria_dispatch(pnria_argument_t type, pnria_func_t instruction)
+static void pnria_dispatch(pnria_ctx_t *ctx, pnria_argument_t type, pnria_func_t instruction)
 {
     pnria_debug("Dispatching... instruction: %p", instruction);
 
     if (instruction == NULL) {
         type = NOARGS;
-        instruction = pnria_unknown;
+        instruction = (pnria_func_t)pnria_unknown;
     }
 
     if (type == NOARGS) {
         pnria_debug("No arguments, calling handler...");
-        instruction();
+        ((pnria_noargs_function_t)instruction)(ctx);
     } else if (type == X) {
-        pnria_x_handler(chip8.opcode, (pnria_x_function_t)instruction);
+        pnria_x_handler(ctx, ctx->chip8.opcode, (pnria_x_function_t)instruction);
     } else if (type == XY) {
-        pnria_xy_handler(chip8.opcode, (pnria_xy_function_t)instruction);
+        pnria_xy_handler(ctx, ctx->chip8.opcode, (pnria_xy_function_t)instruction);
     } else if (type == XYN) {
-        pnria_xyn_handler(chip8.opcode, (pnria_xyn_function_t)instruction);
+        pnria_xyn_handler(ctx, ctx->chip8.opcode, (pnria_xyn_function_t)instruction);
     } else if (type == XKK) {
-        pnria_xkk_handler(chip8.opcode, (pnria_xkk_function_t)instruction);
+        pnria_xkk_handler(ctx, ctx->chip8.opcode, (pnria_xkk_function_t)instruction);
     } else if (type == NNN) {
-        pnria_nnn_handler(chip8.opcode, (pnria_nnn_function_t)instruction);
+        pnria_nnn_handler(ctx, ctx->chip8.opcode, (pnria_nnn_function_t)instruction);
     }
 }
 
-#define PNRIA_HANDLER(type, instruction) (pnria_handler_t){ type, (pnria_func_t)instruction }
+#define PNRIA_HANDLER(type, instruction) { type, (pnria_func_t)instruction }
 
-static pnria_handler_t pnria_0table[0x10];
-static void pnria_0handler()
+// the tables are never written after being initialized, so they can be shared
+// between every context
+static const pnria_handler_t pnria_0table[0x10] = {
+    [0x0] = PNRIA_HANDLER(NOARGS, pnria_00e0),
+    [0xe] = PNRIA_HANDLER(NOARGS, pnria_00ee)
+};
+
+static void pnria_0handler(pnria_ctx_t *ctx)
 {
-    pnria_debug("getting function at %X", chip8.opcode & 0x000F);
-    pnria_dispatch(NOARGS, pnria_0table[chip8.opcode & 0x000F].instruction);
+    pnria_debug("getting function at %X", ctx->chip8.opcode & 0x000F);
+    pnria_dispatch(ctx, NOARGS, pnria_0table[ctx->chip8.opcode & 0x000F].instruction);
 }
 
-static pnria_handler_t pnria_8table[0x10];
-static void pnria_8handler()
+static const pnria_handler_t pnria_8table[0x10] = {
+    [0x0] = PNRIA_HANDLER(XY, pnria_8xy0),
+    [0x1] = PNRIA_HANDLER(XY, pnria_8xy1),
+    [0x2] = PNRIA_HANDLER(XY, pnria_8xy2),
+    [0x3] = PNRIA_HANDLER(XY, pnria_8xy3),
+    [0x4] = PNRIA_HANDLER(XY, pnria_8xy4),
+    [0x5] = PNRIA_HANDLER(XY, pnria_8xy5),
+    [0x6] = PNRIA_HANDLER(XY, pnria_8xy6),
+    [0x7] = PNRIA_HANDLER(XY, pnria_8xy7),
+    [0xe] = PNRIA_HANDLER(XY, pnria_8xye)
+};
+
+static void pnria_8handler(pnria_ctx_t *ctx)
 {
-    pnria_dispatch(XY, pnria_8table[chip8.opcode & 0x000F].instruction);
+    pnria_dispatch(ctx, XY, pnria_8table[ctx->chip8.opcode & 0x000F].instruction);
 }
 
-static pnria_handler_t pnria_etable[0x10];
-static void pnria_ehandler()
+static const pnria_handler_t pnria_etable[0x10] = {
+    [0x1] = PNRIA_HANDLER(X, pnria_exa1),
+    [0xe] = PNRIA_HANDLER(X, pnria_ex9e)
+};
+
+static void pnria_ehandler(pnria_ctx_t *ctx)
 {
-    pnria_dispatch(X, pnria_etable[chip8.opcode & 0x000F].instruction);
+    pnria_dispatch(ctx, X, pnria_etable[ctx->chip8.opcode & 0x000F].instruction);
 }
 
-static pnria_handler_t pnria_ftable[0X100];
-static void pnria_fhandler()
+static const pnria_handler_t pnria_ftable[0X100] = {
+    [0x07] = PNRIA_HANDLER(X, pnria_fx07),
+    [0x0A] = PNRIA_HANDLER(X, pnria_fx0a),
+    [0x15] = PNRIA_HANDLER(X, pnria_fx15),
+    [0x18] = PNRIA_HANDLER(X, pnria_fx18),
+    [0x1E] = PNRIA_HANDLER(X, pnria_fx1e),
+    [0x29] = PNRIA_HANDLER(X, pnria_fx29),
+    [0x33] = PNRIA_HANDLER(X, pnria_fx33),
+    [0x55] = PNRIA_HANDLER(X, pnria_fx55),
+    [0x65] = PNRIA_HANDLER(X, pnria_fx65)
+};
+
+static void pnria_fhandler(pnria_ctx_t *ctx)
 {
-    pnria_dispatch(X, pnria_ftable[chip8.opcode & 0x00FF].instruction);
+    pnria_dispatch(ctx, X, pnria_ftable[ctx->chip8.opcode & 0x00FF].instruction);
 }
 
-static pnria_handler_t pnria_table[0X10] = {
+static const pnria_handler_t pnria_table[0X10] = {
     PNRIA_HANDLER(NOARGS, pnria_0handler),
     PNRIA_HANDLER(NNN,    pnria_1nnn),
     PNRIA_HANDLER(NNN,    pnria_2nnn),
@@ -470,37 +691,301 @@ static pnria_handler_t pnria_table[0X10] = {
     PNRIA_HANDLER(NOARGS, pnria_fhandler)
 };
 
-static void pnria_execute()
+static void pnria_execute(pnria_ctx_t *ctx)
 {
-    unsigned short index = (chip8.opcode & 0xF000) >> 12;
+    unsigned short index = (ctx->chip8.opcode & 0xF000) >> 12;
 
-    pnria_debug("Executing opcode 0x%X, function index 0x%X", chip8.opcode, index);
+    pnria_debug("Executing opcode 0x%X, function index 0x%X", ctx->chip8.opcode, index);
 
     pnria_handler_t handler = pnria_table[index];
-    chip8.PC += PNRIA_OPCODE_SIZE;
-    pnria_dispatch(handler.type, handler.instruction);
+    ctx->chip8.PC += PNRIA_OPCODE_SIZE;
+    pnria_dispatch(ctx, handler.type, handler.instruction);
 }
 
-void pnria_init()
+// table backend: reference implementation, decodes every opcode through the
+// handler tables above
+
+static void pnria_table_run(pnria_ctx_t *ctx, long cycles)
 {
-#if defined(NDEBUG)
-    log_set_level(LOG_INFO);
+    for (long i = 0; i < cycles; ++i) {
+        if (ctx->chip8.PC >= PNRIA_MEMORY_SIZE) {
+            return;
+        }
+
+        ctx->chip8.opcode = ctx->chip8.memory[ctx->chip8.PC] << 8 | ctx->chip8.memory[ctx->chip8.PC + 1];
+
+        pnria_execute(ctx);
+        pnria_advance(ctx, 1);
+    }
+}
+
+// threaded backend: every opcode is decoded once into a single operation with
+// its operands already extracted, then each operation jumps straight to the
+// next one
+
+// decodes the instruction at PC, unless it's already in the cache
+static inline pnria_instruction_t pnria_fetch(pnria_ctx_t *ctx)
+{
+    unsigned short pc = ctx->chip8.PC;
+    pnria_cache_entry_t *entry = &ctx->cache[pc / PNRIA_OPCODE_SIZE];
+
+    if (entry->tag != pc + 1) {
+        entry->tag = pc + 1;
+        entry->instruction = pnria_decode(ctx->chip8.memory[pc] << 8 | ctx->chip8.memory[pc + 1]);
+    }
+
+    return entry->instruction;
+}
+
+#if defined(__GNUC__)
+#define PNRIA_COMPUTED_GOTO
+#endif
+
+void pnria_threaded_run(pnria_ctx_t *ctx, long cycles)
+{
+    pnria_instruction_t in;
+
+// fetches the next instruction, evaluates to false when done
+#define PNRIA_FETCH() (                                      \
+    cycles-- > 0 && ctx->chip8.PC < PNRIA_MEMORY_SIZE &&     \
+    (in = pnria_fetch(ctx),                                  \
+     ctx->chip8.opcode = in.opcode,                          \
+     ctx->chip8.PC += PNRIA_OPCODE_SIZE,                     \
+     true)                                                   \
+)
+
+#if defined(PNRIA_COMPUTED_GOTO)
+    static const void *const targets[PNRIA_OP_COUNT] = {
+        [PNRIA_OP_UNKNOWN] = &&target_unknown,
+        [PNRIA_OP_00E0] = &&target_00e0, [PNRIA_OP_00EE] = &&target_00ee,
+        [PNRIA_OP_1NNN] = &&target_1nnn, [PNRIA_OP_2NNN] = &&target_2nnn,
+        [PNRIA_OP_3XKK] = &&target_3xkk, [PNRIA_OP_4XKK] = &&target_4xkk,
+        [PNRIA_OP_5XY0] = &&target_5xy0, [PNRIA_OP_6XKK] = &&target_6xkk,
+        [PNRIA_OP_7XKK] = &&target_7xkk,
+        [PNRIA_OP_8XY0] = &&target_8xy0, [PNRIA_OP_8XY1] = &&target_8xy1,
+        [PNRIA_OP_8XY2] = &&target_8xy2, [PNRIA_OP_8XY3] = &&target_8xy3,
+        [PNRIA_OP_8XY4] = &&target_8xy4, [PNRIA_OP_8XY5] = &&target_8xy5,
+        [PNRIA_OP_8XY6] = &&target_8xy6, [PNRIA_OP_8XY7] = &&target_8xy7,
+        [PNRIA_OP_8XYE] = &&target_8xye, [PNRIA_OP_9XY0] = &&target_9xy0,
+        [PNRIA_OP_ANNN] = &&target_annn, [PNRIA_OP_BNNN] = &&target_bnnn,
+        [PNRIA_OP_CXKK] = &&target_cxkk, [PNRIA_OP_DXYN] = &&target_dxyn,
+        [PNRIA_OP_EX9E] = &&target_ex9e, [PNRIA_OP_EXA1] = &&target_exa1,
+        [PNRIA_OP_FX07] = &&target_fx07, [PNRIA_OP_FX0A] = &&target_fx0a,
+        [PNRIA_OP_FX15] = &&target_fx15, [PNRIA_OP_FX18] = &&target_fx18,
+        [PNRIA_OP_FX1E] = &&target_fx1e, [PNRIA_OP_FX29] = &&target_fx29,
+        [PNRIA_OP_FX33] = &&target_fx33, [PNRIA_OP_FX55] = &&target_fx55,
+        [PNRIA_OP_FX65] = &&target_fx65
+    };
+
+#define PNRIA_TARGET(name, op) target_##name:
+#define PNRIA_DISPATCH() {   \
+    if (!PNRIA_FETCH()) return; \
+    goto *targets[in.op];     \
+}
+
+    PNRIA_DISPATCH();
 #else
-    // Warning: debug builds will generate huge logs
-    log_set_level(LOG_DEBUG);
+#define PNRIA_TARGET(name, op) case op:
+#define PNRIA_DISPATCH() continue
+
+    while (PNRIA_FETCH()) {
+        switch (in.op) {
+#endif
+
+// every target runs the instruction, counts it towards the timers and
+// dispatches the next one
+#define PNRIA_NEXT() { pnria_advance(ctx, 1); PNRIA_DISPATCH(); }
+
+    PNRIA_TARGET(unknown, PNRIA_OP_UNKNOWN) pnria_unknown(ctx); PNRIA_NEXT();
+    PNRIA_TARGET(00e0, PNRIA_OP_00E0) pnria_00e0(ctx); PNRIA_NEXT();
+    PNRIA_TARGET(00ee, PNRIA_OP_00EE) pnria_00ee(ctx); PNRIA_NEXT();
+    PNRIA_TARGET(1nnn, PNRIA_OP_1NNN) pnria_1nnn(ctx, in.nnn); PNRIA_NEXT();
+    PNRIA_TARGET(2nnn, PNRIA_OP_2NNN) pnria_2nnn(ctx, in.nnn); PNRIA_NEXT();
+    PNRIA_TARGET(3xkk, PNRIA_OP_3XKK) pnria_3xkk(ctx, in.x, in.kk); PNRIA_NEXT();
+    PNRIA_TARGET(4xkk, PNRIA_OP_4XKK) pnria_4xkk(ctx, in.x, in.kk); PNRIA_NEXT();
+    PNRIA_TARGET(5xy0, PNRIA_OP_5XY0) pnria_5xy0(ctx, in.x, in.y); PNRIA_NEXT();
+    PNRIA_TARGET(6xkk, PNRIA_OP_6XKK) pnria_6xkk(ctx, in.x, in.kk); PNRIA_NEXT();
+    PNRIA_TARGET(7xkk, PNRIA_OP_7XKK) pnria_7xkk(ctx, in.x, in.kk); PNRIA_NEXT();
+    PNRIA_TARGET(8xy0, PNRIA_OP_8XY0) pnria_8xy0(ctx, in.x, in.y); PNRIA_NEXT();
+    PNRIA_TARGET(8xy1, PNRIA_OP_8XY1) pnria_8xy1(ctx, in.x, in.y); PNRIA_NEXT();
+    PNRIA_TARGET(8xy2, PNRIA_OP_8XY2) pnria_8xy2(ctx, in.x, in.y); PNRIA_NEXT();
+    PNRIA_TARGET(8xy3, PNRIA_OP_8XY3) pnria_8xy3(ctx, in.x, in.y); PNRIA_NEXT();
+    PNRIA_TARGET(8xy4, PNRIA_OP_8XY4) pnria_8xy4(ctx, in.x, in.y); PNRIA_NEXT();
+    PNRIA_TARGET(8xy5, PNRIA_OP_8XY5) pnria_8xy5(ctx, in.x, in.y); PNRIA_NEXT();
+    PNRIA_TARGET(8xy6, PNRIA_OP_8XY6) pnria_8xy6(ctx, in.x, in.y); PNRIA_NEXT();
+    PNRIA_TARGET(8xy7, PNRIA_OP_8XY7) pnria_8xy7(ctx, in.x, in.y); PNRIA_NEXT();
+    PNRIA_TARGET(8xye, PNRIA_OP_8XYE) pnria_8xye(ctx, in.x, in.y); PNRIA_NEXT();
+    PNRIA_TARGET(9xy0, PNRIA_OP_9XY0) pnria_9xy0(ctx, in.x, in.y); PNRIA_NEXT();
+    PNRIA_TARGET(annn, PNRIA_OP_ANNN) pnria_annn(ctx, in.nnn); PNRIA_NEXT();
+    PNRIA_TARGET(bnnn, PNRIA_OP_BNNN) pnria_bnnn(ctx, in.nnn); PNRIA_NEXT();
+    PNRIA_TARGET(cxkk, PNRIA_OP_CXKK) pnria_cxkk(ctx, in.x, in.kk); PNRIA_NEXT();
+    PNRIA_TARGET(dxyn, PNRIA_OP_DXYN) pnria_dxyn(ctx, in.x, in.y, in.n); PNRIA_NEXT();
+    PNRIA_TARGET(ex9e, PNRIA_OP_EX9E) pnria_ex9e(ctx, in.x); PNRIA_NEXT();
+    PNRIA_TARGET(exa1, PNRIA_OP_EXA1) pnria_exa1(ctx, in.x); PNRIA_NEXT();
+    PNRIA_TARGET(fx07, PNRIA_OP_FX07) pnria_fx07(ctx, in.x); PNRIA_NEXT();
+    PNRIA_TARGET(fx0a, PNRIA_OP_FX0A) pnria_fx0a(ctx, in.x); PNRIA_NEXT();
+    PNRIA_TARGET(fx15, PNRIA_OP_FX15) pnria_fx15(ctx, in.x); PNRIA_NEXT();
+    PNRIA_TARGET(fx18, PNRIA_OP_FX18) pnria_fx18(ctx, in.x); PNRIA_NEXT();
+    PNRIA_TARGET(fx1e, PNRIA_OP_FX1E) pnria_fx1e(ctx, in.x); PNRIA_NEXT();
+    PNRIA_TARGET(fx29, PNRIA_OP_FX29) pnria_fx29(ctx, in.x); PNRIA_NEXT();
+    PNRIA_TARGET(fx33, PNRIA_OP_FX33) pnria_fx33(ctx, in.x); PNRIA_NEXT();
+    PNRIA_TARGET(fx55, PNRIA_OP_FX55) pnria_fx55(ctx, in.x); PNRIA_NEXT();
+    PNRIA_TARGET(fx65, PNRIA_OP_FX65) pnria_fx65(ctx, in.x); PNRIA_NEXT();
+
+#if !defined(PNRIA_COMPUTED_GOTO)
+        }
+    }
+#endif
+
+#undef PNRIA_NEXT
+#undef PNRIA_DISPATCH
+#undef PNRIA_TARGET
+#undef PNRIA_FETCH
+}
+
+typedef void (*pnria_backend_function_t)(pnria_ctx_t *ctx, long cycles);
+
+static const pnria_backend_function_t pnria_backends[] = {
+    [PNRIA_BACKEND_TABLE]    = pnria_table_run,
+    [PNRIA_BACKEND_THREADED] = pnria_threaded_run,
+#if defined(PNRIA_JIT)
+    [PNRIA_BACKEND_JIT]      = pnria_jit_run
+#else
+    [PNRIA_BACKEND_JIT]      = pnria_threaded_run
+#endif
+};
+
+#if defined(PNRIA_PROFILER)
+// table backend counting every instruction into the context's profile. The
+// call path is looked up again only after a call or a return, a 2NNN counts
+// in its caller's path
+static void pnria_profile_run(pnria_ctx_t *ctx, long cycles)
+{
+    pnria_profile_t *profile = ctx->profile;
+    pnria_profile_path_t *path = pnria_profile_path(profile, ctx);
+
+    for (long i = 0; i < cycles; ++i) {
+        unsigned short pc = ctx->chip8.PC;
+        if (pc >= PNRIA_MEMORY_SIZE) {
+            return;
+        }
+
+        ctx->chip8.opcode = ctx->chip8.memory[pc] << 8 | ctx->chip8.memory[pc + 1];
+        unsigned char op = pnria_decode(ctx->chip8.opcode).op;
+
+        pnria_execute(ctx);
+        pnria_advance(ctx, 1);
+
+        ++profile->cycles;
+        ++profile->ops[op];
+        ++profile->addresses[pc];
+        if (path) {
+            ++path->cycles;
+        }
+
+        // FX0A goes back to itself until a key is pressed
+        if (op == PNRIA_OP_FX0A && ctx->chip8.PC == pc) {
+            ++profile->keyWaitCycles;
+        } else if (op == PNRIA_OP_2NNN || op == PNRIA_OP_00EE) {
+            path = pnria_profile_path(profile, ctx);
+        }
+    }
+}
+#endif
+
+// runs on the context's backend, or counting into its profile while profiling
+static inline void pnria_run(pnria_ctx_t *ctx, long cycles)
+{
+#if defined(PNRIA_PROFILER)
+    if (ctx->profile) {
+        pnria_profile_run(ctx, cycles);
+        return;
+    }
+#endif
+    pnria_backends[ctx->backend](ctx, cycles);
+}
+
+pnria_ctx_t *pnria_create()
+{
+    pnria_ctx_t *ctx = calloc(1, sizeof(pnria_ctx_t));
+    if (!ctx) {
+        pnria_error("Error allocating context: %s", strerror(errno));
+        return NULL;
+    }
+
+    ctx->backend = PNRIA_DEFAULT_BACKEND;
+    ctx->cyclesPerFrame = PNRIA_CYCLES_PER_FRAME;
+
+    pnria_ctx_init(ctx);
+
+    return ctx;
+}
+
+void pnria_destroy(pnria_ctx_t *ctx)
+{
+    if (!ctx) {
+        return;
+    }
+
+#if defined(PNRIA_JIT)
+    if (ctx->jit) {
+        pnria_jit_destroy(ctx->jit);
+    }
 #endif
 
-    log_info("Initializing...");
+    for (int page = 0; page < PNRIA_PAGE_COUNT; ++page) {
+        pnria_page_release(ctx->pages[page]);
+        pnria_page_release(ctx->imagePages[page]);
+    }
+
+    free(ctx);
+}
+
+void pnria_reset_registers(pnria_ctx_t *ctx)
+{
+    ctx->chip8.PC     = PNRIA_START_OFFSET;
+    ctx->chip8.opcode = 0;
+    ctx->chip8.I      = 0;
+    ctx->chip8.SP     = 0;
+    ctx->chip8.delay  = 0;
+    ctx->chip8.sound  = 0;
+    ctx->chip8.waiting_for_key = 0;
+
+    memset(ctx->chip8.stack,  0,       sizeof(ctx->chip8.stack));
+    memset(ctx->chip8.V,      0,       PNRIA_REGISTER_SIZE);
+    memset(ctx->chip8.key,    0,       PNRIA_INPUT_SIZE);
+    memset(ctx->chip8.screen, 0,       sizeof(ctx->chip8.screen));
+    pnria_mark_dirty(ctx, 0xFFFFFFFF, UINT64_MAX);
+
+    ctx->frameCycles = ctx->cyclesPerFrame;
+
+    ctx->random = pnria_random_seed(ctx->seed);
+    ctx->frame = 0;
+    ctx->recording = NULL;
+}
+
+void pnria_set_image(pnria_ctx_t *ctx, const unsigned char *image, uint32_t hash, pnria_page_t *const *pages)
+{
+    for (int page = 0; page < PNRIA_PAGE_COUNT; ++page) {
+        pnria_page_release(ctx->imagePages[page]);
+        ctx->imagePages[page] = pages ? pages[page] : NULL;
+        if (pages) {
+            atomic_fetch_add(&pages[page]->refs, 1);
+        }
+    }
 
-    chip8.PC     = PNRIA_START_OFFSET;
-    chip8.opcode = 0;
-    chip8.I      = 0;
-    chip8.SP     = 0;
-    chip8.delay  = 0;
-    chip8.sound  = 0;
+    ctx->image = image;
+    ctx->imageHash = hash;
+}
+
+void pnria_ctx_init(pnria_ctx_t *ctx)
+{
+    pnria_info("Initializing...");
+
+    pnria_reset_registers(ctx);
 
     // load fontset
-    unsigned char fontset[] = {
+    static const unsigned char fontset[] = {
         0xF0, 0x90, 0x90, 0x90, 0xF0, // 0
         0x20, 0x60, 0x20, 0x20, 0x70, // 1
         0xF0, 0x10, 0xF0, 0x80, 0xF0, // 2
@@ -519,71 +1004,127 @@ void pnria_init()
         0xF0, 0x80, 0xF0, 0x80, 0x80  // F
     };
 
-    memset(chip8.memory, 0,       PNRIA_MEMORY_SIZE);
-    memcpy(chip8.memory, fontset, 80);
-    memset(chip8.stack,  0,       PNRIA_STACK_SIZE);
-    memset(chip8.V,      0,       PNRIA_REGISTER_SIZE);
-    memset(chip8.key,    0,       PNRIA_INPUT_SIZE);
-    memset(chip8.screen, 0,       PNRIA_SCREEN_SIZE);
-
-    srand (time(NULL));
-
-    pnria_0table[0x0] = PNRIA_HANDLER(NOARGS, pnria_00e0);
-    pnria_0table[0xe] = PNRIA_HANDLER(NOARGS, pnria_00ee);
-
-    pnria_8table[0x0] = PNRIA_HANDLER(XY, pnria_8xy0);
-    pnria_8table[0x1] = PNRIA_HANDLER(XY, pnria_8xy1);
-    pnria_8table[0x2] = PNRIA_HANDLER(XY, pnria_8xy2);
-    pnria_8table[0x3] = PNRIA_HANDLER(XY, pnria_8xy3);
-    pnria_8table[0x4] = PNRIA_HANDLER(XY, pnria_8xy4);
-    pnria_8table[0x5] = PNRIA_HANDLER(XY, pnria_8xy5);
-    pnria_8table[0x6] = PNRIA_HANDLER(XY, pnria_8xy6);
-    pnria_8table[0x7] = PNRIA_HANDLER(XY, pnria_8xy7);
-    pnria_8table[0xe] = PNRIA_HANDLER(XY, pnria_8xye);
-
-    pnria_etable[0x1] = PNRIA_HANDLER(X, pnria_exa1);
-    pnria_etable[0xe] = PNRIA_HANDLER(X, pnria_ex9e);
-
-    pnria_ftable[0x07] = PNRIA_HANDLER(X, pnria_fx07);
-    pnria_ftable[0x0A] = PNRIA_HANDLER(X, pnria_fx0a);
-    pnria_ftable[0x15] = PNRIA_HANDLER(X, pnria_fx15);
-    pnria_ftable[0x18] = PNRIA_HANDLER(X, pnria_fx18);
-    pnria_ftable[0x1E] = PNRIA_HANDLER(X, pnria_fx1e);
-    pnria_ftable[0x29] = PNRIA_HANDLER(X, pnria_fx29);
-    pnria_ftable[0x33] = PNRIA_HANDLER(X, pnria_fx33);
-    pnria_ftable[0x55] = PNRIA_HANDLER(X, pnria_fx55);
-    pnria_ftable[0x65] = PNRIA_HANDLER(X, pnria_fx65);
+    memset(ctx->chip8.memory, 0,       PNRIA_MEMORY_SIZE);
+    memcpy(ctx->chip8.memory, fontset, 80);
+
+    pnria_invalidate(ctx, 0, PNRIA_MEMORY_SIZE);
+
+    memcpy(ctx->ownImage, ctx->chip8.memory, PNRIA_MEMORY_SIZE);
+    pnria_set_image(ctx, ctx->ownImage, pnria_hash(ctx->ownImage, PNRIA_MEMORY_SIZE), NULL);
 }
 
-void pnria_reset()
+void pnria_ctx_reset(pnria_ctx_t *ctx)
 {
-    log_info("Resetting...");
-    chip8 = (pnria_state_t) {};
-    pnria_init();
+    pnria_info("Resetting...");
+    pnria_ctx_init(ctx);
 }
 
-void pnria_cycle()
+void pnria_ctx_restart(pnria_ctx_t *ctx)
 {
-    if (chip8.PC >= PNRIA_MEMORY_SIZE) {
+    if (ctx->imagePages[0] || pnria_pages_create(ctx->imagePages, ctx->image)) {
+        pnria_share_pages(ctx, ctx->imagePages);
+    } else if (memcmp(ctx->chip8.memory, ctx->image, PNRIA_MEMORY_SIZE) != 0) {
+        memcpy(ctx->chip8.memory, ctx->image, PNRIA_MEMORY_SIZE);
+        pnria_invalidate(ctx, 0, PNRIA_MEMORY_SIZE);
+    }
+
+    pnria_reset_registers(ctx);
+}
+
+void pnria_ctx_cycle(pnria_ctx_t *ctx)
+{
+    pnria_run(ctx, 1);
+}
+
+void pnria_run_cycles(pnria_ctx_t *ctx, long cycles)
+{
+    pnria_run(ctx, cycles);
+}
+
+void pnria_run_frame(pnria_ctx_t *ctx)
+{
+    pnria_run(ctx, ctx->frameCycles);
+}
+
+void pnria_ctx_set_cycles_per_frame(pnria_ctx_t *ctx, int cycles)
+{
+    if (cycles < 1) {
+        pnria_error("Invalid cycles per frame: %d", cycles);
         return;
     }
 
-    chip8.opcode = chip8.memory[chip8.PC] << 8 | chip8.memory[chip8.PC + 1];
+    // starts a new frame at the new rate
+    ctx->cyclesPerFrame = cycles;
+    ctx->frameCycles = cycles;
+}
+
+int pnria_ctx_get_cycles_per_frame(pnria_ctx_t *ctx)
+{
+    return ctx->cyclesPerFrame;
+}
+
+void pnria_ctx_set_seed(pnria_ctx_t *ctx, uint64_t seed)
+{
+    ctx->seed = seed;
+    ctx->random = pnria_random_seed(seed);
+}
 
-    pnria_execute();
+uint64_t pnria_ctx_get_seed(pnria_ctx_t *ctx)
+{
+    return ctx->seed;
+}
 
-    if (chip8.delay > 0) {
-        pnria_debug("Decrementing delay timer, value: ", chip8.delay);
-        --chip8.delay;
+long pnria_ctx_get_frame(pnria_ctx_t *ctx)
+{
+    return ctx->frame;
+}
+
+void pnria_ctx_set_backend(pnria_ctx_t *ctx, pnria_backend_t backend)
+{
+#if !defined(PNRIA_JIT)
+    if (backend == PNRIA_BACKEND_JIT) {
+        pnria_warn("Built without the jit backend, using the threaded one");
+        backend = PNRIA_BACKEND_THREADED;
     }
+#endif
+    ctx->backend = backend;
+}
+
+pnria_backend_t pnria_ctx_get_backend(pnria_ctx_t *ctx)
+{
+    return ctx->backend;
+}
 
-    if (chip8.sound > 0) {
-        pnria_debug("Decrementing sound timer, value: ", chip8.sound);
-        --chip8.sound;
+bool pnria_ctx_set_profile(pnria_ctx_t *ctx, pnria_profile_t *profile)
+{
+#if defined(PNRIA_PROFILER)
+    ctx->profile = profile;
+    return true;
+#else
+    (void)ctx;
+    (void)profile;
+    pnria_warn("Built without the profiler, not profiling");
+    return false;
+#endif
+}
+
+// the rom was copied to memory, makes it the image save states and restarts
+// compare against
+static void pnria_loaded(pnria_ctx_t *ctx, size_t size)
+{
+    pnria_invalidate(ctx, PNRIA_START_OFFSET, PNRIA_START_OFFSET + size);
+
+    // a library's image is never written
+    if (ctx->image != ctx->ownImage) {
+        memcpy(ctx->ownImage, ctx->image, PNRIA_MEMORY_SIZE);
     }
+    memcpy(ctx->ownImage + PNRIA_START_OFFSET, ctx->chip8.memory + PNRIA_START_OFFSET, size);
+    pnria_set_image(ctx, ctx->ownImage, pnria_hash(ctx->ownImage, PNRIA_MEMORY_SIZE), NULL);
+
+    pnria_info("Rom loaded, %zu bytes read", size);
 }
 
-bool pnria_load(const char *romFile)
+bool pnria_ctx_load(pnria_ctx_t *ctx, const char *romFile)
 {
     if (!romFile) {
         pnria_warn("No rom file name. Provide the path to the rom file.");
@@ -592,36 +1133,158 @@ bool pnria_load(const char *romFile)
 
     pnria_info("Loading %s...", romFile);
 
-    FILE *file = fopen(romFile, "r");
+    FILE *file = fopen(romFile, "rb");
     if (!file) {
         pnria_error("Error reading file: %s", strerror(errno));
         return false;
     }
 
-    fseek(file, 0, SEEK_END);
-    long size = ftell(file);
-    rewind(file);
-
-    char buffer[size];
-    long read_size = fread(buffer, sizeof(char), size, file);
+    long size = -1;
+    if (fseek(file, 0, SEEK_END) == 0) {
+        size = ftell(file);
+        rewind(file);
+    }
 
-    if (size != read_size) {
-        pnria_error("Read size != file size.");
+    if (size < 0) {
+        pnria_error("Error reading file size: %s", strerror(errno));
         fclose(file);
         return false;
     }
 
-    if ((PNRIA_START_OFFSET + size) > PNRIA_MEMORY_SIZE) {
-        pnria_error("ROM bigger than the available memory, %d bytes. Aborting.", size);
+    if (size > PNRIA_MEMORY_SIZE - PNRIA_START_OFFSET) {
+        pnria_error("ROM bigger than the available memory, %ld bytes. Aborting.", size);
         fclose(file);
         return false;
     }
 
-    memcpy(chip8.memory + PNRIA_START_OFFSET, buffer, size);
+    // read straight into memory, put back from the image if it fails
+    unsigned char *rom = ctx->chip8.memory + PNRIA_START_OFFSET;
+    long read_size = fread(rom, sizeof(char), size, file);
+    fclose(file);
 
-    pnria_info("Rom loaded, %d bytes read", size);
+    if (size != read_size) {
+        pnria_error("Read size != file size.");
+        memcpy(rom, ctx->image + PNRIA_START_OFFSET, size);
+        pnria_invalidate(ctx, PNRIA_START_OFFSET, PNRIA_START_OFFSET + size);
+        return false;
+    }
 
-    fclose(file);
+    pnria_loaded(ctx, size);
 
     return true;
 }
+
+bool pnria_ctx_load_buffer(pnria_ctx_t *ctx, const void *rom, size_t size)
+{
+    if (!rom && size > 0) {
+        pnria_warn("No rom. Provide the rom's bytes.");
+        return false;
+    }
+
+    if (size > PNRIA_MEMORY_SIZE - PNRIA_START_OFFSET) {
+        pnria_error("ROM bigger than the available memory, %zu bytes. Aborting.", size);
+        return false;
+    }
+
+    memcpy(ctx->chip8.memory + PNRIA_START_OFFSET, rom, size);
+    pnria_loaded(ctx, size);
+
+    return true;
+}
+
+void pnria_set_log_level(int level)
+{
+    if (level < PNRIA_LOG_LEVEL) {
+        pnria_warn("Log level %d is below the compiled in level %d", level, PNRIA_LOG_LEVEL);
+    }
+
+    pnria_log_level = level;
+    log_set_level(level);
+}
+
+// context-less api, operates on the default instance
+
+void pnria_init()
+{
+    pnria_ctx_init(&pnria_default_ctx);
+}
+
+void pnria_reset()
+{
+    pnria_ctx_reset(&pnria_default_ctx);
+}
+
+void pnria_cycle()
+{
+    pnria_ctx_cycle(&pnria_default_ctx);
+}
+
+bool pnria_load(const char *romFile)
+{
+    return pnria_ctx_load(&pnria_default_ctx, romFile);
+}
+
+bool pnria_load_buffer(const void *rom, size_t size)
+{
+    return pnria_ctx_load_buffer(&pnria_default_ctx, rom, size);
+}
+
+void pnria_set_input(const char *key)
+{
+    pnria_ctx_set_input(&pnria_default_ctx, key);
+}
+
+unsigned char *pnria_get_screen()
+{
+    return pnria_ctx_get_screen(&pnria_default_ctx);
+}
+
+unsigned long pnria_get_screen_generation()
+{
+    return pnria_ctx_get_screen_generation(&pnria_default_ctx);
+}
+
+uint32_t pnria_get_dirty_rows()
+{
+    return pnria_ctx_get_dirty_rows(&pnria_default_ctx);
+}
+
+bool pnria_get_dirty_rect(int *x, int *y, int *width, int *height)
+{
+    return pnria_ctx_get_dirty_rect(&pnria_default_ctx, x, y, width, height);
+}
+
+void pnria_clear_dirty()
+{
+    pnria_ctx_clear_dirty(&pnria_default_ctx);
+}
+
+void pnria_set_cycles_per_frame(int cycles)
+{
+    pnria_ctx_set_cycles_per_frame(&pnria_default_ctx, cycles);
+}
+
+int pnria_get_cycles_per_frame()
+{
+    return pnria_ctx_get_cycles_per_frame(&pnria_default_ctx);
+}
+
+void pnria_set_seed(uint64_t seed)
+{
+    pnria_ctx_set_seed(&pnria_default_ctx, seed);
+}
+
+pnria_state_t pnria_get_state()
+{
+    return pnria_ctx_get_state(&pnria_default_ctx);
+}
+
+const pnria_state_t *pnria_view_state()
+{
+    return pnria_ctx_view_state(&pnria_default_ctx);
+}
+
+bool pnria_export_screen(const pnria_framebuffer_t *framebuffer, uint32_t rows)
+{
+    return pnria_ctx_export_screen(&pnria_default_ctx, framebuffer, rows);
+}
@@ -0,0 +1,442 @@
+#ifndef PANAROIA_P_H
+#define PANAROIA_P_H
+
+// internal declarations shared by the library sources
+
+#include "panaroia/panaroia.h"
+
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "log.h"
+
+#if defined(__FILE_NAME__)
+#define __FILENAME__ __FILE_NAME__
+#else
+#define __FILENAME__ (strrchr(__FILE__, '/') ? strrchr(__FILE__, '/') + 1 : __FILE__)
+#endif
+
+// messages below PNRIA_LOG_LEVEL are removed at compile time, the ones above it
+// are only formatted if they pass the runtime level
+#ifndef PNRIA_LOG_LEVEL
+#if defined(NDEBUG)
+#define PNRIA_LOG_LEVEL PNRIA_LOG_INFO
+#else
+// Warning: debug builds will generate huge logs
+#define PNRIA_LOG_LEVEL PNRIA_LOG_DEBUG
+#endif
+#endif
+
+extern int pnria_log_level;
+
+#define pnria_log(level, ...) do {                               \
+    if ((level) >= pnria_log_level) {                             \
+        log_log((level), __FILENAME__, __LINE__, __VA_ARGS__);    \
+    }                                                             \
+} while (0)
+
+#define pnria_nolog(...) do {} while (0)
+
+#if PNRIA_LOG_LEVEL <= PNRIA_LOG_TRACE
+#define pnria_trace(...) pnria_log(LOG_TRACE, __VA_ARGS__)
+#else
+#define pnria_trace(...) pnria_nolog(__VA_ARGS__)
+#endif
+
+#if PNRIA_LOG_LEVEL <= PNRIA_LOG_DEBUG
+#define pnria_debug(...) pnria_log(LOG_DEBUG, __VA_ARGS__)
+#else
+#define pnria_debug(...) pnria_nolog(__VA_ARGS__)
+#endif
+
+#if PNRIA_LOG_LEVEL <= PNRIA_LOG_INFO
+#define pnria_info(...) pnria_log(LOG_INFO, __VA_ARGS__)
+#else
+#define pnria_info(...) pnria_nolog(__VA_ARGS__)
+#endif
+
+#if PNRIA_LOG_LEVEL <= PNRIA_LOG_WARN
+#define pnria_warn(...) pnria_log(LOG_WARN, __VA_ARGS__)
+#else
+#define pnria_warn(...) pnria_nolog(__VA_ARGS__)
+#endif
+
+#if PNRIA_LOG_LEVEL <= PNRIA_LOG_ERROR
+#define pnria_error(...) pnria_log(LOG_ERROR, __VA_ARGS__)
+#else
+#define pnria_error(...) pnria_nolog(__VA_ARGS__)
+#endif
+
+#if PNRIA_LOG_LEVEL <= PNRIA_LOG_FATAL
+#define pnria_fatal(...) pnria_log(LOG_FATAL, __VA_ARGS__)
+#else
+#define pnria_fatal(...) pnria_nolog(__VA_ARGS__)
+#endif
+
+#ifndef PNRIA_DEFAULT_BACKEND
+#define PNRIA_DEFAULT_BACKEND PNRIA_BACKEND_TABLE
+#endif
+
+typedef enum {
+    PNRIA_OP_UNKNOWN,
+    PNRIA_OP_00E0, PNRIA_OP_00EE,
+    PNRIA_OP_1NNN, PNRIA_OP_2NNN,
+    PNRIA_OP_3XKK, PNRIA_OP_4XKK, PNRIA_OP_5XY0,
+    PNRIA_OP_6XKK, PNRIA_OP_7XKK,
+    PNRIA_OP_8XY0, PNRIA_OP_8XY1, PNRIA_OP_8XY2, PNRIA_OP_8XY3,
+    PNRIA_OP_8XY4, PNRIA_OP_8XY5, PNRIA_OP_8XY6, PNRIA_OP_8XY7, PNRIA_OP_8XYE,
+    PNRIA_OP_9XY0,
+    PNRIA_OP_ANNN, PNRIA_OP_BNNN, PNRIA_OP_CXKK, PNRIA_OP_DXYN,
+    PNRIA_OP_EX9E, PNRIA_OP_EXA1,
+    PNRIA_OP_FX07, PNRIA_OP_FX0A, PNRIA_OP_FX15, PNRIA_OP_FX18, PNRIA_OP_FX1E,
+    PNRIA_OP_FX29, PNRIA_OP_FX33, PNRIA_OP_FX55, PNRIA_OP_FX65,
+    PNRIA_OP_COUNT
+} pnria_op_t;
+
+// a decoded opcode
+typedef struct {
+    unsigned short opcode;
+    unsigned char op;
+    unsigned char x;
+    unsigned char y;
+    unsigned char n;
+    unsigned char kk;
+    unsigned short nnn;
+} pnria_instruction_t;
+
+// decoding tables, must resolve every opcode to the same instruction the
+// handler tables do. Indexed by the top and the lowest nibbles, F opcodes are
+// indexed by their lowest byte
+static const unsigned char pnria_optable[0x10][0x10] = {
+    [0x0] = { [0x0] = PNRIA_OP_00E0, [0xE] = PNRIA_OP_00EE },
+    [0x1] = { [0x0 ... 0xF] = PNRIA_OP_1NNN },
+    [0x2] = { [0x0 ... 0xF] = PNRIA_OP_2NNN },
+    [0x3] = { [0x0 ... 0xF] = PNRIA_OP_3XKK },
+    [0x4] = { [0x0 ... 0xF] = PNRIA_OP_4XKK },
+    [0x5] = { [0x0 ... 0xF] = PNRIA_OP_5XY0 },
+    [0x6] = { [0x0 ... 0xF] = PNRIA_OP_6XKK },
+    [0x7] = { [0x0 ... 0xF] = PNRIA_OP_7XKK },
+    [0x8] = {
+        [0x0] = PNRIA_OP_8XY0, [0x1] = PNRIA_OP_8XY1, [0x2] = PNRIA_OP_8XY2,
+        [0x3] = PNRIA_OP_8XY3, [0x4] = PNRIA_OP_8XY4, [0x5] = PNRIA_OP_8XY5,
+        [0x6] = PNRIA_OP_8XY6, [0x7] = PNRIA_OP_8XY7, [0xE] = PNRIA_OP_8XYE
+    },
+    [0x9] = { [0x0 ... 0xF] = PNRIA_OP_9XY0 },
+    [0xA] = { [0x0 ... 0xF] = PNRIA_OP_ANNN },
+    [0xB] = { [0x0 ... 0xF] = PNRIA_OP_BNNN },
+    [0xC] = { [0x0 ... 0xF] = PNRIA_OP_CXKK },
+    [0xD] = { [0x0 ... 0xF] = PNRIA_OP_DXYN },
+    [0xE] = { [0x1] = PNRIA_OP_EXA1, [0xE] = PNRIA_OP_EX9E }
+};
+
+static const unsigned char pnria_foptable[0x100] = {
+    [0x07] = PNRIA_OP_FX07,
+    [0x0A] = PNRIA_OP_FX0A,
+    [0x15] = PNRIA_OP_FX15,
+    [0x18] = PNRIA_OP_FX18,
+    [0x1E] = PNRIA_OP_FX1E,
+    [0x29] = PNRIA_OP_FX29,
+    [0x33] = PNRIA_OP_FX33,
+    [0x55] = PNRIA_OP_FX55,
+    [0x65] = PNRIA_OP_FX65
+};
+
+static inline pnria_instruction_t pnria_decode(unsigned short opcode)
+{
+    unsigned short group = opcode >> 12;
+
+    return (pnria_instruction_t) {
+        .opcode = opcode,
+        .op  = group == 0xF ? pnria_foptable[opcode & 0x00FF]
+                            : pnria_optable[group][opcode & 0x000F],
+        .x   = (opcode & 0x0F00) >> 8,
+        .y   = (opcode & 0x00F0) >> 4,
+        .n   = opcode & 0x000F,
+        .kk  = opcode & 0x00FF,
+        .nnn = opcode & 0x0FFF
+    };
+}
+
+#define PNRIA_DECODE_CACHE_SIZE (PNRIA_MEMORY_SIZE / PNRIA_OPCODE_SIZE)
+
+typedef struct {
+    // address + 1 the instruction was decoded from, 0 marks an empty entry.
+    // Odd addresses share the entry of the even address below them
+    unsigned short tag;
+    pnria_instruction_t instruction;
+} pnria_cache_entry_t;
+
+typedef struct pnria_jit pnria_jit_t;
+
+// memory pages shared between a context and its forks, never written while
+// shared
+#define PNRIA_PAGE_SIZE 256
+#define PNRIA_PAGE_COUNT (PNRIA_MEMORY_SIZE / PNRIA_PAGE_SIZE)
+
+typedef struct {
+    atomic_int refs;
+    unsigned char bytes[PNRIA_PAGE_SIZE];
+} pnria_page_t;
+
+static inline void pnria_page_release(pnria_page_t *page)
+{
+    if (page && atomic_fetch_sub(&page->refs, 1) == 1) {
+        free(page);
+    }
+}
+
+// new pages holding a copy of the memory, false with none allocated on errors
+bool pnria_pages_create(pnria_page_t **pages, const unsigned char *memory);
+
+// makes the context's memory equal to the pages and remembers them, copying
+// only the pages that differ
+void pnria_share_pages(pnria_ctx_t *ctx, pnria_page_t *const *pages);
+
+// cycles run inside a call path, the subroutines called from the outermost in
+typedef struct {
+    unsigned short calls[PNRIA_STACK_SIZE];
+    int depth;
+    bool used;
+    unsigned long cycles;
+} pnria_profile_path_t;
+
+struct pnria_profile {
+    unsigned long cycles;
+    unsigned long keyWaitCycles;
+    // executions of every instruction, indexed by pnria_op_t, and of every
+    // address
+    unsigned long ops[PNRIA_OP_COUNT];
+    unsigned long addresses[PNRIA_MEMORY_SIZE];
+
+    // open addressing table of the call paths, at least twice their count
+    pnria_profile_path_t *paths;
+    size_t pathCount;
+    size_t pathSlots;
+};
+
+// the call path the context's stack is in, added the first time. NULL if
+// there's no memory for it
+pnria_profile_path_t *pnria_profile_path(pnria_profile_t *profile, const pnria_ctx_t *ctx);
+
+struct pnria_ctx {
+    pnria_state_t chip8;
+    pnria_backend_t backend;
+
+    // instructions per 60 Hz frame, and the ones left in the current frame
+    int cyclesPerFrame;
+    int frameCycles;
+
+    // CXKK's generator, restarted from the seed by init
+    uint64_t seed;
+    uint64_t random;
+
+    // frames run since init
+    long frame;
+
+    // recording being written or replayed, NULL for neither
+    pnria_recording_t *recording;
+    bool replaying;
+
+    // decoded instructions used by the threaded backend
+    pnria_cache_entry_t cache[PNRIA_DECODE_CACHE_SIZE];
+
+    // translated code, created the first time the jit backend runs
+    pnria_jit_t *jit;
+
+#if defined(PNRIA_PROFILER)
+    // counts of what runs, NULL when not profiling
+    pnria_profile_t *profile;
+#endif
+
+    // byte per pixel copy of the screen returned by pnria_ctx_get_screen,
+    // unpacked again only when the screen generation changes
+    unsigned char pixels[PNRIA_SCREEN_SIZE];
+    unsigned long pixelsGeneration;
+
+    // screen changes since the last pnria_ctx_clear_dirty, one bit per row
+    // and per column with column 0 in the most significant bit
+    uint32_t dirtyRows;
+    uint64_t dirtyColumns;
+
+    // bumped by every change to the screen
+    unsigned long generation;
+
+    // memory as it was after init and load, save states only keep the bytes
+    // that differ from it. Either ownImage or the image of a library rom
+    const unsigned char *image;
+    uint32_t imageHash;
+    unsigned char ownImage[PNRIA_MEMORY_SIZE];
+
+    // the image as pages, restarting only copies the ones written since.
+    // Those of the library rom, or taken by the first restart and dropped
+    // when the image changes
+    pnria_page_t *imagePages[PNRIA_PAGE_COUNT];
+
+    // page each part of the memory is a copy of, taken by the last fork or
+    // restored from one, NULL once written since
+    pnria_page_t *pages[PNRIA_PAGE_COUNT];
+};
+
+// copies every field of the chip8 state but the memory, between any structs
+// with the same field names
+#define PNRIA_COPY_REGISTERS(to, from) do {                     \
+    (to)->opcode = (from)->opcode;                              \
+    memcpy((to)->V, (from)->V, sizeof((to)->V));                \
+    (to)->I = (from)->I;                                        \
+    (to)->PC = (from)->PC;                                      \
+    memcpy((to)->screen, (from)->screen, sizeof((to)->screen)); \
+    (to)->delay = (from)->delay;                                \
+    (to)->sound = (from)->sound;                                \
+    memcpy((to)->stack, (from)->stack, sizeof((to)->stack));    \
+    (to)->SP = (from)->SP;                                      \
+    memcpy((to)->key, (from)->key, sizeof((to)->key));          \
+    (to)->waiting_for_key = (from)->waiting_for_key;            \
+} while (0)
+
+// 32 bit FNV-1a
+static inline uint32_t pnria_hash(const void *data, size_t size)
+{
+    const unsigned char *bytes = data;
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < size; ++i) {
+        hash = (hash ^ bytes[i]) * 16777619u;
+    }
+    return hash;
+}
+
+// 64 bit FNV-1a
+static inline uint64_t pnria_hash64(const void *data, size_t size)
+{
+    const unsigned char *bytes = data;
+    uint64_t hash = 14695981039346656037ull;
+    for (size_t i = 0; i < size; ++i) {
+        hash = (hash ^ bytes[i]) * 1099511628211ull;
+    }
+    return hash;
+}
+
+// generator state for a seed, splitmix64 so nearby seeds give unrelated
+// sequences. Never 0, which xorshift can't leave
+static inline uint64_t pnria_random_seed(uint64_t seed)
+{
+    uint64_t z = seed + 0x9E3779B97F4A7C15ull;
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+    z ^= z >> 31;
+    return z ? z : 1;
+}
+
+// next random byte, xorshift64* keeping the high bits of the product
+static inline unsigned char pnria_random(uint64_t *state)
+{
+    uint64_t x = *state;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    *state = x;
+    return (x * 0x2545F4914F6CDD1Dull) >> 56;
+}
+
+static inline uint64_t pnria_load64(const unsigned char *bytes)
+{
+    uint64_t value;
+    memcpy(&value, bytes, sizeof(value));
+    return value;
+}
+
+// first index from i on where a[0, size) and b differ, size if none. Most of
+// the bytes usually match, so whole blocks are skipped with memcmp first
+static inline unsigned int pnria_first_difference(const unsigned char *a, const unsigned char *b, unsigned int i,
+                                                  unsigned int size)
+{
+    for (; i + 64 <= size && memcmp(a + i, b + i, 64) == 0; i += 64);
+    for (; i + 8 <= size && pnria_load64(a + i) == pnria_load64(b + i); i += 8);
+    for (; i < size && a[i] == b[i]; ++i);
+    return i;
+}
+
+// records the rows and columns changed by an instruction
+static inline void pnria_mark_dirty(pnria_ctx_t *ctx, uint32_t rows, uint64_t columns)
+{
+    if (rows) {
+        ctx->dirtyRows |= rows;
+        ctx->dirtyColumns |= columns;
+        ++ctx->generation;
+    }
+}
+
+// called at the start of every frame while recording or replaying, applies
+// the frame's recorded input
+void pnria_recording_frame(pnria_ctx_t *ctx);
+// called after the keys are set while recording
+void pnria_recording_input(pnria_ctx_t *ctx);
+// called when the context goes back to another frame while recording or
+// replaying
+void pnria_recording_seek(pnria_ctx_t *ctx);
+
+// counts the cycles run in the current frame, which must not go past its end,
+// ticking the timers when it ends
+static inline void pnria_advance(pnria_ctx_t *ctx, int cycles)
+{
+    ctx->frameCycles -= cycles;
+    if (ctx->frameCycles > 0) {
+        return;
+    }
+    ctx->frameCycles = ctx->cyclesPerFrame;
+
+    ++ctx->frame;
+    if (ctx->recording) {
+        pnria_recording_frame(ctx);
+    }
+
+    if (ctx->chip8.delay > 0) {
+        pnria_debug("Decrementing delay timer, value: %d", ctx->chip8.delay);
+        --ctx->chip8.delay;
+    }
+
+    if (ctx->chip8.sound > 0) {
+        pnria_debug("Decrementing sound timer, value: %d", ctx->chip8.sound);
+        --ctx->chip8.sound;
+    }
+}
+
+void pnria_threaded_run(pnria_ctx_t *ctx, long cycles);
+
+// everything save states and rewind frames bring back
+typedef struct {
+    pnria_state_t chip8;
+    int cyclesPerFrame;
+    int frameCycles;
+    uint64_t random;
+    long frame;
+} pnria_snapshot_t;
+
+void pnria_snapshot(pnria_ctx_t *ctx, pnria_snapshot_t *snapshot);
+// only drops the instructions decoded from memory that changes, marks the
+// whole screen dirty
+void pnria_restore(pnria_ctx_t *ctx, const pnria_snapshot_t *snapshot);
+
+// everything init resets but the memory
+void pnria_reset_registers(pnria_ctx_t *ctx);
+
+// the image restart goes back to, with its pages if it has them
+void pnria_set_image(pnria_ctx_t *ctx, const unsigned char *image, uint32_t hash, pnria_page_t *const *pages);
+
+// drops the decoded instructions overlapping memory[start, end), called on
+// every write to the memory
+void pnria_invalidate(pnria_ctx_t *ctx, unsigned int start, unsigned int end);
+
+// draws a sprite of n lines at x, y, pixels past the right edge continue on
+// the next row and rows past the bottom are clipped. Adds the rows and columns
+// that changed to the masks, returns true if any set pixel was erased
+bool pnria_draw(uint64_t *screen, const unsigned char *sprite, unsigned int x, unsigned int y, int n,
+                uint32_t *changedRows, uint64_t *changedColumns);
+
+#if defined(PNRIA_JIT)
+void pnria_jit_run(pnria_ctx_t *ctx, long cycles);
+void pnria_jit_invalidate(pnria_ctx_t *ctx, unsigned int start, unsigned int end);
+void pnria_jit_destroy(pnria_jit_t *jit);
+#endif
+
+#endif // PANAROIA_P_H
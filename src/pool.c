@@ -0,0 +1,359 @@
+#include "panaroia_p.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+// Every worker owns a deque of jobs. It pushes and pops at the bottom, so jobs
+// submitted from its own callbacks run first while their data is still warm,
+// and idle workers steal the oldest jobs from the top of the others' deques.
+// Jobs are whole rom sessions, so a lock per deque costs nothing compared to
+// running them.
+
+typedef struct {
+    pthread_mutex_t lock;
+    pnria_job_t *jobs;
+    // ring buffer, top is where thieves take jobs, bottom where the owner does
+    size_t top;
+    size_t bottom;
+    size_t capacity;
+} pnria_deque_t;
+
+typedef struct {
+    pnria_pool_t *pool;
+    int index;
+    pthread_t thread;
+    pnria_deque_t deque;
+} pnria_worker_t;
+
+struct pnria_pool {
+    int count;
+    int started;
+    pnria_worker_t *workers;
+
+    // protects the counters below and the conditions
+    pthread_mutex_t lock;
+    pthread_cond_t work;
+    pthread_cond_t idle;
+    // jobs sitting in deques, and jobs submitted but not done yet
+    long queued;
+    long pending;
+    // deque for the next job submitted from outside the workers
+    int next;
+    bool stopping;
+};
+
+// the worker running on the current thread, if any
+static _Thread_local pnria_worker_t *pnria_current_worker;
+
+static bool pnria_deque_push(pnria_deque_t *deque, const pnria_job_t *job)
+{
+    pthread_mutex_lock(&deque->lock);
+
+    if (deque->bottom - deque->top == deque->capacity) {
+        size_t capacity = deque->capacity ? deque->capacity * 2 : 64;
+        pnria_job_t *jobs = malloc(capacity * sizeof(pnria_job_t));
+        if (!jobs) {
+            pthread_mutex_unlock(&deque->lock);
+            return false;
+        }
+
+        for (size_t i = deque->top; i < deque->bottom; ++i) {
+            jobs[i - deque->top] = deque->jobs[i % deque->capacity];
+        }
+        free(deque->jobs);
+
+        deque->jobs = jobs;
+        deque->bottom -= deque->top;
+        deque->top = 0;
+        deque->capacity = capacity;
+    }
+
+    deque->jobs[deque->bottom++ % deque->capacity] = *job;
+
+    pthread_mutex_unlock(&deque->lock);
+    return true;
+}
+
+static bool pnria_deque_pop(pnria_deque_t *deque, pnria_job_t *job, bool steal)
+{
+    pthread_mutex_lock(&deque->lock);
+
+    bool found = deque->top != deque->bottom;
+    if (found) {
+        *job = steal ? deque->jobs[deque->top++ % deque->capacity]
+                     : deque->jobs[--deque->bottom % deque->capacity];
+    }
+
+    pthread_mutex_unlock(&deque->lock);
+    return found;
+}
+
+static void pnria_job_free(pnria_job_t *job)
+{
+    free((char *)job->romFile);
+    free((void *)job->rom);
+    free((pnria_input_event_t *)job->inputs);
+}
+
+// own deque first, then the others starting with the next worker
+static bool pnria_pool_take(pnria_worker_t *worker, pnria_job_t *job)
+{
+    pnria_pool_t *pool = worker->pool;
+
+    bool found = pnria_deque_pop(&worker->deque, job, false);
+    for (int i = 1; !found && i < pool->count; ++i) {
+        found = pnria_deque_pop(&pool->workers[(worker->index + i) % pool->count].deque, job, true);
+    }
+
+    if (found) {
+        pthread_mutex_lock(&pool->lock);
+        --pool->queued;
+        pthread_mutex_unlock(&pool->lock);
+    }
+
+    return found;
+}
+
+static void pnria_pool_run(pnria_ctx_t *ctx, const pnria_job_t *job)
+{
+    pnria_ctx_set_cycles_per_frame(ctx, job->cyclesPerFrame > 0 ? job->cyclesPerFrame : PNRIA_CYCLES_PER_FRAME);
+    pnria_ctx_set_seed(ctx, job->seed);
+
+    bool loaded = true;
+    if (job->libraryRom) {
+        pnria_ctx_load_rom(ctx, job->libraryRom);
+        if (job->cyclesPerFrame > 0) {
+            pnria_ctx_set_cycles_per_frame(ctx, job->cyclesPerFrame);
+        }
+    } else {
+        pnria_ctx_init(ctx);
+        loaded = job->romFile ? pnria_ctx_load(ctx, job->romFile)
+                              : pnria_ctx_load_buffer(ctx, job->rom, job->romSize);
+    }
+
+    if (!loaded) {
+        if (job->done) {
+            job->done(job, NULL);
+        }
+        return;
+    }
+
+    long next = 0;
+    for (long frame = 0; frame < job->frames; ++frame) {
+        while (next < job->inputCount && job->inputs[next].frame <= frame) {
+            pnria_ctx_set_input(ctx, job->inputs[next++].keys);
+        }
+
+        pnria_run_frame(ctx);
+    }
+
+    if (job->done) {
+        job->done(job, ctx);
+    }
+}
+
+static void *pnria_worker_main(void *data)
+{
+    pnria_worker_t *worker = data;
+    pnria_pool_t *pool = worker->pool;
+
+    pnria_current_worker = worker;
+
+    pnria_ctx_t *ctx = pnria_create();
+
+    for (;;) {
+        pnria_job_t job;
+        if (!pnria_pool_take(worker, &job)) {
+            pthread_mutex_lock(&pool->lock);
+            // a job can be taken before its submit counted it as queued
+            while (pool->queued <= 0 && !pool->stopping) {
+                pthread_cond_wait(&pool->work, &pool->lock);
+            }
+            bool stop = pool->queued <= 0 && pool->stopping;
+            pthread_mutex_unlock(&pool->lock);
+
+            if (stop) {
+                break;
+            }
+            continue;
+        }
+
+        if (ctx) {
+            pnria_pool_run(ctx, &job);
+        } else if (job.done) {
+            job.done(&job, NULL);
+        }
+        pnria_job_free(&job);
+
+        pthread_mutex_lock(&pool->lock);
+        if (--pool->pending == 0) {
+            pthread_cond_broadcast(&pool->idle);
+        }
+        pthread_mutex_unlock(&pool->lock);
+    }
+
+    pnria_destroy(ctx);
+    pnria_current_worker = NULL;
+
+    return NULL;
+}
+
+pnria_pool_t *pnria_pool_create(int threads)
+{
+    if (threads == 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        threads = cpus > 0 ? cpus : 1;
+    }
+
+    if (threads < 0) {
+        pnria_error("Invalid thread count: %d", threads);
+        return NULL;
+    }
+
+    pnria_pool_t *pool = calloc(1, sizeof(pnria_pool_t));
+    pnria_worker_t *workers = calloc(threads, sizeof(pnria_worker_t));
+    if (!pool || !workers) {
+        pnria_error("Error allocating pool: %s", strerror(errno));
+        free(pool);
+        free(workers);
+        return NULL;
+    }
+
+    pool->count = threads;
+    pool->workers = workers;
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->work, NULL);
+    pthread_cond_init(&pool->idle, NULL);
+
+    for (int i = 0; i < threads; ++i) {
+        workers[i].pool = pool;
+        workers[i].index = i;
+        pthread_mutex_init(&workers[i].deque.lock, NULL);
+    }
+
+    // jobs given to a worker that couldn't start are stolen by the others
+    for (; pool->started < threads; ++pool->started) {
+        pnria_worker_t *worker = &workers[pool->started];
+        int error = pthread_create(&worker->thread, NULL, pnria_worker_main, worker);
+        if (error) {
+            pnria_error("Error starting worker thread: %s", strerror(error));
+            break;
+        }
+    }
+
+    if (pool->started == 0) {
+        pnria_pool_destroy(pool);
+        return NULL;
+    }
+
+    pnria_debug("Pool started with %d threads", pool->started);
+
+    return pool;
+}
+
+void pnria_pool_destroy(pnria_pool_t *pool)
+{
+    if (!pool) {
+        return;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    pool->stopping = true;
+    pthread_cond_broadcast(&pool->work);
+    pthread_mutex_unlock(&pool->lock);
+
+    for (int i = 0; i < pool->started; ++i) {
+        pthread_join(pool->workers[i].thread, NULL);
+    }
+
+    // the workers only stop once the deques are empty
+    for (int i = 0; i < pool->count; ++i) {
+        free(pool->workers[i].deque.jobs);
+        pthread_mutex_destroy(&pool->workers[i].deque.lock);
+    }
+
+    pthread_cond_destroy(&pool->idle);
+    pthread_cond_destroy(&pool->work);
+    pthread_mutex_destroy(&pool->lock);
+    free(pool->workers);
+    free(pool);
+}
+
+int pnria_pool_size(pnria_pool_t *pool)
+{
+    return pool->started;
+}
+
+bool pnria_pool_submit(pnria_pool_t *pool, const pnria_job_t *job)
+{
+    if ((!job->romFile && !job->rom && !job->libraryRom) || job->frames < 0 || job->inputCount < 0) {
+        pnria_error("Invalid job");
+        return false;
+    }
+
+    pnria_job_t copy = *job;
+    copy.romFile = job->romFile ? strdup(job->romFile) : NULL;
+    copy.rom = NULL;
+    if (!job->romFile && !job->libraryRom) {
+        void *rom = malloc(job->romSize ? job->romSize : 1);
+        if (rom) {
+            memcpy(rom, job->rom, job->romSize);
+        }
+        copy.rom = rom;
+    }
+    copy.inputs = NULL;
+    if (job->inputCount > 0) {
+        pnria_input_event_t *inputs = malloc(job->inputCount * sizeof(pnria_input_event_t));
+        if (inputs) {
+            memcpy(inputs, job->inputs, job->inputCount * sizeof(pnria_input_event_t));
+        }
+        copy.inputs = inputs;
+    }
+
+    if ((job->romFile && !copy.romFile) || (!job->romFile && !job->libraryRom && !copy.rom) ||
+        (job->inputCount > 0 && !copy.inputs)) {
+        pnria_error("Error allocating job: %s", strerror(errno));
+        pnria_job_free(&copy);
+        return false;
+    }
+
+    // counted as pending before it's visible, so a wait can't miss it
+    pthread_mutex_lock(&pool->lock);
+    pnria_worker_t *worker = pnria_current_worker;
+    if (!worker || worker->pool != pool) {
+        worker = &pool->workers[pool->next];
+        pool->next = (pool->next + 1) % pool->count;
+    }
+    ++pool->pending;
+    pthread_mutex_unlock(&pool->lock);
+
+    if (!pnria_deque_push(&worker->deque, &copy)) {
+        pnria_error("Error allocating job: %s", strerror(errno));
+        pnria_job_free(&copy);
+
+        pthread_mutex_lock(&pool->lock);
+        if (--pool->pending == 0) {
+            pthread_cond_broadcast(&pool->idle);
+        }
+        pthread_mutex_unlock(&pool->lock);
+        return false;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    ++pool->queued;
+    pthread_cond_signal(&pool->work);
+    pthread_mutex_unlock(&pool->lock);
+
+    return true;
+}
+
+void pnria_pool_wait(pnria_pool_t *pool)
+{
+    pthread_mutex_lock(&pool->lock);
+    while (pool->pending > 0) {
+        pthread_cond_wait(&pool->idle, &pool->lock);
+    }
+    pthread_mutex_unlock(&pool->lock);
+}
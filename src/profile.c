@@ -0,0 +1,228 @@
+#include "panaroia_p.h"
+
+#include <errno.h>
+#include <stdio.h>
+
+// Contexts count into a profile from their run loop when the library is built
+// with PNRIA_PROFILER, this only keeps and writes the counts. Call paths are
+// the subroutines the stack is in, read from the 2NNN each return address
+// points at, and are kept in an open addressing table looked up again only
+// after a call or a return.
+
+static const char *const pnria_op_names[PNRIA_OP_COUNT] = {
+    [PNRIA_OP_UNKNOWN] = "unknown",
+    [PNRIA_OP_00E0] = "00E0", [PNRIA_OP_00EE] = "00EE",
+    [PNRIA_OP_1NNN] = "1NNN", [PNRIA_OP_2NNN] = "2NNN",
+    [PNRIA_OP_3XKK] = "3XKK", [PNRIA_OP_4XKK] = "4XKK", [PNRIA_OP_5XY0] = "5XY0",
+    [PNRIA_OP_6XKK] = "6XKK", [PNRIA_OP_7XKK] = "7XKK",
+    [PNRIA_OP_8XY0] = "8XY0", [PNRIA_OP_8XY1] = "8XY1", [PNRIA_OP_8XY2] = "8XY2", [PNRIA_OP_8XY3] = "8XY3",
+    [PNRIA_OP_8XY4] = "8XY4", [PNRIA_OP_8XY5] = "8XY5", [PNRIA_OP_8XY6] = "8XY6", [PNRIA_OP_8XY7] = "8XY7",
+    [PNRIA_OP_8XYE] = "8XYE",
+    [PNRIA_OP_9XY0] = "9XY0",
+    [PNRIA_OP_ANNN] = "ANNN", [PNRIA_OP_BNNN] = "BNNN", [PNRIA_OP_CXKK] = "CXKK", [PNRIA_OP_DXYN] = "DXYN",
+    [PNRIA_OP_EX9E] = "EX9E", [PNRIA_OP_EXA1] = "EXA1",
+    [PNRIA_OP_FX07] = "FX07", [PNRIA_OP_FX0A] = "FX0A", [PNRIA_OP_FX15] = "FX15", [PNRIA_OP_FX18] = "FX18",
+    [PNRIA_OP_FX1E] = "FX1E", [PNRIA_OP_FX29] = "FX29", [PNRIA_OP_FX33] = "FX33", [PNRIA_OP_FX55] = "FX55",
+    [PNRIA_OP_FX65] = "FX65"
+};
+
+pnria_profile_t *pnria_profile_create()
+{
+    pnria_profile_t *profile = calloc(1, sizeof(pnria_profile_t));
+    if (!profile) {
+        pnria_error("Error allocating profile: %s", strerror(errno));
+        return NULL;
+    }
+
+    return profile;
+}
+
+void pnria_profile_destroy(pnria_profile_t *profile)
+{
+    if (!profile) {
+        return;
+    }
+
+    free(profile->paths);
+    free(profile);
+}
+
+void pnria_profile_clear(pnria_profile_t *profile)
+{
+    free(profile->paths);
+    memset(profile, 0, sizeof(pnria_profile_t));
+}
+
+static uint64_t pnria_calls_hash(const unsigned short *calls, int depth)
+{
+    return pnria_hash64(calls, depth * sizeof(unsigned short));
+}
+
+static pnria_profile_path_t *pnria_path_slot(pnria_profile_path_t *paths, size_t slots,
+                                             const unsigned short *calls, int depth)
+{
+    size_t slot = pnria_calls_hash(calls, depth) & (slots - 1);
+    while (paths[slot].used && (paths[slot].depth != depth ||
+           memcmp(paths[slot].calls, calls, depth * sizeof(unsigned short)) != 0)) {
+        slot = (slot + 1) & (slots - 1);
+    }
+    return &paths[slot];
+}
+
+static bool pnria_profile_grow(pnria_profile_t *profile)
+{
+    size_t slots = profile->pathSlots ? profile->pathSlots * 2 : 64;
+    pnria_profile_path_t *paths = calloc(slots, sizeof(pnria_profile_path_t));
+    if (!paths) {
+        pnria_error("Error allocating profile paths: %s", strerror(errno));
+        return false;
+    }
+
+    for (size_t i = 0; i < profile->pathSlots; ++i) {
+        const pnria_profile_path_t *path = &profile->paths[i];
+        if (path->used) {
+            *pnria_path_slot(paths, slots, path->calls, path->depth) = *path;
+        }
+    }
+
+    free(profile->paths);
+    profile->paths = paths;
+    profile->pathSlots = slots;
+
+    return true;
+}
+
+pnria_profile_path_t *pnria_profile_path(pnria_profile_t *profile, const pnria_ctx_t *ctx)
+{
+    // 2NNN pushes its own address, the subroutine is the NNN stored there
+    unsigned short calls[PNRIA_STACK_SIZE];
+    int depth = ctx->chip8.SP < PNRIA_STACK_SIZE ? ctx->chip8.SP : PNRIA_STACK_SIZE;
+    for (int i = 0; i < depth; ++i) {
+        unsigned short address = ctx->chip8.stack[i] % PNRIA_MEMORY_SIZE;
+        calls[i] = (ctx->chip8.memory[address] << 8 | ctx->chip8.memory[(address + 1) % PNRIA_MEMORY_SIZE]) & 0x0FFF;
+    }
+
+    if (profile->pathSlots) {
+        pnria_profile_path_t *path = pnria_path_slot(profile->paths, profile->pathSlots, calls, depth);
+        if (path->used) {
+            return path;
+        }
+    }
+
+    if ((profile->pathCount + 1) * 2 > profile->pathSlots && !pnria_profile_grow(profile)) {
+        return NULL;
+    }
+
+    pnria_profile_path_t *path = pnria_path_slot(profile->paths, profile->pathSlots, calls, depth);
+    memcpy(path->calls, calls, depth * sizeof(unsigned short));
+    path->depth = depth;
+    path->used = true;
+    ++profile->pathCount;
+
+    return path;
+}
+
+unsigned long pnria_profile_cycles(const pnria_profile_t *profile)
+{
+    return profile->cycles;
+}
+
+unsigned long pnria_profile_opcode_count(const pnria_profile_t *profile, unsigned short opcode)
+{
+    return profile->ops[pnria_decode(opcode).op];
+}
+
+unsigned long pnria_profile_address_count(const pnria_profile_t *profile, unsigned short address)
+{
+    return address < PNRIA_MEMORY_SIZE ? profile->addresses[address] : 0;
+}
+
+unsigned long pnria_profile_key_wait_cycles(const pnria_profile_t *profile)
+{
+    return profile->keyWaitCycles;
+}
+
+static FILE *pnria_profile_open(const char *file)
+{
+    FILE *out = fopen(file, "w");
+    if (!out) {
+        pnria_error("Error writing %s: %s", file, strerror(errno));
+    }
+    return out;
+}
+
+static bool pnria_profile_close(FILE *out, const char *file)
+{
+    bool written = !ferror(out);
+    if (fclose(out) != 0 || !written) {
+        pnria_error("Error writing %s: %s", file, strerror(errno));
+        return false;
+    }
+    return true;
+}
+
+bool pnria_profile_save_json(const pnria_profile_t *profile, const char *file)
+{
+    FILE *out = pnria_profile_open(file);
+    if (!out) {
+        return false;
+    }
+
+    fprintf(out, "{\n  \"cycles\": %lu,\n  \"key_wait_cycles\": %lu,\n  \"ops\": {",
+            profile->cycles, profile->keyWaitCycles);
+    for (int op = 0; op < PNRIA_OP_COUNT; ++op) {
+        fprintf(out, "%s\n    \"%s\": %lu", op > 0 ? "," : "", pnria_op_names[op], profile->ops[op]);
+    }
+
+    // only the addresses run
+    fprintf(out, "\n  },\n  \"addresses\": {");
+    bool first = true;
+    for (int address = 0; address < PNRIA_MEMORY_SIZE; ++address) {
+        if (profile->addresses[address]) {
+            fprintf(out, "%s\n    \"0x%03X\": %lu", first ? "" : ",", address, profile->addresses[address]);
+            first = false;
+        }
+    }
+
+    fprintf(out, "%s},\n  \"paths\": [", first ? "" : "\n  ");
+    first = true;
+    for (size_t i = 0; i < profile->pathSlots; ++i) {
+        const pnria_profile_path_t *path = &profile->paths[i];
+        if (!path->used) {
+            continue;
+        }
+
+        fprintf(out, "%s\n    { \"calls\": [", first ? "" : ",");
+        for (int call = 0; call < path->depth; ++call) {
+            fprintf(out, "%s\"0x%03X\"", call > 0 ? ", " : "", path->calls[call]);
+        }
+        fprintf(out, "], \"cycles\": %lu }", path->cycles);
+        first = false;
+    }
+    fprintf(out, "%s]\n}\n", first ? "" : "\n  ");
+
+    return pnria_profile_close(out, file);
+}
+
+bool pnria_profile_save_folded(const pnria_profile_t *profile, const char *file)
+{
+    FILE *out = pnria_profile_open(file);
+    if (!out) {
+        return false;
+    }
+
+    for (size_t i = 0; i < profile->pathSlots; ++i) {
+        const pnria_profile_path_t *path = &profile->paths[i];
+        if (!path->used || path->cycles == 0) {
+            continue;
+        }
+
+        fprintf(out, "main");
+        for (int call = 0; call < path->depth; ++call) {
+            fprintf(out, ";0x%03X", path->calls[call]);
+        }
+        fprintf(out, " %lu\n", path->cycles);
+    }
+
+    return pnria_profile_close(out, file);
+}
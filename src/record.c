@@ -0,0 +1,359 @@
+#include "panaroia_p.h"
+
+#include <errno.h>
+#include <stdio.h>
+
+// Recording layout, version 2, numbers in little endian:
+//   "PNRI", version (1), hash of the rom image (4), seed (8)
+//   cycles per frame (4), frames recorded (8), number of events (4)
+//   then for every event the frames since the previous one as a LEB128
+//   varint and the pressed keys, bit n for key n (2)
+
+#define PNRIA_RECORDING_MAGIC "PNRI"
+#define PNRIA_RECORDING_VERSION 2
+
+#define PNRIA_RECORDING_HEADER_SIZE 33
+
+// a LEB128 varint of a long never takes more
+#define PNRIA_VARINT_MAX_SIZE 10
+
+struct pnria_recording {
+    uint32_t imageHash;
+    uint64_t seed;
+    int cyclesPerFrame;
+    long frames;
+
+    // input changes sorted by frame, at most one per frame, keys are 0 or 1
+    pnria_input_event_t *events;
+    long count;
+    long capacity;
+
+    // next event to replay
+    long next;
+};
+
+static const char pnria_no_keys[PNRIA_INPUT_SIZE];
+
+static const char *pnria_recording_keys(pnria_recording_t *recording)
+{
+    return recording->count > 0 ? recording->events[recording->count - 1].keys : pnria_no_keys;
+}
+
+pnria_recording_t *pnria_recording_create()
+{
+    pnria_recording_t *recording = calloc(1, sizeof(pnria_recording_t));
+    if (!recording) {
+        pnria_error("Error allocating recording: %s", strerror(errno));
+        return NULL;
+    }
+
+    recording->cyclesPerFrame = PNRIA_CYCLES_PER_FRAME;
+
+    return recording;
+}
+
+void pnria_recording_destroy(pnria_recording_t *recording)
+{
+    if (!recording) {
+        return;
+    }
+
+    free(recording->events);
+    free(recording);
+}
+
+long pnria_recording_frames(pnria_recording_t *recording)
+{
+    return recording->frames;
+}
+
+uint64_t pnria_recording_seed(pnria_recording_t *recording)
+{
+    return recording->seed;
+}
+
+int pnria_recording_cycles_per_frame(pnria_recording_t *recording)
+{
+    return recording->cyclesPerFrame;
+}
+
+const pnria_input_event_t *pnria_recording_events(pnria_recording_t *recording, long *count)
+{
+    *count = recording->count;
+    return recording->events;
+}
+
+void pnria_ctx_record(pnria_ctx_t *ctx, pnria_recording_t *recording)
+{
+    // restarting releases every key
+    unsigned char held[PNRIA_INPUT_SIZE];
+    memcpy(held, ctx->chip8.key, PNRIA_INPUT_SIZE);
+
+    pnria_ctx_restart(ctx);
+
+    recording->imageHash = ctx->imageHash;
+    recording->seed = ctx->seed;
+    recording->cyclesPerFrame = ctx->cyclesPerFrame;
+    recording->frames = 0;
+    recording->count = 0;
+
+    ctx->recording = recording;
+    ctx->replaying = false;
+
+    // keys already held are pressed from the first frame
+    memcpy(ctx->chip8.key, held, PNRIA_INPUT_SIZE);
+    pnria_recording_input(ctx);
+}
+
+bool pnria_ctx_replay(pnria_ctx_t *ctx, pnria_recording_t *recording)
+{
+    if (recording->imageHash != ctx->imageHash) {
+        pnria_error("Recording of another rom");
+        return false;
+    }
+
+    ctx->seed = recording->seed;
+    pnria_ctx_set_cycles_per_frame(ctx, recording->cyclesPerFrame);
+    pnria_ctx_restart(ctx);
+
+    ctx->recording = recording;
+    ctx->replaying = true;
+    pnria_recording_seek(ctx);
+
+    return true;
+}
+
+void pnria_ctx_stop(pnria_ctx_t *ctx)
+{
+    ctx->recording = NULL;
+}
+
+void pnria_recording_frame(pnria_ctx_t *ctx)
+{
+    pnria_recording_t *recording = ctx->recording;
+
+    if (!ctx->replaying) {
+        recording->frames = ctx->frame;
+        return;
+    }
+
+    while (recording->next < recording->count && recording->events[recording->next].frame <= ctx->frame) {
+        memcpy(ctx->chip8.key, recording->events[recording->next++].keys, PNRIA_INPUT_SIZE);
+    }
+}
+
+void pnria_recording_input(pnria_ctx_t *ctx)
+{
+    pnria_recording_t *recording = ctx->recording;
+
+    char keys[PNRIA_INPUT_SIZE];
+    for (int i = 0; i < PNRIA_INPUT_SIZE; ++i) {
+        keys[i] = ctx->chip8.key[i] != 0;
+    }
+
+    // a change later in the same frame replaces the earlier one
+    if (recording->count > 0 && recording->events[recording->count - 1].frame == ctx->frame) {
+        --recording->count;
+    }
+
+    if (memcmp(keys, pnria_recording_keys(recording), PNRIA_INPUT_SIZE) == 0) {
+        return;
+    }
+
+    if (recording->count == recording->capacity) {
+        long capacity = recording->capacity ? recording->capacity * 2 : 256;
+        pnria_input_event_t *events = realloc(recording->events, capacity * sizeof(pnria_input_event_t));
+        if (!events) {
+            pnria_error("Error allocating recording events: %s", strerror(errno));
+            return;
+        }
+        recording->events = events;
+        recording->capacity = capacity;
+    }
+
+    pnria_input_event_t *event = &recording->events[recording->count++];
+    event->frame = ctx->frame;
+    memcpy(event->keys, keys, PNRIA_INPUT_SIZE);
+}
+
+void pnria_recording_seek(pnria_ctx_t *ctx)
+{
+    pnria_recording_t *recording = ctx->recording;
+
+    // first event after the frame
+    long low = 0;
+    long high = recording->count;
+    while (low < high) {
+        long middle = low + (high - low) / 2;
+        if (recording->events[middle].frame <= ctx->frame) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+
+    if (ctx->replaying) {
+        recording->next = low;
+        memcpy(ctx->chip8.key, low > 0 ? recording->events[low - 1].keys : pnria_no_keys, PNRIA_INPUT_SIZE);
+        return;
+    }
+
+    // the input from the frame on is recorded again, starting with the keys
+    // the context went back to
+    if (low > 0 && recording->events[low - 1].frame == ctx->frame) {
+        --low;
+    }
+    recording->count = low;
+    recording->frames = ctx->frame;
+    pnria_recording_input(ctx);
+}
+
+static inline void pnria_put_le(unsigned char *out, size_t *used, uint64_t value, int bytes)
+{
+    for (int i = 0; i < bytes; ++i) {
+        out[(*used)++] = value >> (i * 8);
+    }
+}
+
+static inline uint64_t pnria_get_le(const unsigned char *in, size_t *used, int bytes)
+{
+    uint64_t value = 0;
+    for (int i = 0; i < bytes; ++i) {
+        value |= (uint64_t)in[(*used)++] << (i * 8);
+    }
+    return value;
+}
+
+bool pnria_recording_save(pnria_recording_t *recording, const char *file)
+{
+    size_t size = PNRIA_RECORDING_HEADER_SIZE + recording->count * (PNRIA_VARINT_MAX_SIZE + 2);
+    unsigned char *data = malloc(size);
+    if (!data) {
+        pnria_error("Error allocating recording of %zu bytes: %s", size, strerror(errno));
+        return false;
+    }
+
+    size_t used = 0;
+    memcpy(data, PNRIA_RECORDING_MAGIC, 4);
+    used += 4;
+    pnria_put_le(data, &used, PNRIA_RECORDING_VERSION, 1);
+    pnria_put_le(data, &used, recording->imageHash, 4);
+    pnria_put_le(data, &used, recording->seed, 8);
+    pnria_put_le(data, &used, recording->cyclesPerFrame, 4);
+    pnria_put_le(data, &used, recording->frames, 8);
+    pnria_put_le(data, &used, recording->count, 4);
+
+    long frame = 0;
+    for (long i = 0; i < recording->count; ++i) {
+        const pnria_input_event_t *event = &recording->events[i];
+
+        uint64_t delta = event->frame - frame;
+        do {
+            data[used++] = (delta & 0x7F) | (delta > 0x7F ? 0x80 : 0);
+            delta >>= 7;
+        } while (delta);
+        frame = event->frame;
+
+        uint16_t keys = 0;
+        for (int k = 0; k < PNRIA_INPUT_SIZE; ++k) {
+            keys |= event->keys[k] << k;
+        }
+        pnria_put_le(data, &used, keys, 2);
+    }
+
+    FILE *f = fopen(file, "wb");
+    if (!f) {
+        pnria_error("Error writing recording %s: %s", file, strerror(errno));
+        free(data);
+        return false;
+    }
+
+    bool written = fwrite(data, 1, used, f) == used;
+    written = fclose(f) == 0 && written;
+    if (!written) {
+        pnria_error("Error writing recording %s", file);
+    }
+
+    free(data);
+    return written;
+}
+
+pnria_recording_t *pnria_recording_load(const char *file)
+{
+    FILE *f = fopen(file, "rb");
+    if (!f) {
+        pnria_error("Error reading recording %s: %s", file, strerror(errno));
+        return NULL;
+    }
+
+    fseek(f, 0, SEEK_END);
+    long size = ftell(f);
+    rewind(f);
+
+    unsigned char *data = size > 0 ? malloc(size) : NULL;
+    bool read = data && (long)fread(data, 1, size, f) == size;
+    fclose(f);
+
+    pnria_recording_t *recording = read ? pnria_recording_create() : NULL;
+    if (!recording) {
+        pnria_error("Error reading recording %s", file);
+        free(data);
+        return NULL;
+    }
+
+    size_t used = 0;
+    bool valid = size >= PNRIA_RECORDING_HEADER_SIZE && memcmp(data, PNRIA_RECORDING_MAGIC, 4) == 0;
+    used += 4;
+    if (valid) {
+        valid = pnria_get_le(data, &used, 1) == PNRIA_RECORDING_VERSION;
+        recording->imageHash = pnria_get_le(data, &used, 4);
+        recording->seed = pnria_get_le(data, &used, 8);
+        recording->cyclesPerFrame = pnria_get_le(data, &used, 4);
+        recording->frames = pnria_get_le(data, &used, 8);
+        recording->count = pnria_get_le(data, &used, 4);
+        recording->capacity = recording->count;
+        // every event takes at least 3 bytes
+        valid = valid && recording->cyclesPerFrame > 0 && recording->frames >= 0 &&
+                recording->count <= (size - (long)used) / 3;
+    }
+
+    if (valid && recording->count > 0) {
+        recording->events = malloc(recording->count * sizeof(pnria_input_event_t));
+        valid = recording->events != NULL;
+    }
+
+    long frame = 0;
+    for (long i = 0; valid && i < recording->count; ++i) {
+        uint64_t delta = 0;
+        int shift = 0;
+        unsigned char byte;
+        do {
+            byte = used < (size_t)size ? data[used++] : 0x80;
+            delta |= (uint64_t)(byte & 0x7F) << shift;
+            shift += 7;
+        } while (byte & 0x80 && shift < 7 * PNRIA_VARINT_MAX_SIZE);
+
+        // every event after the first changes the keys on a later frame
+        frame += delta;
+        valid = !(byte & 0x80) && used + 2 <= (size_t)size && (i == 0 || delta > 0) && frame <= recording->frames;
+        if (!valid) {
+            break;
+        }
+
+        uint16_t keys = pnria_get_le(data, &used, 2);
+        recording->events[i].frame = frame;
+        for (int k = 0; k < PNRIA_INPUT_SIZE; ++k) {
+            recording->events[i].keys[k] = (keys >> k) & 1;
+        }
+    }
+
+    free(data);
+
+    if (!valid || used != (size_t)size) {
+        pnria_error("Invalid recording %s", file);
+        pnria_recording_destroy(recording);
+        return NULL;
+    }
+
+    return recording;
+}
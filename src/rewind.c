@@ -0,0 +1,400 @@
+#include "panaroia_p.h"
+
+#include <errno.h>
+#include <stdlib.h>
+
+// Frames are snapshots encoded as runs of the bytes that differ from a base,
+// xored with it: a keyframe against an empty snapshot and the frames after it
+// against the keyframe. Every run is the distance from the end of the
+// previous one (2), its length (2) and the bytes. Encoded frames live in a
+// ring of bytes, wrapping to the start when one doesn't fit at the end, and
+// the oldest frame is always a keyframe. Each frame is stored between two
+// copies of its size and keyframe flag, so the ring is walked both ways and
+// the history never takes more than the bytes it was created with.
+
+// differing bytes up to this far apart share a run
+#define PNRIA_REWIND_RUN_GAP 4
+
+#define PNRIA_SNAPSHOT_SIZE sizeof(pnria_snapshot_t)
+
+// runs never take more than the snapshot plus the header of the first one
+#define PNRIA_REWIND_MAX_FRAME (PNRIA_SNAPSHOT_SIZE + 4)
+
+// size of the encoded frame shifted left once, the lowest bit set for
+// keyframes, before and after the frame
+typedef uint32_t pnria_rewind_tag_t;
+
+#define PNRIA_REWIND_TAG_SIZE sizeof(pnria_rewind_tag_t)
+#define PNRIA_REWIND_RECORD_SIZE(size) ((size) + 2 * PNRIA_REWIND_TAG_SIZE)
+
+struct pnria_rewind {
+    unsigned char *data;
+    size_t capacity;
+    size_t used;
+
+    // where the oldest and the newest frames start and where the newest ends.
+    // Once wrapped the frames from oldest on end at wrapEnd, and the newer
+    // ones start over from 0
+    size_t oldest;
+    size_t newest;
+    size_t head;
+    size_t wrapEnd;
+    bool wrapped;
+
+    int count;
+    int keyframes;
+
+    int keyframeInterval;
+
+    // decoded keyframe, index from the oldest frame or -1
+    pnria_snapshot_t key;
+    int keyIndex;
+
+    pnria_snapshot_t frame;
+    unsigned char encoded[PNRIA_REWIND_MAX_FRAME];
+};
+
+static const pnria_snapshot_t pnria_rewind_empty;
+
+static size_t pnria_rewind_encode(const pnria_snapshot_t *snapshot, const pnria_snapshot_t *base,
+                                  unsigned char *out)
+{
+    const unsigned char *a = (const unsigned char *)snapshot;
+    const unsigned char *b = (const unsigned char *)base;
+    size_t used = 0;
+
+    unsigned int end = 0;
+    for (;;) {
+        unsigned int start = pnria_first_difference(a, b, end, PNRIA_SNAPSHOT_SIZE);
+        if (start == PNRIA_SNAPSHOT_SIZE) {
+            break;
+        }
+
+        unsigned int last = start;
+        for (unsigned int i = start + 1; i < PNRIA_SNAPSHOT_SIZE && i - last <= PNRIA_REWIND_RUN_GAP; ++i) {
+            if (a[i] != b[i]) {
+                last = i;
+            }
+        }
+
+        uint16_t header[2] = { start - end, last + 1 - start };
+        memcpy(out + used, header, sizeof(header));
+        used += sizeof(header);
+        for (unsigned int i = start; i <= last; ++i) {
+            out[used++] = a[i] ^ b[i];
+        }
+        end = last + 1;
+    }
+
+    // an empty run for frames equal to their base, so every frame takes at
+    // least a run header
+    if (used == 0) {
+        memset(out, 0, 4);
+        used = 4;
+    }
+
+    return used;
+}
+
+static void pnria_rewind_decode(const unsigned char *data, size_t size, const pnria_snapshot_t *base,
+                                pnria_snapshot_t *snapshot)
+{
+    unsigned char *out = (unsigned char *)snapshot;
+    memcpy(out, base, PNRIA_SNAPSHOT_SIZE);
+
+    size_t end = 0;
+    for (size_t used = 0; used < size;) {
+        uint16_t header[2];
+        memcpy(header, data + used, sizeof(header));
+        used += sizeof(header);
+
+        size_t start = end + header[0];
+        for (size_t i = 0; i < header[1]; ++i) {
+            out[start + i] ^= data[used++];
+        }
+        end = start + header[1];
+    }
+}
+
+static pnria_rewind_tag_t pnria_rewind_tag(const pnria_rewind_t *rewind, size_t offset)
+{
+    pnria_rewind_tag_t tag;
+    memcpy(&tag, rewind->data + offset, PNRIA_REWIND_TAG_SIZE);
+    return tag;
+}
+
+static size_t pnria_rewind_size(const pnria_rewind_t *rewind, size_t offset)
+{
+    return pnria_rewind_tag(rewind, offset) >> 1;
+}
+
+static bool pnria_rewind_is_keyframe(const pnria_rewind_t *rewind, size_t offset)
+{
+    return pnria_rewind_tag(rewind, offset) & 1;
+}
+
+static const unsigned char *pnria_rewind_encoded(const pnria_rewind_t *rewind, size_t offset)
+{
+    return rewind->data + offset + PNRIA_REWIND_TAG_SIZE;
+}
+
+// where the frame after the one at offset starts
+static size_t pnria_rewind_next(const pnria_rewind_t *rewind, size_t offset)
+{
+    size_t end = offset + PNRIA_REWIND_RECORD_SIZE(pnria_rewind_size(rewind, offset));
+    return rewind->wrapped && end == rewind->wrapEnd ? 0 : end;
+}
+
+// where the frame before the one at offset starts
+static size_t pnria_rewind_previous(const pnria_rewind_t *rewind, size_t offset)
+{
+    size_t end = rewind->wrapped && offset == 0 ? rewind->wrapEnd : offset;
+    pnria_rewind_tag_t tag;
+    memcpy(&tag, rewind->data + end - PNRIA_REWIND_TAG_SIZE, PNRIA_REWIND_TAG_SIZE);
+    return end - PNRIA_REWIND_RECORD_SIZE(tag >> 1);
+}
+
+// where the frame at index starts, walking from the closest end
+static size_t pnria_rewind_offset(const pnria_rewind_t *rewind, int index)
+{
+    size_t offset;
+    if (index < rewind->count / 2) {
+        offset = rewind->oldest;
+        for (int i = 0; i < index; ++i) {
+            offset = pnria_rewind_next(rewind, offset);
+        }
+    } else {
+        offset = rewind->newest;
+        for (int i = rewind->count - 1; i > index; --i) {
+            offset = pnria_rewind_previous(rewind, offset);
+        }
+    }
+    return offset;
+}
+
+// index of the keyframe the frame at index was encoded against, and where
+// it starts
+static int pnria_rewind_keyframe(const pnria_rewind_t *rewind, int index, size_t *offset)
+{
+    size_t at = pnria_rewind_offset(rewind, index);
+    while (!pnria_rewind_is_keyframe(rewind, at)) {
+        at = pnria_rewind_previous(rewind, at);
+        --index;
+    }
+    *offset = at;
+    return index;
+}
+
+static void pnria_rewind_load_key(pnria_rewind_t *rewind, int key, size_t offset)
+{
+    if (rewind->keyIndex != key) {
+        pnria_rewind_decode(pnria_rewind_encoded(rewind, offset), pnria_rewind_size(rewind, offset),
+                            &pnria_rewind_empty, &rewind->key);
+        rewind->keyIndex = key;
+    }
+}
+
+static void pnria_rewind_load(pnria_rewind_t *rewind, int index, pnria_snapshot_t *snapshot)
+{
+    size_t keyOffset;
+    int key = pnria_rewind_keyframe(rewind, index, &keyOffset);
+    pnria_rewind_load_key(rewind, key, keyOffset);
+
+    if (index == key) {
+        *snapshot = rewind->key;
+    } else {
+        size_t offset = pnria_rewind_offset(rewind, index);
+        pnria_rewind_decode(pnria_rewind_encoded(rewind, offset), pnria_rewind_size(rewind, offset),
+                            &rewind->key, snapshot);
+    }
+}
+
+// drops the oldest keyframe and the frames encoded against it
+static void pnria_rewind_drop_oldest(pnria_rewind_t *rewind)
+{
+    do {
+        size_t offset = rewind->oldest;
+        rewind->used -= PNRIA_REWIND_RECORD_SIZE(pnria_rewind_size(rewind, offset));
+        rewind->keyframes -= pnria_rewind_is_keyframe(rewind, offset);
+        rewind->oldest = pnria_rewind_next(rewind, offset);
+        if (rewind->wrapped && rewind->oldest == 0) {
+            rewind->wrapped = false;
+        }
+        --rewind->count;
+        --rewind->keyIndex;
+    } while (rewind->count > 0 && !pnria_rewind_is_keyframe(rewind, rewind->oldest));
+
+    if (rewind->keyIndex < 0) {
+        rewind->keyIndex = -1;
+    }
+}
+
+// where a record of size bytes fits after the newest frame, or -1
+static long pnria_rewind_space(pnria_rewind_t *rewind, size_t size)
+{
+    if (rewind->count == 0) {
+        return size <= rewind->capacity ? 0 : -1;
+    }
+
+    if (rewind->wrapped) {
+        return rewind->oldest - rewind->head >= size ? (long)rewind->head : -1;
+    }
+    if (rewind->capacity - rewind->head >= size) {
+        return rewind->head;
+    }
+    return rewind->oldest >= size ? 0 : -1;
+}
+
+pnria_rewind_t *pnria_rewind_create(size_t bytes, int keyframeInterval)
+{
+    if (keyframeInterval < 0) {
+        pnria_error("Invalid keyframe interval: %d", keyframeInterval);
+        return NULL;
+    }
+
+    pnria_rewind_t *rewind = calloc(1, sizeof(pnria_rewind_t));
+    if (!rewind) {
+        pnria_error("Error allocating rewind history: %s", strerror(errno));
+        return NULL;
+    }
+
+    rewind->capacity = bytes;
+    rewind->data = malloc(bytes);
+    if (!rewind->data) {
+        pnria_error("Error allocating rewind history of %zu bytes: %s", bytes, strerror(errno));
+        pnria_rewind_destroy(rewind);
+        return NULL;
+    }
+
+    rewind->keyframeInterval = keyframeInterval > 0 ? keyframeInterval : PNRIA_REWIND_KEYFRAME_INTERVAL;
+    rewind->keyIndex = -1;
+
+    return rewind;
+}
+
+void pnria_rewind_destroy(pnria_rewind_t *rewind)
+{
+    if (!rewind) {
+        return;
+    }
+
+    free(rewind->data);
+    free(rewind);
+}
+
+void pnria_rewind_clear(pnria_rewind_t *rewind)
+{
+    rewind->oldest = 0;
+    rewind->newest = 0;
+    rewind->head = 0;
+    rewind->wrapped = false;
+    rewind->count = 0;
+    rewind->keyframes = 0;
+    rewind->used = 0;
+    rewind->keyIndex = -1;
+}
+
+bool pnria_rewind_push(pnria_rewind_t *rewind, pnria_ctx_t *ctx)
+{
+    pnria_snapshot(ctx, &rewind->frame);
+
+    size_t keyOffset = 0;
+    int key = rewind->count > 0 ? pnria_rewind_keyframe(rewind, rewind->count - 1, &keyOffset) : -1;
+    bool keyframe = key < 0 || rewind->count - key >= rewind->keyframeInterval;
+    if (!keyframe) {
+        pnria_rewind_load_key(rewind, key, keyOffset);
+    }
+
+    size_t size = pnria_rewind_encode(&rewind->frame, keyframe ? &pnria_rewind_empty : &rewind->key,
+                                      rewind->encoded);
+
+    // a frame that needs every frame before it gone is stored as a keyframe
+    long offset;
+    while ((offset = pnria_rewind_space(rewind, PNRIA_REWIND_RECORD_SIZE(size))) < 0) {
+        if (rewind->count == 0) {
+            pnria_error("Rewind history of %zu bytes too small for a frame of %zu", rewind->capacity, size);
+            return false;
+        }
+        if (!keyframe && rewind->keyframes == 1) {
+            keyframe = true;
+            size = pnria_rewind_encode(&rewind->frame, &pnria_rewind_empty, rewind->encoded);
+        }
+        pnria_rewind_drop_oldest(rewind);
+    }
+
+    if (rewind->count == 0) {
+        rewind->oldest = 0;
+        rewind->wrapped = false;
+    } else if (offset == 0 && !rewind->wrapped) {
+        rewind->wrapped = true;
+        rewind->wrapEnd = rewind->head;
+    }
+
+    pnria_rewind_tag_t tag = size << 1 | keyframe;
+    memcpy(rewind->data + offset, &tag, PNRIA_REWIND_TAG_SIZE);
+    memcpy(rewind->data + offset + PNRIA_REWIND_TAG_SIZE, rewind->encoded, size);
+    memcpy(rewind->data + offset + PNRIA_REWIND_TAG_SIZE + size, &tag, PNRIA_REWIND_TAG_SIZE);
+    rewind->newest = offset;
+    rewind->head = offset + PNRIA_REWIND_RECORD_SIZE(size);
+
+    if (keyframe) {
+        rewind->key = rewind->frame;
+        rewind->keyIndex = rewind->count;
+        ++rewind->keyframes;
+    }
+
+    ++rewind->count;
+    rewind->used += PNRIA_REWIND_RECORD_SIZE(size);
+
+    return true;
+}
+
+bool pnria_rewind_back(pnria_rewind_t *rewind, pnria_ctx_t *ctx)
+{
+    if (rewind->count < 2) {
+        return false;
+    }
+
+    size_t newest = rewind->newest;
+    rewind->used -= PNRIA_REWIND_RECORD_SIZE(pnria_rewind_size(rewind, newest));
+    rewind->keyframes -= pnria_rewind_is_keyframe(rewind, newest);
+    rewind->newest = pnria_rewind_previous(rewind, newest);
+    if (rewind->wrapped && newest == 0) {
+        rewind->wrapped = false;
+        rewind->head = rewind->wrapEnd;
+    } else {
+        rewind->head = newest;
+    }
+
+    --rewind->count;
+    if (rewind->keyIndex == rewind->count) {
+        rewind->keyIndex = -1;
+    }
+
+    pnria_rewind_load(rewind, rewind->count - 1, &rewind->frame);
+    pnria_restore(ctx, &rewind->frame);
+
+    return true;
+}
+
+bool pnria_rewind_restore(pnria_rewind_t *rewind, pnria_ctx_t *ctx, int age)
+{
+    if (age < 0 || age >= rewind->count) {
+        return false;
+    }
+
+    pnria_rewind_load(rewind, rewind->count - 1 - age, &rewind->frame);
+    pnria_restore(ctx, &rewind->frame);
+
+    return true;
+}
+
+int pnria_rewind_frames(pnria_rewind_t *rewind)
+{
+    return rewind->count;
+}
+
+size_t pnria_rewind_bytes(pnria_rewind_t *rewind)
+{
+    return rewind->used;
+}
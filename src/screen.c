@@ -0,0 +1,151 @@
+#include "panaroia_p.h"
+
+// Screen rows are unpacked straight into the caller's buffer from the row's
+// word, four pixels at a time through a table of the converted nibbles when
+// unscaled. Scaled, each run of equal pixels is filled at once, then the
+// finished line is copied to the scale - 1 lines below it.
+
+static size_t pnria_line_size(pnria_pixel_format_t format, int scale)
+{
+    int width = PNRIA_SCREEN_WIDTH * scale;
+    switch (format) {
+    case PNRIA_PIXELS_RGBA: return width * 4;
+    case PNRIA_PIXELS_BYTE: return width;
+    case PNRIA_PIXELS_BIT:  return (width + 7) / 8;
+    }
+    return 0;
+}
+
+// the pixels of every nibble already converted, so unscaled rows are copied
+// four pixels at a time
+typedef struct {
+    unsigned char rgba[16][16];
+    unsigned char bytes[16][4];
+} pnria_nibbles_t;
+
+static void pnria_nibbles_init(pnria_nibbles_t *nibbles, const uint32_t *palette)
+{
+    // the colors as they're laid out in memory, red first
+    unsigned char colors[2][4];
+    for (int i = 0; i < 2; ++i) {
+        colors[i][0] = palette[i] >> 24;
+        colors[i][1] = palette[i] >> 16;
+        colors[i][2] = palette[i] >> 8;
+        colors[i][3] = palette[i];
+    }
+
+    for (int nibble = 0; nibble < 16; ++nibble) {
+        for (int pixel = 0; pixel < 4; ++pixel) {
+            int set = (nibble >> (3 - pixel)) & 1;
+            memcpy(nibbles->rgba[nibble] + pixel * 4, colors[set], 4);
+            nibbles->bytes[nibble][pixel] = colors[set][3];
+        }
+    }
+}
+
+// pixels from the column on that are all set or all unset
+static inline int pnria_run_length(uint64_t line, int column, int set)
+{
+    uint64_t rest = (set ? ~line : line) << column;
+    return rest ? __builtin_clzll(rest) : PNRIA_SCREEN_WIDTH - column;
+}
+
+static void pnria_export_rgba(uint64_t line, unsigned char *out, const pnria_nibbles_t *nibbles, int scale)
+{
+    if (scale == 1) {
+        for (int shift = 60; shift >= 0; shift -= 4, out += 16) {
+            memcpy(out, nibbles->rgba[(line >> shift) & 0xF], 16);
+        }
+        return;
+    }
+
+    for (int column = 0; column < PNRIA_SCREEN_WIDTH;) {
+        int set = (line >> (63 - column)) & 1;
+        int run = pnria_run_length(line, column, set);
+
+        // the run starts with a pixel and is filled by doubling what's written
+        size_t size = (size_t)run * scale * 4;
+        memcpy(out, nibbles->rgba[set ? 0xF : 0], 4);
+        for (size_t done = 4; done < size; done *= 2) {
+            memcpy(out + done, out, done < size - done ? done : size - done);
+        }
+
+        out += size;
+        column += run;
+    }
+}
+
+static void pnria_export_bytes(uint64_t line, unsigned char *out, const pnria_nibbles_t *nibbles, int scale)
+{
+    if (scale == 1) {
+        for (int shift = 60; shift >= 0; shift -= 4, out += 4) {
+            memcpy(out, nibbles->bytes[(line >> shift) & 0xF], 4);
+        }
+        return;
+    }
+
+    for (int column = 0; column < PNRIA_SCREEN_WIDTH;) {
+        int set = (line >> (63 - column)) & 1;
+        int run = pnria_run_length(line, column, set);
+
+        memset(out, nibbles->bytes[set ? 0xF : 0][0], run * scale);
+        out += run * scale;
+        column += run;
+    }
+}
+
+static void pnria_export_bits(uint64_t line, unsigned char *out, int scale)
+{
+    if (scale == 1) {
+        for (int i = 0; i < 8; ++i) {
+            out[i] = line >> (56 - i * 8);
+        }
+        return;
+    }
+
+    memset(out, 0, (PNRIA_SCREEN_WIDTH * scale + 7) / 8);
+    for (int column = 0; column < PNRIA_SCREEN_WIDTH; ++column) {
+        if (!((line >> (63 - column)) & 1)) {
+            continue;
+        }
+        for (int bit = column * scale; bit < (column + 1) * scale; ++bit) {
+            out[bit / 8] |= 0x80 >> (bit % 8);
+        }
+    }
+}
+
+bool pnria_ctx_export_screen(pnria_ctx_t *ctx, const pnria_framebuffer_t *framebuffer, uint32_t rows)
+{
+    int scale = framebuffer->scale;
+    size_t lineSize = pnria_line_size(framebuffer->format, scale > 0 ? scale : 1);
+    size_t pitch = framebuffer->pitch ? framebuffer->pitch : lineSize;
+    if (!framebuffer->pixels || scale < 1 || lineSize == 0 || pitch < lineSize) {
+        pnria_error("Invalid framebuffer");
+        return false;
+    }
+
+    pnria_nibbles_t nibbles;
+    if (framebuffer->format != PNRIA_PIXELS_BIT) {
+        pnria_nibbles_init(&nibbles, framebuffer->palette);
+    }
+
+    for (int row = 0; row < PNRIA_SCREEN_HEIGHT; ++row) {
+        if (!(rows & (1u << row))) {
+            continue;
+        }
+
+        uint64_t line = ctx->chip8.screen[row];
+        unsigned char *out = (unsigned char *)framebuffer->pixels + row * scale * pitch;
+        switch (framebuffer->format) {
+        case PNRIA_PIXELS_RGBA: pnria_export_rgba(line, out, &nibbles, scale); break;
+        case PNRIA_PIXELS_BYTE: pnria_export_bytes(line, out, &nibbles, scale); break;
+        case PNRIA_PIXELS_BIT:  pnria_export_bits(line, out, scale); break;
+        }
+
+        for (int s = 1; s < scale; ++s) {
+            memcpy(out + s * pitch, out, lineSize);
+        }
+    }
+
+    return true;
+}
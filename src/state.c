@@ -0,0 +1,332 @@
+#include "panaroia_p.h"
+
+// Save state layout, version 4, numbers in little endian:
+//   "PNRS", version (1), hash of the rom image (4)
+//   opcode, PC, I, SP (2 each), delay, sound, waiting for key (1 each)
+//   pressed keys, bit n for key n (2)
+//   cycles per frame, cycles left in the current frame (4 each)
+//   state of the random generator (8), frames run since init (8)
+//   V0 to VF (1 each), the stack entries below SP (2 each)
+//   mask of the rows with pixels set (4), then those rows (8 each)
+//   number of memory runs (2), then for every run the bytes since the end of
+//   the previous one (2), its length (2) and the bytes
+
+#define PNRIA_STATE_MAGIC "PNRS"
+#define PNRIA_STATE_VERSION 4
+
+// changed bytes up to this far apart share a run, a new run costs as much as
+// the unchanged bytes in between. It also bounds the memory part of a state
+// to PNRIA_MEMORY_SIZE plus a few bytes
+#define PNRIA_STATE_RUN_GAP 4
+
+typedef struct {
+    unsigned char *data;
+    size_t size;
+    size_t used;
+    bool ok;
+} pnria_writer_t;
+
+typedef struct {
+    const unsigned char *data;
+    size_t size;
+    size_t used;
+    bool ok;
+} pnria_reader_t;
+
+static inline void pnria_put(pnria_writer_t *w, uint32_t value, int bytes)
+{
+    if (w->used + bytes > w->size) {
+        w->ok = false;
+        return;
+    }
+    for (int i = 0; i < bytes; ++i) {
+        w->data[w->used++] = value >> (i * 8);
+    }
+}
+
+static inline void pnria_put_bytes(pnria_writer_t *w, const void *bytes, size_t size)
+{
+    if (w->used + size > w->size) {
+        w->ok = false;
+        return;
+    }
+    memcpy(w->data + w->used, bytes, size);
+    w->used += size;
+}
+
+static inline uint32_t pnria_get(pnria_reader_t *r, int bytes)
+{
+    if (r->used + bytes > r->size) {
+        r->ok = false;
+        return 0;
+    }
+    uint32_t value = 0;
+    for (int i = 0; i < bytes; ++i) {
+        value |= (uint32_t)r->data[r->used++] << (i * 8);
+    }
+    return value;
+}
+
+static inline uint64_t pnria_get64(pnria_reader_t *r)
+{
+    uint64_t low = pnria_get(r, 4);
+    return (uint64_t)pnria_get(r, 4) << 32 | low;
+}
+
+static inline void pnria_get_bytes(pnria_reader_t *r, void *bytes, size_t size)
+{
+    if (r->used + size > r->size) {
+        r->ok = false;
+        return;
+    }
+    memcpy(bytes, r->data + r->used, size);
+    r->used += size;
+}
+
+// copies size bytes from src to memory[offset], widening [first, end) to
+// cover the bytes that changed
+static void pnria_restore_bytes(unsigned char *memory, unsigned int offset, const unsigned char *src,
+                                unsigned int size, unsigned int *first, unsigned int *end)
+{
+    unsigned char *dst = memory + offset;
+    unsigned int start = pnria_first_difference(dst, src, 0, size);
+    if (start == size) {
+        return;
+    }
+
+    unsigned int last = size;
+    for (; last > start && dst[last - 1] == src[last - 1]; --last);
+    memcpy(dst + start, src + start, last - start);
+
+    *first = offset + start < *first ? offset + start : *first;
+    *end = offset + last > *end ? offset + last : *end;
+}
+
+void pnria_snapshot(pnria_ctx_t *ctx, pnria_snapshot_t *snapshot)
+{
+    snapshot->chip8 = ctx->chip8;
+    snapshot->cyclesPerFrame = ctx->cyclesPerFrame;
+    snapshot->frameCycles = ctx->frameCycles;
+    snapshot->random = ctx->random;
+    snapshot->frame = ctx->frame;
+}
+
+void pnria_restore(pnria_ctx_t *ctx, const pnria_snapshot_t *snapshot)
+{
+    unsigned int first = PNRIA_MEMORY_SIZE;
+    unsigned int end = 0;
+    pnria_restore_bytes(ctx->chip8.memory, 0, snapshot->chip8.memory, PNRIA_MEMORY_SIZE, &first, &end);
+    pnria_invalidate(ctx, first, end);
+
+    // the memory is already in place
+    PNRIA_COPY_REGISTERS(&ctx->chip8, &snapshot->chip8);
+
+    ctx->cyclesPerFrame = snapshot->cyclesPerFrame;
+    ctx->frameCycles = snapshot->frameCycles;
+    ctx->random = snapshot->random;
+    ctx->frame = snapshot->frame;
+    pnria_mark_dirty(ctx, 0xFFFFFFFF, UINT64_MAX);
+
+    if (ctx->recording) {
+        pnria_recording_seek(ctx);
+    }
+}
+
+size_t pnria_save_state(pnria_ctx_t *ctx, void *buffer, size_t size)
+{
+    const pnria_state_t *chip8 = &ctx->chip8;
+    pnria_writer_t w = { buffer, size, 0, true };
+
+    pnria_put_bytes(&w, PNRIA_STATE_MAGIC, 4);
+    pnria_put(&w, PNRIA_STATE_VERSION, 1);
+    pnria_put(&w, ctx->imageHash, 4);
+
+    pnria_put(&w, chip8->opcode, 2);
+    pnria_put(&w, chip8->PC, 2);
+    pnria_put(&w, chip8->I, 2);
+    pnria_put(&w, chip8->SP, 2);
+    pnria_put(&w, chip8->delay, 1);
+    pnria_put(&w, chip8->sound, 1);
+    pnria_put(&w, chip8->waiting_for_key, 1);
+
+    uint16_t keys = 0;
+    for (int i = 0; i < PNRIA_INPUT_SIZE; ++i) {
+        keys |= (chip8->key[i] != 0) << i;
+    }
+    pnria_put(&w, keys, 2);
+
+    pnria_put(&w, ctx->cyclesPerFrame, 4);
+    pnria_put(&w, ctx->frameCycles, 4);
+    pnria_put(&w, ctx->random, 4);
+    pnria_put(&w, ctx->random >> 32, 4);
+    pnria_put(&w, ctx->frame, 4);
+    pnria_put(&w, (uint64_t)ctx->frame >> 32, 4);
+
+    pnria_put_bytes(&w, chip8->V, PNRIA_REGISTER_SIZE);
+    int depth = chip8->SP < PNRIA_STACK_SIZE ? chip8->SP : PNRIA_STACK_SIZE;
+    for (int i = 0; i < depth; ++i) {
+        pnria_put(&w, chip8->stack[i], 2);
+    }
+
+    uint32_t rows = 0;
+    for (int row = 0; row < PNRIA_SCREEN_HEIGHT; ++row) {
+        rows |= (uint32_t)(chip8->screen[row] != 0) << row;
+    }
+    pnria_put(&w, rows, 4);
+    for (uint32_t left = rows; left; left &= left - 1) {
+        uint64_t pixels = chip8->screen[__builtin_ctz(left)];
+        pnria_put(&w, pixels, 4);
+        pnria_put(&w, pixels >> 32, 4);
+    }
+
+    const unsigned char *memory = chip8->memory;
+    const unsigned char *image = ctx->image;
+    size_t runsAt = w.used;
+    unsigned int runs = 0;
+    pnria_put(&w, 0, 2);
+
+    unsigned int end = 0;
+    for (;;) {
+        unsigned int start = pnria_first_difference(memory, image, end, PNRIA_MEMORY_SIZE);
+        if (start == PNRIA_MEMORY_SIZE) {
+            break;
+        }
+
+        unsigned int last = start;
+        for (unsigned int i = start + 1; i < PNRIA_MEMORY_SIZE && i - last <= PNRIA_STATE_RUN_GAP; ++i) {
+            if (memory[i] != image[i]) {
+                last = i;
+            }
+        }
+
+        pnria_put(&w, start - end, 2);
+        pnria_put(&w, last + 1 - start, 2);
+        pnria_put_bytes(&w, memory + start, last + 1 - start);
+        end = last + 1;
+        ++runs;
+    }
+
+    if (!w.ok) {
+        pnria_error("Save state doesn't fit in %zu bytes", size);
+        return 0;
+    }
+
+    w.data[runsAt] = runs & 0xFF;
+    w.data[runsAt + 1] = runs >> 8;
+
+    return w.used;
+}
+
+bool pnria_load_state(pnria_ctx_t *ctx, const void *buffer, size_t size)
+{
+    pnria_reader_t r = { buffer, size, 0, true };
+
+    char magic[4] = { 0 };
+    pnria_get_bytes(&r, magic, sizeof(magic));
+    if (memcmp(magic, PNRIA_STATE_MAGIC, sizeof(magic)) != 0) {
+        pnria_error("Not a save state");
+        return false;
+    }
+
+    unsigned int version = pnria_get(&r, 1);
+    if (version != PNRIA_STATE_VERSION) {
+        pnria_error("Unsupported save state version: %u", version);
+        return false;
+    }
+
+    if (pnria_get(&r, 4) != ctx->imageHash) {
+        pnria_error("Save state of another rom");
+        return false;
+    }
+
+    unsigned short opcode = pnria_get(&r, 2);
+    unsigned short PC = pnria_get(&r, 2);
+    unsigned short I = pnria_get(&r, 2);
+    unsigned short SP = pnria_get(&r, 2);
+    unsigned char delay = pnria_get(&r, 1);
+    unsigned char sound = pnria_get(&r, 1);
+    int waitingForKey = pnria_get(&r, 1);
+    uint16_t keys = pnria_get(&r, 2);
+    int cyclesPerFrame = pnria_get(&r, 4);
+    int frameCycles = pnria_get(&r, 4);
+    uint64_t random = pnria_get64(&r);
+    long frame = pnria_get64(&r);
+
+    unsigned char V[PNRIA_REGISTER_SIZE] = { 0 };
+    pnria_get_bytes(&r, V, PNRIA_REGISTER_SIZE);
+
+    unsigned short stack[PNRIA_STACK_SIZE] = { 0 };
+    int depth = SP < PNRIA_STACK_SIZE ? SP : PNRIA_STACK_SIZE;
+    for (int i = 0; i < depth; ++i) {
+        stack[i] = pnria_get(&r, 2);
+    }
+
+    uint64_t screen[PNRIA_SCREEN_HEIGHT];
+    uint32_t rows = pnria_get(&r, 4);
+    for (int row = 0; row < PNRIA_SCREEN_HEIGHT; ++row) {
+        screen[row] = (rows >> row) & 1 ? pnria_get64(&r) : 0;
+    }
+
+    // the runs are checked before the memory is touched, and copied over it
+    // afterwards
+    unsigned int runs = pnria_get(&r, 2);
+    size_t runsAt = r.used;
+    for (unsigned int run = 0, end = 0; run < runs && r.ok; ++run) {
+        unsigned int start = end + pnria_get(&r, 2);
+        unsigned int length = pnria_get(&r, 2);
+        end = start + length;
+        r.used += length;
+        r.ok = r.ok && end <= PNRIA_MEMORY_SIZE && r.used <= size;
+    }
+
+    if (!r.ok || r.used != size || cyclesPerFrame < 1 || frameCycles < 1 || frameCycles > cyclesPerFrame ||
+        random == 0) {
+        pnria_error("Invalid save state");
+        return false;
+    }
+
+    // only the instructions decoded from memory that changes are dropped, so
+    // loading the state of a nearby frame keeps most of them
+    unsigned char *memory = ctx->chip8.memory;
+    unsigned int first = PNRIA_MEMORY_SIZE;
+    unsigned int last = 0;
+    r.used = runsAt;
+    unsigned int end = 0;
+    for (unsigned int run = 0; run < runs; ++run) {
+        unsigned int start = end + pnria_get(&r, 2);
+        unsigned int length = pnria_get(&r, 2);
+        pnria_restore_bytes(memory, end, ctx->image + end, start - end, &first, &last);
+        pnria_restore_bytes(memory, start, r.data + r.used, length, &first, &last);
+        r.used += length;
+        end = start + length;
+    }
+    pnria_restore_bytes(memory, end, ctx->image + end, PNRIA_MEMORY_SIZE - end, &first, &last);
+    pnria_invalidate(ctx, first, last);
+
+    pnria_state_t *chip8 = &ctx->chip8;
+    chip8->opcode = opcode;
+    chip8->PC = PC;
+    chip8->I = I;
+    chip8->SP = SP;
+    chip8->delay = delay;
+    chip8->sound = sound;
+    chip8->waiting_for_key = waitingForKey;
+    for (int i = 0; i < PNRIA_INPUT_SIZE; ++i) {
+        chip8->key[i] = (keys >> i) & 1;
+    }
+    memcpy(chip8->V, V, sizeof(V));
+    memcpy(chip8->stack, stack, sizeof(stack));
+    memcpy(chip8->screen, screen, sizeof(screen));
+
+    ctx->cyclesPerFrame = cyclesPerFrame;
+    ctx->frameCycles = frameCycles;
+    ctx->random = random;
+    ctx->frame = frame;
+    pnria_mark_dirty(ctx, 0xFFFFFFFF, UINT64_MAX);
+
+    if (ctx->recording) {
+        pnria_recording_seek(ctx);
+    }
+
+    return true;
+}
@@ -1,4 +1,6 @@
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 
 #include "panaroia/panaroia.h"
 
@@ -46,6 +48,30 @@ void write_test_rom(char* rom, unsigned short size)
         pnria_get_state();                   \
 })
 
+// path of one of the bundled roms, valid until the next call
+static const char *rom_path(const char *name)
+{
+    static char path[1024];
+    snprintf(path, sizeof(path), "%s/%s", PNRIA_ROMS_DIR, name);
+    return path;
+}
+
+// rewrites its first instruction and runs it again: after 9 cycles V[0] is
+// 0x77 from the new instruction and V[A] is 1 from the old one
+static void load_self_modifying_rom()
+{
+    LOAD_ROM(
+        0x7A01, // add 1 to V[A], replaced with 0x6077
+        0x3A02, // stop once V[A] is 2
+        0x1208,
+        0x1206,
+        0x6060, 0x6177,
+        0xA200,
+        0xF155, // store 0x6077 (load 0x77 into V[0]) at 0x200
+        0x1200
+    );
+}
+
 static void check_init()
 {
     pnria_state_t state = pnria_get_state();
@@ -81,6 +107,24 @@ static void check_init()
     }
 }
 
+// the default instance runs a rom loaded before any init
+START_TEST (default_load_test)
+{
+    const char *path = rom_path("BRIX");
+
+    ck_assert(pnria_load(path));
+    pnria_state_t state = pnria_get_state();
+    ck_assert_uint_eq(state.memory[PNRIA_START_OFFSET], 0x6E);
+
+    pnria_init();
+    ck_assert(pnria_load(path));
+    for (int i = 0; i < 100; ++i) {
+        pnria_cycle();
+    }
+    ck_assert_uint_ne(pnria_get_state().PC, PNRIA_START_OFFSET);
+}
+END_TEST
+
 START_TEST (init_state_test)
 {
     pnria_init();
@@ -98,6 +142,8 @@ void reset_state_test()
 }
 END_TEST
 
+static void assert_same_state(const pnria_state_t *a, const pnria_state_t *b);
+
 START_TEST (load_test)
 {
     LOAD_ROM(0x0123, 0x4567);
@@ -126,6 +172,1123 @@ START_TEST (load_test)
     memset(exceedingRom, 1, exceedingSize);
     write_test_rom(exceedingRom, exceedingSize);
     ck_assert(!pnria_load(TEST_ROM_NAME));
+
+    // loading the bytes is the same as loading the file
+    unsigned char rom[] = { 0x60, 0x05, 0x70, 0x01, 0xC1, 0xFF, 0x12, 0x02 };
+    write_test_rom((char *)rom, sizeof(rom));
+    pnria_ctx_t *fromFile = pnria_create();
+    pnria_ctx_t *fromBuffer = pnria_create();
+    ck_assert(pnria_ctx_load(fromFile, TEST_ROM_NAME));
+    ck_assert(pnria_ctx_load_buffer(fromBuffer, rom, sizeof(rom)));
+    pnria_run_cycles(fromFile, 20);
+    pnria_run_cycles(fromBuffer, 20);
+    pnria_state_t a = pnria_ctx_get_state(fromFile);
+    pnria_state_t b = pnria_ctx_get_state(fromBuffer);
+    assert_same_state(&a, &b);
+
+    unsigned char buffer[PNRIA_SAVE_STATE_MAX_SIZE];
+    size_t stateSize = pnria_save_state(fromFile, buffer, sizeof(buffer));
+    ck_assert(pnria_load_state(fromBuffer, buffer, stateSize));
+
+    // too big, the memory is left as it was
+    ck_assert(!pnria_ctx_load_buffer(fromBuffer, exceedingRom, exceedingSize));
+    ck_assert_uint_eq(pnria_ctx_get_state(fromBuffer).memory[PNRIA_START_OFFSET], 0x60);
+    ck_assert(pnria_load_buffer(rom, sizeof(rom)));
+    ck_assert_uint_eq(pnria_get_state().memory[PNRIA_START_OFFSET + 4], 0xC1);
+
+    pnria_destroy(fromBuffer);
+    pnria_destroy(fromFile);
+}
+END_TEST
+
+START_TEST (context_test)
+{
+    LOAD_ROM(0x6001, 0x1200);
+
+    pnria_ctx_t *first = pnria_create();
+    pnria_ctx_t *second = pnria_create();
+    ck_assert_ptr_ne(first, NULL);
+    ck_assert_ptr_ne(second, NULL);
+
+    ck_assert(pnria_ctx_load(first, TEST_ROM_NAME));
+    pnria_ctx_cycle(first);
+
+    pnria_state_t state = pnria_ctx_get_state(first);
+    ck_assert_uint_eq(state.V[0], 1);
+    ck_assert_uint_eq(state.PC, PNRIA_START_OFFSET + PNRIA_OPCODE_SIZE);
+
+    // other instances are untouched
+    state = pnria_ctx_get_state(second);
+    ck_assert_uint_eq(state.V[0], 0);
+    ck_assert_uint_eq(state.PC, PNRIA_START_OFFSET);
+
+    state = pnria_get_state();
+    ck_assert_uint_eq(state.V[0], 0);
+    ck_assert_uint_eq(state.PC, PNRIA_START_OFFSET);
+
+    pnria_destroy(first);
+    pnria_destroy(second);
+}
+END_TEST
+
+static void assert_same_state(const pnria_state_t *a, const pnria_state_t *b)
+{
+    ck_assert_uint_eq(a->opcode, b->opcode);
+    ck_assert_uint_eq(a->PC, b->PC);
+    ck_assert_uint_eq(a->I, b->I);
+    ck_assert_uint_eq(a->SP, b->SP);
+    ck_assert_uint_eq(a->delay, b->delay);
+    ck_assert_uint_eq(a->sound, b->sound);
+    ck_assert(memcmp(a->V, b->V, PNRIA_REGISTER_SIZE) == 0);
+    ck_assert(memcmp(a->stack, b->stack, sizeof(a->stack)) == 0);
+    ck_assert(memcmp(a->memory, b->memory, PNRIA_MEMORY_SIZE) == 0);
+    ck_assert(memcmp(a->screen, b->screen, sizeof(a->screen)) == 0);
+}
+
+// runs every bundled rom on the table backend and on the given one, comparing
+// the state after runs of a few cycles
+static void differential_test(pnria_backend_t backend)
+{
+    const char *roms[] = {
+        "15PUZZLE", "BLINKY", "BLITZ", "BRIX", "CONNECT4", "GUESS",
+        "HIDDEN", "INVADERS", "KALEID", "MAZE", "MERLIN", "MISSILE",
+        "PONG", "PONG2", "PUZZLE", "SYZYGY", "TANK", "TETRIS",
+        "TICTAC", "UFO", "VBRIX", "VERS", "WIPEOFF"
+    };
+
+    pnria_ctx_t *reference = pnria_create();
+    pnria_ctx_t *tested = pnria_create();
+    pnria_ctx_set_backend(reference, PNRIA_BACKEND_TABLE);
+    pnria_ctx_set_backend(tested, backend);
+
+    for (size_t r = 0; r < sizeof(roms) / sizeof(roms[0]); ++r) {
+        const char *path = rom_path(roms[r]);
+
+        // both backends draw the same random numbers
+        pnria_ctx_set_seed(reference, r);
+        pnria_ctx_set_seed(tested, r);
+        pnria_ctx_reset(reference);
+        pnria_ctx_reset(tested);
+        ck_assert(pnria_ctx_load(reference, path));
+        ck_assert(pnria_ctx_load(tested, path));
+
+        char keys[16] = { 0 };
+        long cycles = 0;
+        for (int chunk = 0; cycles < 20000; ++chunk) {
+            // press each key for a while so key waits and checks are exercised
+            if (chunk % 60 == 0) {
+                memset(keys, 0, sizeof(keys));
+                keys[(chunk / 60) % 16] = 1;
+                pnria_ctx_set_input(reference, keys);
+                pnria_ctx_set_input(tested, keys);
+            }
+
+            // runs of different lengths stop the backends at every point
+            long count = 1 + chunk % 17;
+
+            pnria_run_cycles(reference, count);
+            pnria_run_cycles(tested, count);
+            cycles += count;
+
+            assert_same_state(pnria_ctx_view_state(reference), pnria_ctx_view_state(tested));
+        }
+    }
+
+    pnria_destroy(reference);
+    pnria_destroy(tested);
+}
+
+START_TEST (threaded_backend_test)
+{
+    differential_test(PNRIA_BACKEND_THREADED);
+}
+END_TEST
+
+// runs the test rom on the table backend and on the given one, comparing the
+// state after each cycle
+static pnria_state_t run_on_backend(pnria_backend_t backend, int cycles)
+{
+    pnria_ctx_t *reference = pnria_create();
+    pnria_ctx_t *tested = pnria_create();
+    pnria_ctx_set_backend(reference, PNRIA_BACKEND_TABLE);
+    pnria_ctx_set_backend(tested, backend);
+    ck_assert(pnria_ctx_load(reference, TEST_ROM_NAME));
+    ck_assert(pnria_ctx_load(tested, TEST_ROM_NAME));
+
+    for (int i = 0; i < cycles; ++i) {
+        pnria_ctx_cycle(reference);
+        pnria_ctx_cycle(tested);
+
+        assert_same_state(pnria_ctx_view_state(reference), pnria_ctx_view_state(tested));
+    }
+
+    pnria_state_t state = pnria_ctx_get_state(tested);
+    pnria_destroy(reference);
+    pnria_destroy(tested);
+
+    return state;
+}
+
+// compares every machine of a batch against a context running the same rom
+// with the same input and seed, each machine pair sharing a key so the batch
+// runs both converged and diverged
+static void compare_batch(const char *rom, int cycles)
+{
+    enum { MACHINES = 8 };
+    pnria_batch_t *batch = pnria_batch_create(MACHINES);
+    pnria_ctx_t *ctxs[MACHINES];
+    ck_assert_ptr_ne(batch, NULL);
+    ck_assert_int_eq(pnria_batch_size(batch), MACHINES);
+    for (int m = 0; m < MACHINES; ++m) {
+        pnria_batch_set_seed(batch, m, m / 2);
+    }
+    ck_assert(pnria_batch_load(batch, rom));
+
+    for (int m = 0; m < MACHINES; ++m) {
+        ctxs[m] = pnria_create();
+        pnria_ctx_set_backend(ctxs[m], PNRIA_BACKEND_TABLE);
+        pnria_ctx_set_seed(ctxs[m], m / 2);
+        ck_assert(pnria_ctx_load(ctxs[m], rom));
+    }
+
+    long ran = 0;
+    for (int chunk = 0; ran < cycles; ++chunk) {
+        if (chunk % 40 == 0) {
+            for (int m = 0; m < MACHINES; ++m) {
+                char keys[16] = { 0 };
+                // machines without keys keep waiting on FX0A
+                if (m % 4 != 3) {
+                    keys[(chunk / 40 + m / 2) % 16] = 1;
+                }
+                pnria_batch_set_input(batch, m, keys);
+                pnria_ctx_set_input(ctxs[m], keys);
+            }
+        }
+
+        long count = 1 + chunk % 13;
+        pnria_batch_run_cycles(batch, count);
+        for (int m = 0; m < MACHINES; ++m) {
+            pnria_run_cycles(ctxs[m], count);
+        }
+        ran += count;
+
+        for (int m = 0; m < MACHINES; ++m) {
+            pnria_state_t b = pnria_batch_get_state(batch, m);
+            assert_same_state(pnria_ctx_view_state(ctxs[m]), &b);
+        }
+    }
+
+    for (int m = 0; m < MACHINES; ++m) {
+        pnria_destroy(ctxs[m]);
+    }
+    pnria_batch_destroy(batch);
+}
+
+START_TEST (batch_test)
+{
+    const char *roms[] = { "15PUZZLE", "BRIX", "CONNECT4", "INVADERS", "KALEID", "MISSILE", "TANK" };
+    for (size_t r = 0; r < sizeof(roms) / sizeof(roms[0]); ++r) {
+        const char *path = rom_path(roms[r]);
+        compare_batch(path, 10000);
+    }
+
+    // key dependent branches, calls, self modifying code and sprites
+    LOAD_ROM(
+        0xF00A,         // V0 = first pressed key, waits without keys
+        0xE09E, 0x1210, // skip the jump if V0 is pressed
+        0x2216,         // call
+        0x8104, 0x8115, 0x8016, 0x801E,
+        0xA200, 0xF155, // rewrite the first instruction
+        0x1200,
+        0x6A07, 0x7A01, 0xFA29, 0xDAB5,
+        0x00EE
+    );
+    compare_batch(TEST_ROM_NAME, 500);
+
+    // stores past the end of the memory wrap around in the machine's own
+    LOAD_ROM(
+        0x6A2A,
+        0xAFFF,
+        0xFF55, // V0 to VF from 0xFFF on, VA lands at 0x009
+        0x1206
+    );
+    for (int machines = 1; machines <= 2; ++machines) {
+        pnria_batch_t *batch = pnria_batch_create(machines);
+        ck_assert(pnria_batch_load(batch, TEST_ROM_NAME));
+        pnria_state_t idle = pnria_batch_get_state(batch, machines - 1);
+        if (machines == 2) {
+            idle.PC = 0x206;
+            pnria_batch_set_state(batch, 1, &idle);
+        }
+        pnria_batch_run_cycles(batch, 10);
+
+        pnria_state_t state = pnria_batch_get_state(batch, 0);
+        ck_assert_uint_eq(state.memory[0xFFF], 0);
+        ck_assert_uint_eq(state.memory[0x009], 0x2A);
+        if (machines == 2) {
+            state = pnria_batch_get_state(batch, 1);
+            ck_assert(memcmp(state.memory, idle.memory, PNRIA_MEMORY_SIZE) == 0);
+        }
+        pnria_batch_destroy(batch);
+    }
+}
+END_TEST
+
+typedef struct {
+    pnria_pool_t *pool;
+    pnria_job_t followUp;
+    bool loaded;
+    pnria_state_t state;
+} pool_result_t;
+
+static void pool_job_done(const pnria_job_t *job, pnria_ctx_t *ctx)
+{
+    pool_result_t *result = job->userData;
+    result->loaded = ctx != NULL;
+    if (ctx) {
+        result->state = pnria_ctx_get_state(ctx);
+    }
+    // a follow up that isn't submitted is never loaded
+    if (result->followUp.done) {
+        pnria_pool_submit(result->pool, &result->followUp);
+    }
+}
+
+START_TEST (pool_test)
+{
+    const char *roms[] = { "15PUZZLE", "BRIX", "CONNECT4", "INVADERS", "KALEID", "MISSILE", "TANK" };
+    enum { ROMS = sizeof(roms) / sizeof(roms[0]), VARIANTS = 4, JOBS = ROMS * VARIANTS };
+
+    char paths[ROMS][1024];
+    unsigned char romBytes[ROMS][PNRIA_MEMORY_SIZE];
+    size_t romSizes[ROMS];
+    pnria_input_event_t inputs[VARIANTS][8];
+    for (int r = 0; r < ROMS; ++r) {
+        strcpy(paths[r], rom_path(roms[r]));
+        FILE *f = fopen(paths[r], "rb");
+        ck_assert_ptr_ne(f, NULL);
+        romSizes[r] = fread(romBytes[r], 1, sizeof(romBytes[r]), f);
+        fclose(f);
+    }
+    for (int v = 0; v < VARIANTS; ++v) {
+        for (int e = 0; e < 8; ++e) {
+            inputs[v][e] = (pnria_input_event_t) { .frame = e * 20 + v };
+            inputs[v][e].keys[(v * 5 + e) % 16] = e % 2 == 0;
+        }
+    }
+
+    pnria_pool_t *pool = pnria_pool_create(3);
+    ck_assert_ptr_ne(pool, NULL);
+    ck_assert_int_eq(pnria_pool_size(pool), 3);
+
+    // the first job of every rom submits the others from its callback
+    pool_result_t results[JOBS] = { 0 };
+    pnria_job_t jobs[JOBS];
+    for (int j = 0; j < JOBS; ++j) {
+        // some jobs get the rom's bytes instead of its file
+        jobs[j] = (pnria_job_t) {
+            .romFile = j % VARIANTS == 1 ? NULL : paths[j / VARIANTS],
+            .rom = romBytes[j / VARIANTS],
+            .romSize = romSizes[j / VARIANTS],
+            .inputs = inputs[j % VARIANTS],
+            .inputCount = 8,
+            .frames = 200 + j,
+            .cyclesPerFrame = 5 + j % 3 * 5,
+            .seed = j,
+            .done = pool_job_done,
+            .userData = &results[j]
+        };
+        results[j].pool = pool;
+    }
+    for (int j = 0; j < JOBS; ++j) {
+        if (j % VARIANTS != VARIANTS - 1) {
+            results[j].followUp = jobs[j + 1];
+        }
+    }
+    for (int r = 0; r < ROMS; ++r) {
+        ck_assert(pnria_pool_submit(pool, &jobs[r * VARIANTS]));
+    }
+
+    pool_result_t missing = { 0 };
+    pnria_job_t missingJob = { .romFile = "missing rom", .frames = 1, .done = pool_job_done, .userData = &missing };
+    missing.loaded = true;
+    ck_assert(pnria_pool_submit(pool, &missingJob));
+
+    pnria_pool_wait(pool);
+    ck_assert(!missing.loaded);
+
+    pnria_ctx_t *ctx = pnria_create();
+    pnria_ctx_set_backend(ctx, PNRIA_BACKEND_TABLE);
+    for (int j = 0; j < JOBS; ++j) {
+        pnria_ctx_set_cycles_per_frame(ctx, jobs[j].cyclesPerFrame);
+        pnria_ctx_set_seed(ctx, jobs[j].seed);
+        pnria_ctx_init(ctx);
+        ck_assert(pnria_ctx_load(ctx, paths[j / VARIANTS]));
+        for (long frame = 0, next = 0; frame < jobs[j].frames; ++frame) {
+            while (next < 8 && jobs[j].inputs[next].frame <= frame) {
+                pnria_ctx_set_input(ctx, jobs[j].inputs[next++].keys);
+            }
+            pnria_run_frame(ctx);
+        }
+
+        ck_assert(results[j].loaded);
+        pnria_state_t state = pnria_ctx_get_state(ctx);
+        assert_same_state(&state, &results[j].state);
+    }
+    pnria_destroy(ctx);
+
+    // queued jobs still run when the pool is destroyed
+    pool_result_t last = { 0 };
+    pnria_job_t lastJob = jobs[0];
+    lastJob.userData = &last;
+    ck_assert(pnria_pool_submit(pool, &lastJob));
+    pnria_pool_destroy(pool);
+    ck_assert(last.loaded);
+    assert_same_state(&results[0].state, &last.state);
+}
+END_TEST
+
+START_TEST (seed_test)
+{
+    LOAD_ROM(
+        0xC0FF, 0xC1FF, 0xC2FF, 0xC30F,
+        0x1200
+    );
+
+    pnria_ctx_t *ctxs[3];
+    for (int c = 0; c < 3; ++c) {
+        ctxs[c] = pnria_create();
+        pnria_ctx_set_seed(ctxs[c], c == 2 ? 43 : 42);
+        ck_assert(pnria_ctx_load(ctxs[c], TEST_ROM_NAME));
+        pnria_run_cycles(ctxs[c], 4);
+    }
+    ck_assert_uint_eq(pnria_ctx_get_seed(ctxs[0]), 42);
+
+    // same seed, same numbers
+    pnria_state_t a = pnria_ctx_get_state(ctxs[0]);
+    pnria_state_t b = pnria_ctx_get_state(ctxs[1]);
+    pnria_state_t c = pnria_ctx_get_state(ctxs[2]);
+    ck_assert(memcmp(a.V, b.V, 4) == 0);
+    ck_assert(memcmp(a.V, c.V, 4) != 0);
+    ck_assert_uint_le(a.V[3], 0x0F);
+
+    // reset starts over from the seed
+    pnria_ctx_reset(ctxs[1]);
+    ck_assert(pnria_ctx_load(ctxs[1], TEST_ROM_NAME));
+    pnria_run_cycles(ctxs[1], 4);
+    b = pnria_ctx_get_state(ctxs[1]);
+    ck_assert(memcmp(a.V, b.V, 4) == 0);
+
+    // the generator is part of save states
+    unsigned char buffer[PNRIA_SAVE_STATE_MAX_SIZE];
+    size_t size = pnria_save_state(ctxs[0], buffer, sizeof(buffer));
+    ck_assert(pnria_load_state(ctxs[2], buffer, size));
+    pnria_run_cycles(ctxs[0], 5);
+    pnria_run_cycles(ctxs[2], 5);
+    a = pnria_ctx_get_state(ctxs[0]);
+    c = pnria_ctx_get_state(ctxs[2]);
+    ck_assert(memcmp(a.V, c.V, 4) == 0);
+
+    for (int i = 0; i < 3; ++i) {
+        pnria_destroy(ctxs[i]);
+    }
+}
+END_TEST
+
+// save states only keep the stack below SP
+static void assert_restored_state(pnria_state_t *saved, pnria_state_t *restored)
+{
+    for (int i = saved->SP; i < PNRIA_STACK_SIZE; ++i) {
+        saved->stack[i] = 0;
+        restored->stack[i] = 0;
+    }
+    assert_same_state(saved, restored);
+}
+
+START_TEST (save_state_test)
+{
+    const char *path = rom_path("INVADERS");
+    unsigned char buffer[PNRIA_SAVE_STATE_MAX_SIZE];
+
+    pnria_ctx_t *ctx = pnria_create();
+    pnria_ctx_t *other = pnria_create();
+    ck_assert(pnria_ctx_load(ctx, path));
+    ck_assert(pnria_ctx_load(other, path));
+    pnria_ctx_set_cycles_per_frame(ctx, 7);
+
+    // nothing changed yet, only the header and registers
+    size_t size = pnria_save_state(ctx, buffer, sizeof(buffer));
+    ck_assert_uint_gt(size, 0);
+    ck_assert_uint_lt(size, 80);
+
+    char keys[16] = { [5] = 1 };
+    pnria_ctx_set_input(ctx, keys);
+    for (int frame = 0; frame < 500; ++frame) {
+        pnria_run_frame(ctx);
+    }
+    pnria_run_cycles(ctx, 3);
+
+    size = pnria_save_state(ctx, buffer, sizeof(buffer));
+    ck_assert_uint_gt(size, 0);
+    ck_assert_uint_eq(pnria_save_state(ctx, buffer, size - 1), 0);
+
+    // restored in another context, both run on the same way
+    pnria_state_t saved = pnria_ctx_get_state(ctx);
+    ck_assert(pnria_load_state(other, buffer, size));
+    pnria_state_t restored = pnria_ctx_get_state(other);
+    assert_restored_state(&saved, &restored);
+    ck_assert_int_eq(pnria_ctx_get_cycles_per_frame(other), 7);
+    ck_assert_uint_eq(pnria_ctx_get_dirty_rows(other), 0xFFFFFFFF);
+    ck_assert(memcmp(pnria_ctx_get_screen(ctx), pnria_ctx_get_screen(other), PNRIA_SCREEN_SIZE) == 0);
+
+    for (int frame = 0; frame < 200; ++frame) {
+        pnria_run_frame(ctx);
+        pnria_run_frame(other);
+    }
+    saved = pnria_ctx_get_state(ctx);
+    restored = pnria_ctx_get_state(other);
+    assert_restored_state(&saved, &restored);
+
+    // invalid states leave the context as it was
+    unsigned char invalid[PNRIA_SAVE_STATE_MAX_SIZE];
+    memcpy(invalid, buffer, size);
+    invalid[4] = 1; // the version before the random generator was saved
+    ck_assert(!pnria_load_state(other, invalid, size));
+    ck_assert(!pnria_load_state(other, buffer, size - 1));
+    ck_assert(!pnria_load_state(other, buffer, 3));
+    restored = pnria_ctx_get_state(other);
+    assert_restored_state(&saved, &restored);
+
+    // frame counts past 32 bits survive, the frame is at byte 38
+    unsigned char later[PNRIA_SAVE_STATE_MAX_SIZE];
+    ck_assert(pnria_load_state(other, buffer, size));
+    long frame = pnria_ctx_get_frame(other);
+    memcpy(invalid, buffer, size);
+    invalid[42] = 1;
+    ck_assert(pnria_load_state(other, invalid, size));
+    ck_assert_int_eq(pnria_ctx_get_frame(other), frame + (1L << 32));
+    ck_assert_uint_eq(pnria_save_state(other, later, sizeof(later)), size);
+    ck_assert(memcmp(later, invalid, size) == 0);
+
+    pnria_ctx_t *another = pnria_create();
+    path = rom_path("MISSILE");
+    ck_assert(pnria_ctx_load(another, path));
+    ck_assert(!pnria_load_state(another, buffer, size));
+
+    // going back to a state from before self modifying code ran drops the
+    // instructions decoded from the rewritten memory
+    load_self_modifying_rom();
+    for (int b = 0; b < 3; ++b) {
+        pnria_backend_t backend = (pnria_backend_t[]) {
+            PNRIA_BACKEND_TABLE, PNRIA_BACKEND_THREADED, PNRIA_BACKEND_JIT
+        }[b];
+        pnria_ctx_init(another);
+        pnria_ctx_set_backend(another, backend);
+        ck_assert(pnria_ctx_load(another, TEST_ROM_NAME));
+
+        size = pnria_save_state(another, buffer, sizeof(buffer));
+        pnria_run_cycles(another, 9);
+        ck_assert_uint_eq(pnria_ctx_get_state(another).V[0], 0x77);
+
+        ck_assert(pnria_load_state(another, buffer, size));
+        ck_assert_uint_eq(pnria_ctx_get_state(another).memory[PNRIA_START_OFFSET], 0x7A);
+        pnria_run_cycles(another, 1);
+        ck_assert_uint_eq(pnria_ctx_get_state(another).V[0xA], 1);
+    }
+
+    pnria_destroy(another);
+    pnria_destroy(other);
+    pnria_destroy(ctx);
+}
+END_TEST
+
+// runs the frames with a key changing every few frames, returns the state
+static pnria_state_t run_keys(pnria_ctx_t *ctx, int frames, int offset)
+{
+    for (int frame = 0; frame < frames; ++frame) {
+        char keys[16] = { 0 };
+        keys[(frame / 25 + offset) % 16] = frame % 50 < 40;
+        pnria_ctx_set_input(ctx, keys);
+        pnria_run_frame(ctx);
+    }
+    return pnria_ctx_get_state(ctx);
+}
+
+START_TEST (recording_test)
+{
+    const char *file = "test-recording.pnri";
+    const char *path = rom_path("BRIX");
+
+    pnria_ctx_t *ctx = pnria_create();
+    pnria_ctx_set_seed(ctx, 9);
+    ck_assert(pnria_ctx_load(ctx, path));
+    pnria_run_frame(ctx);
+
+    // recording restarts the rom
+    pnria_recording_t *recording = pnria_recording_create();
+    ck_assert_ptr_ne(recording, NULL);
+    pnria_ctx_record(ctx, recording);
+    ck_assert_int_eq(pnria_ctx_get_frame(ctx), 0);
+    pnria_state_t recorded = run_keys(ctx, 300, 0);
+    pnria_ctx_stop(ctx);
+    ck_assert_int_eq(pnria_ctx_get_frame(ctx), 300);
+    ck_assert_int_eq(pnria_recording_frames(recording), 300);
+
+    long count;
+    const pnria_input_event_t *events = pnria_recording_events(recording, &count);
+    ck_assert_int_eq(count, 18);
+    ck_assert_int_eq(events[1].frame, 25);
+
+    ck_assert(pnria_recording_save(recording, file));
+    pnria_recording_t *loaded = pnria_recording_load(file);
+    ck_assert_ptr_ne(loaded, NULL);
+    ck_assert_int_eq(pnria_recording_frames(loaded), 300);
+    ck_assert_uint_eq(pnria_recording_seed(loaded), 9);
+    ck_assert_int_eq(pnria_recording_cycles_per_frame(loaded), PNRIA_CYCLES_PER_FRAME);
+    long loadedCount;
+    const pnria_input_event_t *loadedEvents = pnria_recording_events(loaded, &loadedCount);
+    ck_assert_int_eq(loadedCount, count);
+    ck_assert(memcmp(events, loadedEvents, count * sizeof(pnria_input_event_t)) == 0);
+
+    // the replay ignores other input, seed and cycles per frame
+    pnria_ctx_t *other = pnria_create();
+    pnria_ctx_set_cycles_per_frame(other, 3);
+    ck_assert(pnria_ctx_load(other, path));
+    ck_assert(pnria_ctx_replay(other, loaded));
+    ck_assert_uint_eq(pnria_ctx_get_seed(other), 9);
+    pnria_state_t replayed = run_keys(other, 300, 7);
+    assert_same_state(&recorded, &replayed);
+
+    // going back while recording drops what was recorded after it
+    pnria_ctx_record(ctx, recording);
+    run_keys(ctx, 120, 0);
+    pnria_fork_t *fork = pnria_fork_create(ctx);
+    run_keys(ctx, 60, 3);
+    pnria_fork_restore(fork, ctx);
+    recorded = run_keys(ctx, 100, 5);
+    ck_assert_int_eq(pnria_recording_frames(recording), 220);
+
+    ck_assert(pnria_ctx_replay(other, recording));
+    for (int frame = 0; frame < 220; ++frame) {
+        pnria_run_frame(other);
+    }
+    replayed = pnria_ctx_get_state(other);
+    assert_same_state(&recorded, &replayed);
+
+    // and so does going back while replaying
+    pnria_fork_restore(fork, other);
+    for (int frame = 0; frame < 100; ++frame) {
+        pnria_run_frame(other);
+    }
+    replayed = pnria_ctx_get_state(other);
+    assert_same_state(&recorded, &replayed);
+
+    // keys held when recording starts stay pressed and are recorded
+    char held[16] = { [4] = 1 };
+    pnria_ctx_set_input(ctx, held);
+    pnria_ctx_record(ctx, recording);
+    ck_assert_uint_eq(pnria_ctx_get_state(ctx).key[4], 1);
+    events = pnria_recording_events(recording, &count);
+    ck_assert_int_eq(count, 1);
+    ck_assert_int_eq(events[0].frame, 0);
+    ck_assert(memcmp(events[0].keys, held, sizeof(held)) == 0);
+
+    path = rom_path("TANK");
+    pnria_ctx_init(other);
+    ck_assert(pnria_ctx_load(other, path));
+    ck_assert(!pnria_ctx_replay(other, recording));
+
+    // frame counts past 32 bits survive, the frames recorded are at byte 21
+    unsigned char bytes[4096];
+    FILE *f = fopen(file, "rb");
+    size_t size = fread(bytes, 1, sizeof(bytes), f);
+    fclose(f);
+    ck_assert_uint_gt(size, 40);
+    ck_assert_uint_lt(size, sizeof(bytes));
+    bytes[25] = 1;
+    f = fopen(file, "wb");
+    fwrite(bytes, 1, size, f);
+    fclose(f);
+    pnria_recording_t *longer = pnria_recording_load(file);
+    ck_assert_ptr_ne(longer, NULL);
+    ck_assert_int_eq(pnria_recording_frames(longer), 300 + (1L << 32));
+    pnria_recording_destroy(longer);
+
+    // truncated files aren't recordings
+    f = fopen(file, "wb");
+    fwrite(bytes, 1, 40, f);
+    fclose(f);
+    ck_assert_ptr_eq(pnria_recording_load(file), NULL);
+    ck_assert_ptr_eq(pnria_recording_load("missing recording"), NULL);
+    remove(file);
+
+    pnria_fork_destroy(fork);
+    pnria_recording_destroy(loaded);
+    pnria_recording_destroy(recording);
+    pnria_destroy(other);
+    pnria_destroy(ctx);
+}
+END_TEST
+
+START_TEST (library_test)
+{
+    const char *path = rom_path("BRIX");
+
+    pnria_library_t *library = pnria_library_create();
+    ck_assert_ptr_ne(library, NULL);
+    ck_assert_int_eq(pnria_library_add_directory(library, PNRIA_ROMS_DIR), 23);
+    ck_assert_int_eq(pnria_library_size(library), 23);
+    ck_assert_int_eq(pnria_library_add_directory(library, "missing directory"), -1);
+
+    // the same rom however it's found
+    pnria_rom_t *rom = pnria_library_add(library, path);
+    ck_assert_ptr_ne(rom, NULL);
+    ck_assert_str_eq(pnria_rom_name(rom), "BRIX");
+    ck_assert_ptr_eq(pnria_library_find(library, pnria_rom_hash(rom)), rom);
+
+    unsigned char bytes[PNRIA_MEMORY_SIZE];
+    FILE *f = fopen(path, "rb");
+    size_t size = fread(bytes, 1, sizeof(bytes), f);
+    fclose(f);
+    ck_assert_uint_eq(pnria_rom_size(rom), size);
+    ck_assert_ptr_eq(pnria_library_add_buffer(library, "copy", bytes, size), rom);
+    ck_assert_int_eq(pnria_library_size(library), 23);
+    ck_assert_ptr_eq(pnria_library_add(library, "missing rom"), NULL);
+
+    // plays the same as the file, and states move between them
+    pnria_ctx_t *ctx = pnria_create();
+    pnria_ctx_t *other = pnria_create();
+    pnria_ctx_set_seed(ctx, 5);
+    pnria_ctx_set_seed(other, 5);
+    pnria_ctx_load_rom(ctx, rom);
+    ck_assert(pnria_ctx_load(other, path));
+    pnria_state_t fresh = pnria_ctx_get_state(ctx);
+    pnria_state_t a = run_keys(ctx, 200, 0);
+    pnria_state_t b = run_keys(other, 200, 0);
+    assert_same_state(&a, &b);
+
+    unsigned char buffer[PNRIA_SAVE_STATE_MAX_SIZE];
+    size_t stateSize = pnria_save_state(other, buffer, sizeof(buffer));
+    ck_assert(pnria_load_state(ctx, buffer, stateSize));
+
+    // restarting puts back what the session wrote, and loading a file over
+    // it leaves the library's image alone
+    pnria_ctx_load_rom(ctx, pnria_library_get(library, 0));
+    ck_assert(pnria_ctx_load(ctx, TEST_ROM_NAME));
+    pnria_ctx_load_rom(ctx, rom);
+    a = pnria_ctx_get_state(ctx);
+    assert_same_state(&fresh, &a);
+    ck_assert_int_eq(pnria_ctx_get_cycles_per_frame(ctx), PNRIA_CYCLES_PER_FRAME);
+
+    pnria_rom_set_cycles_per_frame(rom, 7);
+    pnria_ctx_load_rom(ctx, rom);
+    ck_assert_int_eq(pnria_rom_get_cycles_per_frame(rom), 7);
+    ck_assert_int_eq(pnria_ctx_get_cycles_per_frame(ctx), 7);
+
+    // jobs run library roms at their cycles per frame
+    pnria_pool_t *pool = pnria_pool_create(1);
+    pool_result_t result = { 0 };
+    pnria_job_t job = { .libraryRom = rom, .frames = 100, .done = pool_job_done, .userData = &result };
+    ck_assert(pnria_pool_submit(pool, &job));
+    pnria_pool_destroy(pool);
+    ck_assert(result.loaded);
+
+    pnria_ctx_set_seed(other, 0);
+    pnria_ctx_set_cycles_per_frame(other, 7);
+    pnria_ctx_init(other);
+    ck_assert(pnria_ctx_load(other, path));
+    for (int frame = 0; frame < 100; ++frame) {
+        pnria_run_frame(other);
+    }
+    b = pnria_ctx_get_state(other);
+    assert_same_state(&result.state, &b);
+
+    pnria_destroy(other);
+    pnria_destroy(ctx);
+    pnria_library_destroy(library);
+}
+END_TEST
+
+START_TEST (restart_test)
+{
+    const char *path = rom_path("BRIX");
+
+    pnria_backend_t backends[] = { PNRIA_BACKEND_TABLE, PNRIA_BACKEND_THREADED, PNRIA_BACKEND_JIT };
+    for (size_t b = 0; b < sizeof(backends) / sizeof(backends[0]); ++b) {
+        pnria_ctx_t *ctx = pnria_create();
+        pnria_ctx_set_backend(ctx, backends[b]);
+        pnria_ctx_set_seed(ctx, 3);
+        ck_assert(pnria_ctx_load(ctx, path));
+        pnria_state_t fresh = pnria_ctx_get_state(ctx);
+        pnria_state_t first = run_keys(ctx, 300, 0);
+
+        // every session plays the same, forks taken in one still restore
+        pnria_fork_t *fork = pnria_fork_create(ctx);
+        for (int session = 0; session < 3; ++session) {
+            pnria_ctx_restart(ctx);
+            pnria_state_t state = pnria_ctx_get_state(ctx);
+            assert_same_state(&fresh, &state);
+            ck_assert_int_eq(pnria_ctx_get_frame(ctx), 0);
+
+            state = run_keys(ctx, 300, 0);
+            assert_same_state(&first, &state);
+            run_keys(ctx, 100, session);
+        }
+        pnria_fork_restore(fork, ctx);
+        pnria_state_t state = pnria_ctx_get_state(ctx);
+        assert_same_state(&first, &state);
+        pnria_fork_destroy(fork);
+
+        // and restart the rom loaded last
+        pnria_ctx_init(ctx);
+        ck_assert(pnria_ctx_load(ctx, TEST_ROM_NAME));
+        fresh = pnria_ctx_get_state(ctx);
+        run_keys(ctx, 10, 0);
+        pnria_ctx_restart(ctx);
+        state = pnria_ctx_get_state(ctx);
+        assert_same_state(&fresh, &state);
+
+        pnria_destroy(ctx);
+    }
+}
+END_TEST
+
+START_TEST (profile_test)
+{
+    LOAD_ROM(
+        0x2206, // call 0x206
+        0xF30A, // wait for a key
+        0x1204,
+        0x6001, // V[0] = 1
+        0x00EE
+    );
+
+    pnria_ctx_t *ctx = pnria_create();
+    ck_assert(pnria_ctx_load(ctx, TEST_ROM_NAME));
+    pnria_profile_t *profile = pnria_profile_create();
+    ck_assert_ptr_ne(profile, NULL);
+
+    // built without the profiler, nothing is counted
+    if (!pnria_ctx_set_profile(ctx, profile)) {
+        pnria_run_cycles(ctx, 10);
+        ck_assert_uint_eq(pnria_profile_cycles(profile), 0);
+        pnria_profile_destroy(profile);
+        pnria_destroy(ctx);
+        return;
+    }
+
+    pnria_run_cycles(ctx, 10);
+    ck_assert_uint_eq(pnria_profile_cycles(profile), 10);
+    ck_assert_uint_eq(pnria_profile_opcode_count(profile, 0x2000), 1);
+    ck_assert_uint_eq(pnria_profile_opcode_count(profile, 0x6A7F), 1);
+    ck_assert_uint_eq(pnria_profile_opcode_count(profile, 0xF00A), 7);
+    ck_assert_uint_eq(pnria_profile_opcode_count(profile, 0x8124), 0);
+    ck_assert_uint_eq(pnria_profile_address_count(profile, 0x202), 7);
+    ck_assert_uint_eq(pnria_profile_address_count(profile, 0x204), 0);
+    ck_assert_uint_eq(pnria_profile_key_wait_cycles(profile), 7);
+
+    char keys[16] = { [5] = 1 };
+    pnria_ctx_set_input(ctx, keys);
+    pnria_run_cycles(ctx, 2);
+    ck_assert_uint_eq(pnria_profile_opcode_count(profile, 0xF00A), 8);
+    ck_assert_uint_eq(pnria_profile_address_count(profile, 0x204), 1);
+    ck_assert_uint_eq(pnria_profile_key_wait_cycles(profile), 7);
+
+    // the subroutine runs 6001 and 00EE, the rest runs in main
+    const char *file = "test-profile.folded";
+    ck_assert(pnria_profile_save_folded(profile, file));
+    char folded[256] = { 0 };
+    FILE *in = fopen(file, "r");
+    ck_assert_ptr_ne(in, NULL);
+    size_t size = fread(folded, 1, sizeof(folded) - 1, in);
+    fclose(in);
+    remove(file);
+    ck_assert_uint_gt(size, 0);
+    ck_assert_ptr_ne(strstr(folded, "main 10\n"), NULL);
+    ck_assert_ptr_ne(strstr(folded, "main;0x206 2\n"), NULL);
+
+    ck_assert(pnria_profile_save_json(profile, "test-profile.json"));
+    remove("test-profile.json");
+
+    pnria_profile_clear(profile);
+    ck_assert_uint_eq(pnria_profile_cycles(profile), 0);
+    ck_assert_uint_eq(pnria_profile_address_count(profile, 0x202), 0);
+
+    // profiling doesn't change what runs
+    const char *path = rom_path("BRIX");
+    pnria_ctx_t *plain = pnria_create();
+    pnria_ctx_set_backend(plain, PNRIA_BACKEND_THREADED);
+    ck_assert(pnria_ctx_load(plain, path));
+    pnria_ctx_init(ctx);
+    ck_assert(pnria_ctx_load(ctx, path));
+    pnria_state_t profiled = run_keys(ctx, 300, 0);
+    pnria_state_t expected = run_keys(plain, 300, 0);
+    assert_same_state(&profiled, &expected);
+    ck_assert_uint_eq(pnria_profile_cycles(profile), 300 * PNRIA_CYCLES_PER_FRAME);
+
+    pnria_ctx_set_profile(ctx, NULL);
+    pnria_run_frame(ctx);
+    ck_assert_uint_eq(pnria_profile_cycles(profile), 300 * PNRIA_CYCLES_PER_FRAME);
+
+    pnria_profile_destroy(profile);
+    pnria_destroy(plain);
+    pnria_destroy(ctx);
+}
+END_TEST
+
+START_TEST (rewind_test)
+{
+    enum { FRAMES = 300 };
+    const char *path = rom_path("INVADERS");
+
+    pnria_ctx_t *ctx = pnria_create();
+    ck_assert(pnria_ctx_load(ctx, path));
+    pnria_state_t *states = malloc(FRAMES * sizeof(pnria_state_t));
+
+    pnria_rewind_t *rewind = pnria_rewind_create(64 * 1024, 10);
+    pnria_rewind_t *small = pnria_rewind_create(8 * 1024, 0);
+    ck_assert_ptr_ne(rewind, NULL);
+    ck_assert_ptr_ne(small, NULL);
+
+    for (int frame = 0; frame < FRAMES; ++frame) {
+        char keys[16] = { 0 };
+        keys[frame / 20 % 16] = 1;
+        pnria_ctx_set_input(ctx, keys);
+        pnria_run_frame(ctx);
+        states[frame] = pnria_ctx_get_state(ctx);
+        ck_assert(pnria_rewind_push(rewind, ctx));
+        ck_assert(pnria_rewind_push(small, ctx));
+    }
+
+    // every frame kept in far less than a snapshot per frame
+    ck_assert_int_eq(pnria_rewind_frames(rewind), FRAMES);
+    ck_assert_uint_lt(pnria_rewind_bytes(rewind), FRAMES * sizeof(pnria_state_t) / 10);
+    for (int age = 0; age < FRAMES; age += 7) {
+        ck_assert(pnria_rewind_restore(rewind, ctx, age));
+        pnria_state_t state = pnria_ctx_get_state(ctx);
+        assert_same_state(&states[FRAMES - 1 - age], &state);
+    }
+    ck_assert(!pnria_rewind_restore(rewind, ctx, FRAMES));
+
+    // the oldest frames were dropped from the small one, the rest still restore
+    int kept = pnria_rewind_frames(small);
+    ck_assert_int_lt(kept, FRAMES);
+    ck_assert_int_gt(kept, 10);
+    // everything the history takes, frames and what indexes them, within
+    // the size it was created with
+    ck_assert_uint_le(pnria_rewind_bytes(small), 8 * 1024);
+    ck_assert(pnria_rewind_restore(small, ctx, kept - 1));
+    pnria_state_t state = pnria_ctx_get_state(ctx);
+    assert_same_state(&states[FRAMES - kept], &state);
+
+    // stepping back, then branching from there
+    pnria_rewind_restore(rewind, ctx, 0);
+    for (int frame = FRAMES - 2; frame >= FRAMES - 50; --frame) {
+        ck_assert(pnria_rewind_back(rewind, ctx));
+        state = pnria_ctx_get_state(ctx);
+        assert_same_state(&states[frame], &state);
+    }
+    ck_assert_int_eq(pnria_rewind_frames(rewind), FRAMES - 49);
+
+    pnria_run_frame(ctx);
+    pnria_state_t branch = pnria_ctx_get_state(ctx);
+    ck_assert(pnria_rewind_push(rewind, ctx));
+    ck_assert(pnria_rewind_back(rewind, ctx));
+    state = pnria_ctx_get_state(ctx);
+    assert_same_state(&states[FRAMES - 50], &state);
+    ck_assert(pnria_rewind_push(rewind, ctx));
+    pnria_run_frame(ctx);
+    ck_assert(pnria_rewind_push(rewind, ctx));
+    ck_assert(pnria_rewind_restore(rewind, ctx, 0));
+    state = pnria_ctx_get_state(ctx);
+    assert_same_state(&branch, &state);
+
+    pnria_rewind_clear(rewind);
+    ck_assert_int_eq(pnria_rewind_frames(rewind), 0);
+    ck_assert(!pnria_rewind_back(rewind, ctx));
+
+    pnria_rewind_t *tiny = pnria_rewind_create(100, 0);
+    ck_assert(!pnria_rewind_push(tiny, ctx));
+    pnria_rewind_destroy(tiny);
+
+    // going back from after self modifying code ran
+    load_self_modifying_rom();
+    pnria_ctx_init(ctx);
+    pnria_ctx_set_backend(ctx, PNRIA_BACKEND_THREADED);
+    ck_assert(pnria_ctx_load(ctx, TEST_ROM_NAME));
+    ck_assert(pnria_rewind_push(rewind, ctx));
+    pnria_run_cycles(ctx, 9);
+    ck_assert(pnria_rewind_push(rewind, ctx));
+    ck_assert_uint_eq(pnria_ctx_get_state(ctx).V[0], 0x77);
+    ck_assert(pnria_rewind_back(rewind, ctx));
+    pnria_run_cycles(ctx, 1);
+    ck_assert_uint_eq(pnria_ctx_get_state(ctx).V[0xA], 1);
+
+    pnria_rewind_destroy(small);
+    pnria_rewind_destroy(rewind);
+    free(states);
+    pnria_destroy(ctx);
+}
+END_TEST
+
+START_TEST (fork_test)
+{
+    const char *path = rom_path("INVADERS");
+
+    pnria_ctx_t *ctx = pnria_create();
+    pnria_ctx_t *other = pnria_create();
+    ck_assert(pnria_ctx_load(ctx, path));
+    ck_assert(pnria_ctx_load(other, path));
+
+    char keys[16] = { 0 };
+    keys[5] = 1;
+    pnria_ctx_set_input(ctx, keys);
+    for (int frame = 0; frame < 200; ++frame) {
+        pnria_run_frame(ctx);
+    }
+    pnria_run_cycles(ctx, 3);
+    pnria_fork_t *first = pnria_fork_create(ctx);
+    ck_assert_ptr_ne(first, NULL);
+    pnria_state_t firstState = pnria_ctx_get_state(ctx);
+
+    for (int frame = 0; frame < 100; ++frame) {
+        pnria_run_frame(ctx);
+    }
+    pnria_fork_t *second = pnria_fork_create(ctx);
+    ck_assert_ptr_ne(second, NULL);
+    pnria_state_t secondState = pnria_ctx_get_state(ctx);
+
+    // back and forth between forks, in the same and in another context
+    pnria_state_t state;
+    for (int i = 0; i < 2; ++i) {
+        pnria_fork_restore(first, ctx);
+        state = pnria_ctx_get_state(ctx);
+        assert_same_state(&firstState, &state);
+        ck_assert_uint_eq(pnria_ctx_get_dirty_rows(ctx), 0xFFFFFFFF);
+
+        pnria_fork_restore(second, ctx);
+        state = pnria_ctx_get_state(ctx);
+        assert_same_state(&secondState, &state);
+    }
+
+    pnria_fork_restore(first, other);
+    state = pnria_ctx_get_state(other);
+    assert_same_state(&firstState, &state);
+
+    // forks outlive the context they were taken from
+    pnria_destroy(ctx);
+    pnria_fork_restore(second, other);
+    state = pnria_ctx_get_state(other);
+    assert_same_state(&secondState, &state);
+    pnria_fork_destroy(second);
+    pnria_fork_destroy(first);
+
+    // writes after the fork don't reach it, and the instructions decoded from
+    // them are dropped on restore
+    load_self_modifying_rom();
+    for (int b = 0; b < 3; ++b) {
+        pnria_backend_t backend = (pnria_backend_t[]) {
+            PNRIA_BACKEND_TABLE, PNRIA_BACKEND_THREADED, PNRIA_BACKEND_JIT
+        }[b];
+        pnria_ctx_init(other);
+        pnria_ctx_set_backend(other, backend);
+        ck_assert(pnria_ctx_load(other, TEST_ROM_NAME));
+
+        pnria_fork_t *fork = pnria_fork_create(other);
+        pnria_run_cycles(other, 9);
+        ck_assert_uint_eq(pnria_ctx_get_state(other).V[0], 0x77);
+
+        pnria_fork_t *modified = pnria_fork_create(other);
+        pnria_fork_restore(fork, other);
+        ck_assert_uint_eq(pnria_ctx_get_state(other).memory[PNRIA_START_OFFSET], 0x7A);
+        pnria_run_cycles(other, 1);
+        ck_assert_uint_eq(pnria_ctx_get_state(other).V[0xA], 1);
+
+        pnria_fork_restore(modified, other);
+        ck_assert_uint_eq(pnria_ctx_get_state(other).memory[PNRIA_START_OFFSET], 0x60);
+        pnria_fork_destroy(modified);
+        pnria_fork_destroy(fork);
+    }
+
+    pnria_destroy(other);
+}
+END_TEST
+
+START_TEST (decode_cache_test)
+{
+    // self modifying code, rewrites the first instruction and runs it again
+    load_self_modifying_rom();
+
+    pnria_state_t state = run_on_backend(PNRIA_BACKEND_THREADED, 9);
+    ck_assert_uint_eq(state.V[0], 0x77);
+    ck_assert_uint_eq(state.V[0xA], 1);
+
+    // same, storing the BCD of 0x70 (112) over 0x7A01 turning it into
+    // 0x0101, an unknown instruction
+    LOAD_ROM(
+        0x7A01,
+        0x3A02,
+        0x1208,
+        0x1206,
+        0x6070,
+        0xA200,
+        0xF033,
+        0x1200
+    );
+
+    state = run_on_backend(PNRIA_BACKEND_THREADED, 8);
+    ck_assert_uint_eq(state.PC, PNRIA_START_OFFSET + PNRIA_OPCODE_SIZE);
+    ck_assert_uint_eq(state.V[0xA], 1);
+
+    // odd aligned instructions share the cache entry of the even address
+    // below them
+    LOAD_ROM(
+        0x6001,
+        0x1205, // jumps to 0x7005, add 5 to V[0]
+        0x6170, // 0x1204 jumps back here, load 0x70 into V[1]
+        0x0512,
+        0x0401,
+        0x1200
+    );
+
+    state = run_on_backend(PNRIA_BACKEND_THREADED, 13);
+    ck_assert_uint_eq(state.V[0], 6);
+    ck_assert_uint_eq(state.V[1], 0x70);
+    ck_assert_uint_eq(state.PC, 0x206);
+}
+END_TEST
+
+START_TEST (jit_backend_test)
+{
+    differential_test(PNRIA_BACKEND_JIT);
+
+    // self modifying code must drop the translated blocks
+    load_self_modifying_rom();
+
+    pnria_state_t state = run_on_backend(PNRIA_BACKEND_JIT, 9);
+    ck_assert_uint_eq(state.V[0], 0x77);
+    ck_assert_uint_eq(state.V[0xA], 1);
+
+    // a loop of translated instructions stopped by the cycle budget, with the
+    // timers running
+    LOAD_ROM(
+        0x603C, // V[0] = 60
+        0xF015, // delay = V[0]
+        0x7101, // V[1] += 1
+        0x8214, // V[2] += V[1]
+        0x1204
+    );
+
+    pnria_ctx_t *ctx = pnria_create();
+    pnria_ctx_set_backend(ctx, PNRIA_BACKEND_JIT);
+    ck_assert(pnria_ctx_load(ctx, TEST_ROM_NAME));
+    pnria_run_cycles(ctx, 32);
+    state = pnria_ctx_get_state(ctx);
+    ck_assert_uint_eq(state.V[1], 10);
+    ck_assert_uint_eq(state.V[2], 55);
+    ck_assert_uint_eq(state.delay, 60 - 3);
+    ck_assert_uint_eq(state.PC, 0x204);
+    pnria_destroy(ctx);
 }
 END_TEST
 
@@ -493,8 +1656,8 @@ START_TEST (test_fx15)
         0x6051, 0xF015
     );
 
-    // delay decreases in the cycle
-    ck_assert_uint_eq(state.delay, 0x50);
+    // the timers only tick at the end of the frame
+    ck_assert_uint_eq(state.delay, 0x51);
 }
 END_TEST
 
@@ -505,8 +1668,8 @@ START_TEST (test_fx07)
         0x6051, 0xF015, 0xF007
     );
 
-    ck_assert_uint_eq(state.V[0], 0x50);
-    ck_assert_uint_eq(state.delay, 0x4F);
+    ck_assert_uint_eq(state.V[0], 0x51);
+    ck_assert_uint_eq(state.delay, 0x51);
 }
 END_TEST
 
@@ -517,7 +1680,7 @@ START_TEST (test_fx18)
         0x6051, 0xF018
     );
 
-    ck_assert_uint_eq(state.sound, 0x50);
+    ck_assert_uint_eq(state.sound, 0x51);
 }
 END_TEST
 
@@ -532,6 +1695,208 @@ START_TEST (test_fx1e)
 }
 END_TEST
 
+START_TEST (frame_timers_test)
+{
+    LOAD_ROM(
+        0x6051, 0xF015, 0xF018,
+        0xF107,
+        0x1206
+    );
+
+    // the timers tick once every PNRIA_CYCLES_PER_FRAME instructions
+    for (int i = 0; i < PNRIA_CYCLES_PER_FRAME - 1; ++i) {
+        pnria_cycle();
+    }
+    pnria_state_t state = pnria_get_state();
+    ck_assert_uint_eq(state.delay, 0x51);
+    ck_assert_uint_eq(state.V[1], 0x51);
+
+    pnria_cycle();
+    state = pnria_get_state();
+    ck_assert_uint_eq(state.delay, 0x50);
+    ck_assert_uint_eq(state.sound, 0x50);
+
+    // running frames gives the same state as running their cycles
+    pnria_ctx_t *frames = pnria_create();
+    pnria_ctx_t *cycles = pnria_create();
+    pnria_ctx_set_cycles_per_frame(frames, 7);
+    pnria_ctx_set_cycles_per_frame(cycles, 7);
+    ck_assert_int_eq(pnria_ctx_get_cycles_per_frame(frames), 7);
+    ck_assert(pnria_ctx_load(frames, TEST_ROM_NAME));
+    ck_assert(pnria_ctx_load(cycles, TEST_ROM_NAME));
+
+    pnria_run_cycles(cycles, 3);
+    pnria_run_frame(frames);
+    for (int i = 0; i < 10; ++i) {
+        pnria_run_frame(frames);
+    }
+    pnria_run_cycles(cycles, 4 + 7 * 10);
+
+    pnria_state_t a = pnria_ctx_get_state(frames);
+    pnria_state_t b = pnria_ctx_get_state(cycles);
+    assert_same_state(&a, &b);
+    ck_assert_uint_eq(a.delay, 0x51 - 11);
+
+    // a frame started by one run continues in the next
+    pnria_run_cycles(cycles, 2);
+    pnria_run_frame(cycles);
+    b = pnria_ctx_get_state(cycles);
+    ck_assert_uint_eq(b.delay, 0x51 - 12);
+
+    pnria_destroy(frames);
+    pnria_destroy(cycles);
+}
+END_TEST
+
+START_TEST (test_dxyn)
+{
+    // the 0 from the fontset at 0, 0
+    pnria_state_t state = EXECUTE_INSTRUCTION(0xD005);
+
+    ck_assert_uint_eq(state.V[0xF], 0);
+    ck_assert(state.screen[0] == 0xF000000000000000);
+    ck_assert(state.screen[1] == 0x9000000000000000);
+    ck_assert(state.screen[4] == 0xF000000000000000);
+    ck_assert(state.screen[5] == 0);
+
+    unsigned char *screen = pnria_get_screen();
+    ck_assert_uint_eq(screen[0], 1);
+    ck_assert_uint_eq(screen[3], 1);
+    ck_assert_uint_eq(screen[4], 0);
+    ck_assert_uint_eq(screen[PNRIA_SCREEN_WIDTH], 1);
+    ck_assert_uint_eq(screen[PNRIA_SCREEN_WIDTH + 1], 0);
+    ck_assert_uint_eq(screen[PNRIA_SCREEN_WIDTH + 3], 1);
+
+    // drawing it again erases it and collides
+    state = EXECUTE_INSTRUCTIONS(2, 0xD005, 0xD005);
+
+    ck_assert_uint_eq(state.V[0xF], 1);
+    for (int row = 0; row < PNRIA_SCREEN_HEIGHT; ++row) {
+        ck_assert(state.screen[row] == 0);
+    }
+
+    // pixels past the right edge continue on the next row
+    state = EXECUTE_INSTRUCTIONS(2, 0x603E, 0xD011);
+
+    ck_assert(state.screen[0] == 0x3);
+    ck_assert(state.screen[1] == 0xC000000000000000);
+
+    // rows past the bottom are clipped
+    state = EXECUTE_INSTRUCTIONS(2, 0x611E, 0xD015);
+
+    ck_assert(state.screen[30] == 0xF000000000000000);
+    ck_assert(state.screen[31] == 0x9000000000000000);
+    ck_assert(state.screen[0] == 0);
+}
+END_TEST
+
+START_TEST (screen_tracking_test)
+{
+    LOAD_ROM(
+        0x603C, 0x6102,
+        0xD015, // the 0 from the fontset at 60, 2
+        0x00E0,
+        0x00E0  // clearing a blank screen changes nothing
+    );
+    pnria_clear_dirty();
+    unsigned long generation = pnria_get_screen_generation();
+
+    int x, y, width, height;
+    pnria_cycle(); pnria_cycle();
+    ck_assert_uint_eq(pnria_get_screen_generation(), generation);
+    ck_assert(!pnria_get_dirty_rect(&x, &y, &width, &height));
+
+    pnria_cycle();
+    ck_assert_uint_eq(pnria_get_screen_generation(), generation + 1);
+    ck_assert_uint_eq(pnria_get_dirty_rows(), 0x7C);
+    ck_assert(pnria_get_dirty_rect(&x, &y, &width, &height));
+    ck_assert_int_eq(x, 60);
+    ck_assert_int_eq(y, 2);
+    ck_assert_int_eq(width, 4);
+    ck_assert_int_eq(height, 5);
+    ck_assert_uint_eq(pnria_get_screen()[2 * PNRIA_SCREEN_WIDTH + 60], 1);
+
+    pnria_clear_dirty();
+    ck_assert_uint_eq(pnria_get_dirty_rows(), 0);
+
+    pnria_cycle();
+    ck_assert_uint_eq(pnria_get_screen_generation(), generation + 2);
+    ck_assert_uint_eq(pnria_get_dirty_rows(), 0x7C);
+    ck_assert_uint_eq(pnria_get_screen()[2 * PNRIA_SCREEN_WIDTH + 60], 0);
+
+    pnria_cycle();
+    ck_assert_uint_eq(pnria_get_screen_generation(), generation + 2);
+}
+END_TEST
+
+START_TEST (screen_export_test)
+{
+    const char *path = rom_path("BRIX");
+
+    pnria_ctx_t *ctx = pnria_create();
+    ck_assert(pnria_ctx_load(ctx, path));
+    run_keys(ctx, 100, 0);
+
+    const pnria_state_t *view = pnria_ctx_view_state(ctx);
+    ck_assert_uint_eq(pnria_ctx_get_pc(ctx), view->PC);
+    ck_assert_uint_eq(pnria_ctx_get_i(ctx), view->I);
+    ck_assert_uint_eq(pnria_ctx_get_opcode(ctx), view->opcode);
+    ck_assert_uint_eq(pnria_ctx_get_register(ctx, 0xA), view->V[0xA]);
+    ck_assert_uint_eq(pnria_ctx_get_delay(ctx), view->delay);
+    ck_assert_uint_eq(pnria_ctx_get_sound(ctx), view->sound);
+    const unsigned char *screen = pnria_ctx_get_screen(ctx);
+
+    // every format and scale, rows padded past the pixels
+    static unsigned char pixels[PNRIA_SCREEN_SIZE * 4 * 9 + 3 * PNRIA_SCREEN_HEIGHT * 3];
+    pnria_pixel_format_t formats[] = { PNRIA_PIXELS_RGBA, PNRIA_PIXELS_BYTE, PNRIA_PIXELS_BIT };
+    int sizes[] = { 4, 1, 0 };
+    for (int f = 0; f < 3; ++f) {
+        for (int scale = 1; scale <= 3; ++scale) {
+            size_t lineSize = sizes[f] ? PNRIA_SCREEN_WIDTH * scale * sizes[f] : 8 * scale;
+            pnria_framebuffer_t framebuffer = {
+                .pixels = pixels, .format = formats[f], .scale = scale,
+                .pitch = lineSize + 3, .palette = { 0x10203040, 0xA0B0C0D0 }
+            };
+            memset(pixels, 0xEE, sizeof(pixels));
+            ck_assert(pnria_ctx_export_screen(ctx, &framebuffer, UINT32_MAX));
+
+            for (int y = 0; y < PNRIA_SCREEN_HEIGHT * scale; ++y) {
+                const unsigned char *line = pixels + y * framebuffer.pitch;
+                for (int x = 0; x < PNRIA_SCREEN_WIDTH * scale; ++x) {
+                    int set = screen[(y / scale) * PNRIA_SCREEN_WIDTH + x / scale];
+                    if (formats[f] == PNRIA_PIXELS_RGBA) {
+                        ck_assert_uint_eq(line[x * 4], set ? 0xA0 : 0x10);
+                        ck_assert_uint_eq(line[x * 4 + 3], set ? 0xD0 : 0x40);
+                    } else if (formats[f] == PNRIA_PIXELS_BYTE) {
+                        ck_assert_uint_eq(line[x], set ? 0xD0 : 0x40);
+                    } else {
+                        ck_assert_int_eq((line[x / 8] >> (7 - x % 8)) & 1, set);
+                    }
+                }
+                ck_assert_uint_eq(line[lineSize], 0xEE);
+            }
+        }
+    }
+
+    // only the rows asked for are written
+    pnria_framebuffer_t framebuffer = { .pixels = pixels, .format = PNRIA_PIXELS_BYTE, .scale = 1,
+                                        .palette = { 2, 3 } };
+    memset(pixels, 0xEE, sizeof(pixels));
+    ck_assert(pnria_ctx_export_screen(ctx, &framebuffer, 0x5));
+    for (int y = 0; y < 4; ++y) {
+        ck_assert_uint_eq(pixels[y * PNRIA_SCREEN_WIDTH], y == 0 || y == 2 ? 2 + screen[y * PNRIA_SCREEN_WIDTH] : 0xEE);
+    }
+
+    framebuffer.scale = 0;
+    ck_assert(!pnria_ctx_export_screen(ctx, &framebuffer, UINT32_MAX));
+    framebuffer.scale = 2;
+    framebuffer.pitch = 10;
+    ck_assert(!pnria_ctx_export_screen(ctx, &framebuffer, UINT32_MAX));
+
+    pnria_destroy(ctx);
+}
+END_TEST
+
 START_TEST (test_fx55)
 {
     pnria_state_t state = EXECUTE_INSTRUCTIONS(
@@ -594,9 +1959,25 @@ Suite *panaroia_suite()
     TCase *core = tcase_create("Core");
 
     // lib interface
+    tcase_add_test(core, default_load_test);
     tcase_add_test(core, init_state_test);
     tcase_add_test(core, reset_state_test);
     tcase_add_test(core, load_test);
+    tcase_add_test(core, context_test);
+    tcase_add_test(core, threaded_backend_test);
+    tcase_add_test(core, decode_cache_test);
+    tcase_add_test(core, jit_backend_test);
+    tcase_add_test(core, frame_timers_test);
+    tcase_add_test(core, batch_test);
+    tcase_add_test(core, pool_test);
+    tcase_add_test(core, seed_test);
+    tcase_add_test(core, save_state_test);
+    tcase_add_test(core, rewind_test);
+    tcase_add_test(core, fork_test);
+    tcase_add_test(core, recording_test);
+    tcase_add_test(core, library_test);
+    tcase_add_test(core, restart_test);
+    tcase_add_test(core, profile_test);
 
     // TODO 0xe0
     // TODO 0xee
@@ -635,7 +2016,9 @@ Suite *panaroia_suite()
 
     // TODO fx29
 
-    // TODO dxy0
+    tcase_add_test(core, test_dxyn);
+    tcase_add_test(core, screen_tracking_test);
+    tcase_add_test(core, screen_export_test);
 
     tcase_add_test(core, test_fx55);
     tcase_add_test(core, test_fx65);